@@ -10,6 +10,7 @@
 //-----------------------------------------------------------------------
 
 #define RVTEST_RV32U                                                    
+#define RVTEST_RV64U                                                    
 
 #define RVTEST_CODE_BEGIN                                               \
         .text;                                                          \
@@ -32,6 +33,21 @@ _start:
         la tmp_reg, 0x0001000A;                                         \
         csrw mtohost, tmp_reg
 
+#if __riscv_xlen == 64
+// Only the low 32 bits are printed
+#define PRINT_INT(arg_reg, tmp_reg_1, tmp_reg_2)                        \
+        slli tmp_reg_1, arg_reg, 48;                                    \
+        srli tmp_reg_1, tmp_reg_1, 48;                                  \
+        la tmp_reg_2, 0x00020000;                                       \
+        or tmp_reg_2, tmp_reg_1, tmp_reg_2;                             \
+        csrw mtohost, tmp_reg_2;                                        \
+        slli tmp_reg_1, arg_reg, 32;                                    \
+        srli tmp_reg_1, tmp_reg_1, 48;                                  \
+        la tmp_reg_2, 0x00030000;                                       \
+        or tmp_reg_2, tmp_reg_1, tmp_reg_2;                             \
+        csrw mtohost, tmp_reg_2                                         \
+
+#else
 #define PRINT_INT(arg_reg, tmp_reg_1, tmp_reg_2)                        \
         slli tmp_reg_1, arg_reg, 16;                                    \
         srli tmp_reg_1, tmp_reg_1, 16;                                  \
@@ -43,6 +59,8 @@ _start:
         or tmp_reg_2, tmp_reg_1, tmp_reg_2;                             \
         csrw mtohost, tmp_reg_2                                         \
 
+#endif
+
 //-----------------------------------------------------------------------
 // End Macro (return value in TESTNUM)
 // TESTNUM always < 65536 here, so no need to set ExitCode on MSB
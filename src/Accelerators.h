@@ -0,0 +1,70 @@
+#ifndef RISCV_SIM_ACCELERATORS_H
+#define RISCV_SIM_ACCELERATORS_H
+
+#include "CustomUnit.h"
+
+// Accelerators being prototyped, as custom-0 and custom-1 instructions. Add new ones to
+// RegisterAccelerators; the latencies are estimates for the planned hardware.
+//
+//   crc32.b   custom-0, funct3 0, funct7 0: rd = CRC-32 of the low byte of rs2, continuing from rs1
+//   crc32.w   custom-0, funct3 0, funct7 1: the same over the low four bytes of rs2, lowest first
+//   hash.mix  custom-0, funct3 1, funct7 0: rd = MurmurHash3 finaliser of rs1 ^ rs2, 32 bits
+//   crc32.lw  custom-1, funct3 0, funct7 0: crc32.w of the word at address rs2
+//
+// The CRC is the reflected IEEE one without the final inversion, so a caller starts from
+// 0xffffffff and inverts the result.
+namespace Accelerators
+{
+    inline uint32_t Crc32(uint32_t crc, uint32_t data, unsigned bytes)
+    {
+        for (unsigned i = 0; i < 8 * bytes; ++i) {
+            uint32_t bit = (crc ^ (data >> i)) & 1u;
+            crc = (crc >> 1u) ^ (bit ? 0xedb88320u : 0u);
+        }
+        return crc;
+    }
+
+    inline uint32_t Mix(uint32_t h)
+    {
+        h ^= h >> 16u;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13u;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16u;
+        return h;
+    }
+}
+
+inline bool RegisterAccelerators(CustomExtensions& extensions)
+{
+    bool ok = true;
+    CustomInstruction crcByte;
+    crcByte.name = "crc32.b";
+    crcByte.function = [](Word rs1, Word rs2, CustomMemory&) { return Word(Accelerators::Crc32(rs1, rs2, 1)); };
+    ok &= extensions.Register(Opcode::Custom0, 0, 0, crcByte);
+
+    CustomInstruction crcWord;
+    crcWord.name = "crc32.w";
+    crcWord.function = [](Word rs1, Word rs2, CustomMemory&) { return Word(Accelerators::Crc32(rs1, rs2, 4)); };
+    crcWord.latency = 2;
+    ok &= extensions.Register(Opcode::Custom0, 0, 1, crcWord);
+
+    CustomInstruction mix;
+    mix.name = "hash.mix";
+    mix.function = [](Word rs1, Word rs2, CustomMemory&) { return Word(Accelerators::Mix(uint32_t(rs1 ^ rs2))); };
+    mix.latency = 3;
+    ok &= extensions.Register(Opcode::Custom0, 1, 0, mix);
+
+    CustomInstruction crcLoad;
+    crcLoad.name = "crc32.lw";
+    crcLoad.function = [](Word rs1, Word rs2, CustomMemory& mem) {
+        return Word(Accelerators::Crc32(rs1, mem.Load(MemFunc::W, rs2), 4));
+    };
+    crcLoad.latency = 5;
+    crcLoad.occupancy = 2;
+    crcLoad.accessesMemory = true;
+    ok &= extensions.Register(Opcode::Custom1, 0, 0, crcLoad);
+    return ok;
+}
+
+#endif //RISCV_SIM_ACCELERATORS_H
@@ -0,0 +1,39 @@
+#ifndef RISCV_SIM_BARRIER_H
+#define RISCV_SIM_BARRIER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Reusable barrier for a fixed set of threads; every Wait returns once all of them have arrived
+class Barrier
+{
+public:
+    explicit Barrier(size_t threads)
+        : _threads(threads)
+    {
+
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t generation = _generation;
+        if (++_arrived == _threads) {
+            _arrived = 0;
+            ++_generation;
+            _released.notify_all();
+            return;
+        }
+        _released.wait(lock, [&] { return generation != _generation; });
+    }
+
+private:
+    size_t _threads;
+    size_t _arrived = 0;
+    uint64_t _generation = 0;
+    std::mutex _mutex;
+    std::condition_variable _released;
+};
+
+#endif //RISCV_SIM_BARRIER_H
@@ -2,10 +2,47 @@
 #ifndef RISCV_SIM_BASETYPES_H
 #define RISCV_SIM_BASETYPES_H
 
-using Reg32 = uint32_t;
+#include <cstdint>
+
+// Register width of the simulated harts. The simulator is built once per XLEN (riscv_sim for
+// RV32, riscv_sim64 for RV64), so every component is compiled for one width and never checks it
+// at run time.
+#ifndef RISCV_SIM_XLEN
+#define RISCV_SIM_XLEN 32
+#endif
+
+template <unsigned Xlen>
+struct XlenTypes;
+
+template <>
+struct XlenTypes<32>
+{
+    using Word = uint32_t;
+    using SignedWord = int32_t;
+    using DoubleWord = uint64_t;        // full product of a multiply
+    using SignedDoubleWord = int64_t;
+};
+
+template <>
+struct XlenTypes<64>
+{
+    using Word = uint64_t;
+    using SignedWord = int64_t;
+    using DoubleWord = unsigned __int128;
+    using SignedDoubleWord = __int128;
+};
+
+constexpr unsigned XLEN = RISCV_SIM_XLEN;
+static_assert(XLEN == 32 || XLEN == 64, "RISCV_SIM_XLEN must be 32 or 64");
+
 using RId = uint16_t;
-using Word = uint32_t;
-using SignedWord = int32_t;
+using Word = XlenTypes<XLEN>::Word;
+using SignedWord = XlenTypes<XLEN>::SignedWord;
+using DoubleWord = XlenTypes<XLEN>::DoubleWord;
+using SignedDoubleWord = XlenTypes<XLEN>::SignedDoubleWord;
+
+// Memory is kept in words of XLEN bits
+constexpr Word wordBytes = sizeof(Word);
 
 enum class CpuToHostType : uint16_t
 {
@@ -0,0 +1,273 @@
+#ifndef RISCV_SIM_BRANCHPREDICTOR_H
+#define RISCV_SIM_BRANCHPREDICTOR_H
+
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "DirectionPredictor.h"
+#include "Instruction.h"
+
+enum class BranchKind : uint8_t
+{
+    Branch,
+    Jump,
+    Call,
+    Return,
+};
+
+// Direct mapped branch target buffer. It is the only thing fetch knows about an instruction
+// before decoding it, so it also records what kind of control transfer lives at an address.
+class Btb
+{
+public:
+    struct Entry
+    {
+        Word tag = 0;
+        Word target = 0;
+        BranchKind kind = BranchKind::Branch;
+        bool valid = false;
+    };
+
+    explicit Btb(size_t entries)
+        : _entries(entries)
+    {
+
+    }
+
+    const Entry* Find(Word ip) const
+    {
+        const Entry& e = _entries[Index(ip)];
+        return e.valid && e.tag == ip ? &e : nullptr;
+    }
+
+    void Update(Word ip, Word target, BranchKind kind)
+    {
+        _entries[Index(ip)] = Entry{ip, target, kind, true};
+    }
+
+private:
+    size_t Index(Word ip) const
+    {
+        return (ip >> 2u) & (_entries.size() - 1);
+    }
+
+    std::vector<Entry> _entries;
+};
+
+// Return address stack. It is updated when calls and returns resolve, so wrong-path
+// instructions never corrupt it; fetch only peeks at the top.
+class Ras
+{
+public:
+    explicit Ras(size_t entries)
+        : _capacity(entries)
+    {
+
+    }
+
+    std::optional<Word> Top() const
+    {
+        if (_stack.empty())
+            return std::nullopt;
+        return _stack.back();
+    }
+
+    void Push(Word ip)
+    {
+        if (_capacity == 0)
+            return;
+        if (_stack.size() == _capacity)
+            _stack.erase(_stack.begin());
+        _stack.push_back(ip);
+    }
+
+    void Pop()
+    {
+        if (!_stack.empty())
+            _stack.pop_back();
+    }
+
+private:
+    size_t _capacity;
+    std::vector<Word> _stack;
+};
+
+// What fetch guessed for an instruction, carried down the pipeline until it resolves
+struct Prediction
+{
+    Word nextIp = 0;
+    uint64_t history = 0;   // global history before this instruction
+};
+
+// Front end predictor: the BTB and RAS find control transfers and their targets, a
+// pluggable DirectionPredictor decides conditional branches. The global history is
+// updated speculatively at fetch and repaired when a misprediction resolves.
+class BranchPredictor
+{
+public:
+    explicit BranchPredictor(const PredictorConfig& config = PredictorConfig())
+        : _config(config)
+        , _direction(MakeDirectionPredictor(config))
+        , _btb(config.btbEntries)
+        , _ras(config.rasEntries)
+    {
+
+    }
+
+    // Guess for the instruction at ip, which is length bytes long
+    Prediction Predict(Word ip, Word length)
+    {
+        Prediction prediction{ip + length, _history};
+        const Btb::Entry* entry = _direction ? _btb.Find(ip) : nullptr;
+        if (entry == nullptr)
+            return prediction;
+
+        switch (entry->kind)
+        {
+            case BranchKind::Branch: {
+                bool taken = _direction->Predict(ip, _history);
+                _history = (_history << 1u) | uint64_t(taken);
+                if (taken)
+                    prediction.nextIp = entry->target;
+                break;
+            }
+            case BranchKind::Return: prediction.nextIp = _ras.Top().value_or(entry->target); break;
+            case BranchKind::Jump:
+            case BranchKind::Call: prediction.nextIp = entry->target; break;
+        }
+        return prediction;
+    }
+
+    // Rewinds the global history to just after a mispredicted instruction. Everything fetched
+    // after it is about to be squashed, along with the history bits it added.
+    void Recover(Word ip, const Instruction& instr, const Prediction& prediction)
+    {
+        if (instr._nextIp == prediction.nextIp)
+            return;
+        if (instr._type == IType::Br)
+            _history = (prediction.history << 1u) | uint64_t(instr._nextIp != ip + instr._length);
+        else
+            _history = prediction.history;
+    }
+
+    // Trains the tables with a resolved control transfer and records whether its prediction held.
+    // Cores call it in program order; Recover may come earlier, as soon as the outcome is known.
+    void Update(Word ip, const Instruction& instr, const Prediction& prediction)
+    {
+        if (instr._type != IType::Br && instr._type != IType::J && instr._type != IType::Jr)
+            return;
+
+        BranchKind kind = Classify(instr);
+        bool taken = instr._nextIp != ip + instr._length;
+        bool correct = instr._nextIp == prediction.nextIp;
+
+        if (_direction) {
+            if (kind == BranchKind::Branch)
+                _direction->Update(ip, prediction.history, taken);
+            if (taken)
+                _btb.Update(ip, instr._nextIp, kind);
+            if (kind == BranchKind::Call)
+                _ras.Push(ip + instr._length);
+            else if (kind == BranchKind::Return)
+                _ras.Pop();
+        }
+
+        Stats& pc = _perPc[ip];
+        pc.kind = kind;
+        ++pc.executed;
+        pc.taken += taken;
+        pc.mispredicted += !correct;
+
+        ++_total.executed;
+        _total.taken += taken;
+        _total.mispredicted += !correct;
+        if (kind == BranchKind::Branch)
+            _conditionalMispredicts += !correct;
+    }
+
+    void PrintStats(std::ostream& out, uint64_t instructions) const
+    {
+        double perKilo = instructions == 0 ? 0.0 : 1000.0 / double(instructions);
+        out << "Branch predictor (" << ::ToString(_config.kind);
+        if (_direction)
+            out << ", " << _direction->StorageBits() << " bits";
+        out << "): control transfers = " << _total.executed << ", mispredicted = " << _total.mispredicted
+            << ", accuracy = " << Accuracy(_total) << "%, MPKI = " << double(_total.mispredicted) * perKilo
+            << " (conditional " << double(_conditionalMispredicts) * perKilo << ")" << std::endl;
+        if (_config.reportRows != 0)
+            PrintReport(out, _config.reportRows);
+    }
+
+    // Per-instruction accuracy, worst offenders first
+    void PrintReport(std::ostream& out, size_t limit) const
+    {
+        std::vector<std::pair<Word, Stats>> rows(_perPc.begin(), _perPc.end());
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+            return a.second.mispredicted != b.second.mispredicted ? a.second.mispredicted > b.second.mispredicted
+                                                                   : a.first < b.first;
+        });
+        rows.resize(std::min(rows.size(), limit));
+
+        out << "pc,kind,executed,taken,mispredicted,accuracy" << std::endl;
+        for (const auto& [ip, s] : rows)
+            out << std::hex << "0x" << ip << std::dec << ',' << ToString(s.kind) << ',' << s.executed << ','
+                << s.taken << ',' << s.mispredicted << ',' << Accuracy(s) << std::endl;
+    }
+
+private:
+    struct Stats
+    {
+        BranchKind kind = BranchKind::Branch;
+        uint64_t executed = 0;
+        uint64_t taken = 0;
+        uint64_t mispredicted = 0;
+    };
+
+    // Link register conventions from the calling convention: x1 (ra) and x5 (t0)
+    static bool IsLink(const std::optional<RId>& r)
+    {
+        return r && (*r == 1 || *r == 5);
+    }
+
+    static BranchKind Classify(const Instruction& instr)
+    {
+        if (instr._type == IType::Br)
+            return BranchKind::Branch;
+        if (IsLink(instr._dst))
+            return BranchKind::Call;
+        if (instr._type == IType::Jr && IsLink(instr._src1))
+            return BranchKind::Return;
+        return BranchKind::Jump;
+    }
+
+    static const char* ToString(BranchKind kind)
+    {
+        switch (kind)
+        {
+            case BranchKind::Branch: return "branch";
+            case BranchKind::Jump: return "jump";
+            case BranchKind::Call: return "call";
+            case BranchKind::Return: return "return";
+        }
+        return "unknown";
+    }
+
+    static double Accuracy(const Stats& s)
+    {
+        return s.executed == 0 ? 100.0 : 100.0 * double(s.executed - s.mispredicted) / double(s.executed);
+    }
+
+    PredictorConfig _config;
+    std::unique_ptr<DirectionPredictor> _direction;
+    Btb _btb;
+    Ras _ras;
+    std::unordered_map<Word, Stats> _perPc;
+    Stats _total;
+    uint64_t _conditionalMispredicts = 0;
+    uint64_t _history = 0;
+};
+
+#endif //RISCV_SIM_BRANCHPREDICTOR_H
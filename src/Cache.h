@@ -0,0 +1,261 @@
+#ifndef RISCV_SIM_CACHE_H
+#define RISCV_SIM_CACHE_H
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "BaseTypes.h"
+#include "CacheModel.h"
+
+// Organisation of one cache. Ways equal to the number of lines gives a fully associative cache.
+struct CacheShape
+{
+    size_t sets = 1;
+    size_t ways = 1;
+    size_t lineBytes = 128;
+    ReplacementPolicy policy = ReplacementPolicy::Lru;
+
+    bool operator==(const CacheShape& other) const
+    {
+        return sets == other.sets && ways == other.ways && lineBytes == other.lineBytes && policy == other.policy;
+    }
+
+    std::string ToString() const
+    {
+        return std::to_string(sets) + "x" + std::to_string(ways) + "x" + std::to_string(lineBytes) + "B "
+               + ::ToString(policy);
+    }
+};
+
+constexpr unsigned Log2(size_t v)
+{
+    return v <= 1 ? 0 : 1 + Log2(v >> 1u);
+}
+
+// Shape known at compile time. Index, tag and offset math on it folds to constant shifts and masks,
+// and the way loops get a constant trip count.
+template <size_t Sets, size_t Ways, size_t LineBytes, ReplacementPolicy Policy>
+struct StaticGeometry
+{
+    static_assert(LineBytes >= sizeof(Word) && (LineBytes & (LineBytes - 1)) == 0, "line size must be a power of two");
+    static_assert(Sets != 0 && (Sets & (Sets - 1)) == 0, "number of sets must be a power of two");
+    static_assert(Ways != 0, "a cache needs at least one way");
+
+    static constexpr size_t SetsCount() { return Sets; }
+    static constexpr size_t WaysCount() { return Ways; }
+    static constexpr size_t LineWords() { return LineBytes / sizeof(Word); }
+    static constexpr unsigned LineShift() { return Log2(LineBytes); }
+    static constexpr ReplacementPolicy PolicyKind() { return Policy; }
+    static constexpr bool Specialised() { return true; }
+};
+
+// Shape chosen at run time, for caches without a compiled-in specialisation
+class DynamicGeometry
+{
+public:
+    explicit DynamicGeometry(const CacheShape& shape)
+        : _sets(shape.sets)
+        , _ways(shape.ways)
+        , _lineWords(shape.lineBytes / sizeof(Word))
+        , _lineShift(Log2(shape.lineBytes))
+        , _policy(shape.policy)
+    {
+
+    }
+
+    size_t SetsCount() const { return _sets; }
+    size_t WaysCount() const { return _ways; }
+    size_t LineWords() const { return _lineWords; }
+    unsigned LineShift() const { return _lineShift; }
+    ReplacementPolicy PolicyKind() const { return _policy; }
+    static constexpr bool Specialised() { return false; }
+
+private:
+    size_t _sets;
+    size_t _ways;
+    size_t _lineWords;
+    unsigned _lineShift;
+    ReplacementPolicy _policy;
+};
+
+// Tag and data array of a cache. Slots are line frames; the caller keeps the slot found
+// at request time and uses it when the response is due.
+class ICache
+{
+public:
+    ICache() = default;
+    virtual ~ICache() = default;
+    ICache(const ICache &) = delete;
+    ICache& operator=(const ICache&) = delete;
+
+    virtual CacheShape Shape() const = 0;
+    virtual bool IsSpecialised() const = 0;
+    virtual size_t LineWords() const = 0;
+    virtual Word ToLineAddr(Word addr) const = 0;
+    virtual Word ToLineOffset(Word addr) const = 0;
+
+    virtual std::optional<size_t> Find(Word lineAddr) const = 0;
+    // Word of a resident line; marks the line as used at the given time
+    virtual Word& Access(size_t slot, Word offset, uint64_t time) = 0;
+
+    // Slot in the line's set the line should go to: an empty one if any, otherwise the policy's choice
+    virtual size_t Victim(Word lineAddr) = 0;
+    virtual bool IsValid(size_t slot) const = 0;
+    virtual Word LineAddr(size_t slot) const = 0;
+    virtual Word* LineData(size_t slot) = 0;
+    // Claims the slot for a new line; the caller copies the contents into LineData()
+    virtual void Fill(size_t slot, Word lineAddr, uint64_t time) = 0;
+    virtual void Invalidate(size_t slot) = 0;
+    virtual size_t Slots() const = 0;
+};
+
+template <typename Geometry>
+class SetAssociativeCache : public ICache
+{
+public:
+    explicit SetAssociativeCache(Geometry geometry = Geometry())
+        : _geometry(geometry)
+        , _data(Slots() * geometry.LineWords())
+        , _tags(Slots())
+        , _lastUsage(Slots())
+        , _valid(Slots())
+    {
+
+    }
+
+    CacheShape Shape() const override
+    {
+        return CacheShape{_geometry.SetsCount(), _geometry.WaysCount(), _geometry.LineWords() * sizeof(Word),
+                          _geometry.PolicyKind()};
+    }
+
+    bool IsSpecialised() const override { return Geometry::Specialised(); }
+    size_t LineWords() const override { return _geometry.LineWords(); }
+    Word ToLineAddr(Word addr) const override { return addr & ~((Word(1) << _geometry.LineShift()) - 1); }
+    Word ToLineOffset(Word addr) const override { return (addr / wordBytes) & Word(_geometry.LineWords() - 1); }
+
+    std::optional<size_t> Find(Word lineAddr) const override
+    {
+        size_t first = FirstSlot(lineAddr);
+        for (size_t i = first; i < first + _geometry.WaysCount(); ++i) {
+            if (_valid[i] && _tags[i] == lineAddr)
+                return i;
+        }
+        return std::nullopt;
+    }
+
+    Word& Access(size_t slot, Word offset, uint64_t time) override
+    {
+        if (_geometry.PolicyKind() == ReplacementPolicy::Lru)
+            _lastUsage[slot] = time;
+        return _data[slot * _geometry.LineWords() + offset];
+    }
+
+    size_t Victim(Word lineAddr) override
+    {
+        size_t first = FirstSlot(lineAddr);
+        size_t victim = first;
+        for (size_t i = first; i < first + _geometry.WaysCount(); ++i) {
+            if (!_valid[i])
+                return i;
+            if (_lastUsage[i] < _lastUsage[victim])
+                victim = i;
+        }
+
+        if (_geometry.PolicyKind() == ReplacementPolicy::Random) {
+            _rng ^= _rng << 13u;
+            _rng ^= _rng >> 17u;
+            _rng ^= _rng << 5u;
+            victim = first + _rng % _geometry.WaysCount();
+        }
+        return victim;
+    }
+
+    bool IsValid(size_t slot) const override { return _valid[slot]; }
+    Word LineAddr(size_t slot) const override { return _tags[slot]; }
+    Word* LineData(size_t slot) override { return &_data[slot * _geometry.LineWords()]; }
+
+    void Fill(size_t slot, Word lineAddr, uint64_t time) override
+    {
+        _tags[slot] = lineAddr;
+        _lastUsage[slot] = time;
+        _valid[slot] = true;
+    }
+
+    void Invalidate(size_t slot) override
+    {
+        _valid[slot] = false;
+    }
+
+    size_t Slots() const override
+    {
+        return _geometry.SetsCount() * _geometry.WaysCount();
+    }
+
+private:
+    size_t FirstSlot(Word lineAddr) const
+    {
+        return ((lineAddr >> _geometry.LineShift()) & (_geometry.SetsCount() - 1)) * _geometry.WaysCount();
+    }
+
+    Geometry _geometry;
+    std::vector<Word> _data;
+    std::vector<Word> _tags;
+    std::vector<uint64_t> _lastUsage;   // cycle of the last use; 64 bits, so LRU order never wraps
+    std::vector<uint8_t> _valid;
+    uint32_t _rng = 0x9e3779b9;
+};
+
+template <size_t Sets, size_t Ways, size_t LineBytes, ReplacementPolicy Policy>
+using Cache = SetAssociativeCache<StaticGeometry<Sets, Ways, LineBytes, Policy>>;
+using GenericCache = SetAssociativeCache<DynamicGeometry>;
+
+// Shapes that get a compiled-in specialisation. Anything else runs on GenericCache.
+class CacheRegistry
+{
+public:
+    using Factory = std::unique_ptr<ICache> (*)();
+
+    static std::unique_ptr<ICache> Make(const CacheShape& shape)
+    {
+        for (const Entry& entry : Entries()) {
+            if (entry.shape == shape)
+                return entry.make();
+        }
+        return std::make_unique<GenericCache>(DynamicGeometry(shape));
+    }
+
+private:
+    struct Entry
+    {
+        CacheShape shape;
+        Factory make;
+    };
+
+    template <size_t Sets, size_t Ways, size_t LineBytes, ReplacementPolicy Policy>
+    static Entry Register()
+    {
+        return Entry{CacheShape{Sets, Ways, LineBytes, Policy},
+                     []() -> std::unique_ptr<ICache> { return std::make_unique<Cache<Sets, Ways, LineBytes, Policy>>(); }};
+    }
+
+    static const std::vector<Entry>& Entries()
+    {
+        constexpr ReplacementPolicy lru = ReplacementPolicy::Lru;
+        static const std::vector<Entry> entries = {
+            // Default fully associative 4 KiB data and 1 KiB code caches
+            Register<1, 32, 128, lru>(),
+            Register<1, 8, 128, lru>(),
+            // 4 KiB and 1 KiB with 64- and 128-byte lines, direct mapped up to 8 ways
+            Register<32, 1, 128, lru>(), Register<16, 2, 128, lru>(), Register<8, 4, 128, lru>(), Register<4, 8, 128, lru>(),
+            Register<64, 1, 64, lru>(), Register<32, 2, 64, lru>(), Register<16, 4, 64, lru>(), Register<8, 8, 64, lru>(),
+            Register<8, 1, 128, lru>(), Register<4, 2, 128, lru>(), Register<2, 4, 128, lru>(),
+            Register<16, 1, 64, lru>(), Register<8, 2, 64, lru>(), Register<4, 4, 64, lru>(), Register<2, 8, 64, lru>(),
+        };
+        return entries;
+    }
+};
+
+#endif //RISCV_SIM_CACHE_H
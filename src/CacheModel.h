@@ -0,0 +1,199 @@
+#ifndef RISCV_SIM_CACHEMODEL_H
+#define RISCV_SIM_CACHEMODEL_H
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "BaseTypes.h"
+
+enum class ReplacementPolicy : uint8_t
+{
+    Lru,
+    Fifo,
+    Random,
+};
+
+inline const char* ToString(ReplacementPolicy policy)
+{
+    switch (policy)
+    {
+        case ReplacementPolicy::Lru: return "lru";
+        case ReplacementPolicy::Fifo: return "fifo";
+        case ReplacementPolicy::Random: return "random";
+    }
+    return "unknown";
+}
+
+inline std::optional<ReplacementPolicy> ParseReplacementPolicy(const std::string& name)
+{
+    if (name == "lru")
+        return ReplacementPolicy::Lru;
+    if (name == "fifo")
+        return ReplacementPolicy::Fifo;
+    if (name == "random")
+        return ReplacementPolicy::Random;
+    return std::nullopt;
+}
+
+struct CacheConfig
+{
+    size_t sizeBytes = 4096;
+    size_t ways = 1;
+    size_t lineBytes = 128;
+    ReplacementPolicy policy = ReplacementPolicy::Lru;
+    size_t victimEntries = 0;
+
+    size_t Lines() const { return sizeBytes / lineBytes; }
+    size_t Sets() const { return Lines() / ways; }
+
+    // Index math is done with shifts and masks, so every dimension has to be a power of two
+    bool IsValid() const
+    {
+        auto pow2 = [](size_t v) { return v != 0 && (v & (v - 1)) == 0; };
+        return pow2(lineBytes) && lineBytes >= sizeof(Word) && pow2(sizeBytes) && sizeBytes >= lineBytes
+               && pow2(ways) && ways <= Lines();
+    }
+};
+
+struct CacheStats
+{
+    uint64_t accesses = 0;
+    uint64_t misses = 0;
+    uint64_t writebacks = 0;
+    uint64_t victimHits = 0;
+
+    double MissRate() const
+    {
+        return accesses == 0 ? 0.0 : double(misses) / double(accesses);
+    }
+};
+
+// Tag-only set-associative cache. It keeps no line contents, only enough state to decide
+// hit or miss, so it is cheap enough to run many of them side by side over a recorded trace.
+class CacheModel
+{
+public:
+    explicit CacheModel(const CacheConfig& config)
+        : _config(config)
+        , _ways(config.Sets() * config.ways)
+        , _victims(config.victimEntries)
+    {
+        while ((size_t(1) << _lineShift) < config.lineBytes)
+            ++_lineShift;
+        _setMask = Word(config.Sets() - 1);
+    }
+
+    // Returns true on hit
+    bool Access(Word addr, bool write)
+    {
+        ++_stats.accesses;
+        ++_clock;
+
+        Word lineAddr = addr >> _lineShift;
+        Way* set = &_ways[(lineAddr & _setMask) * _config.ways];
+
+        for (size_t i = 0; i < _config.ways; ++i) {
+            if (set[i].valid && set[i].tag == lineAddr) {
+                if (_config.policy == ReplacementPolicy::Lru)
+                    set[i].stamp = _clock;
+                set[i].dirty |= write;
+                return true;
+            }
+        }
+
+        ++_stats.misses;
+        bool dirty = write;
+        for (Way& v : _victims) {
+            if (v.valid && v.tag == lineAddr) {
+                ++_stats.victimHits;
+                dirty |= v.dirty;
+                v.valid = false;
+                break;
+            }
+        }
+
+        Way& victim = set[FindVictim(set)];
+        if (victim.valid)
+            Evict(victim);
+
+        victim = Way{lineAddr, _clock, true, dirty};
+        return false;
+    }
+
+    const CacheConfig& Config() const
+    {
+        return _config;
+    }
+
+    const CacheStats& Stats() const
+    {
+        return _stats;
+    }
+
+private:
+    struct Way
+    {
+        Word tag = 0;
+        uint64_t stamp = 0;
+        bool valid = false;
+        bool dirty = false;
+    };
+
+    // Evicted lines go to the victim buffer when there is one, pushing out its oldest entry
+    void Evict(const Way& line)
+    {
+        if (_victims.empty()) {
+            _stats.writebacks += line.dirty;
+            return;
+        }
+
+        Way* slot = &_victims.front();
+        for (Way& v : _victims) {
+            if (!v.valid) {
+                slot = &v;
+                break;
+            }
+            if (v.stamp < slot->stamp)
+                slot = &v;
+        }
+        if (slot->valid)
+            _stats.writebacks += slot->dirty;
+        *slot = Way{line.tag, _clock, true, line.dirty};
+    }
+
+    size_t FindVictim(const Way* set)
+    {
+        for (size_t i = 0; i < _config.ways; ++i) {
+            if (!set[i].valid)
+                return i;
+        }
+
+        if (_config.policy == ReplacementPolicy::Random) {
+            // xorshift32: deterministic, so sweeps are reproducible run to run
+            _rng ^= _rng << 13u;
+            _rng ^= _rng >> 17u;
+            _rng ^= _rng << 5u;
+            return _rng & (_config.ways - 1);
+        }
+
+        // Lru and Fifo differ only in whether hits refresh the stamp
+        size_t victim = 0;
+        for (size_t i = 1; i < _config.ways; ++i) {
+            if (set[i].stamp < set[victim].stamp)
+                victim = i;
+        }
+        return victim;
+    }
+
+    CacheConfig _config;
+    CacheStats _stats;
+    std::vector<Way> _ways;
+    std::vector<Way> _victims;
+    unsigned _lineShift = 0;
+    Word _setMask = 0;
+    uint64_t _clock = 0;
+    uint32_t _rng = 0x9e3779b9;
+};
+
+#endif //RISCV_SIM_CACHEMODEL_H
@@ -0,0 +1,168 @@
+#ifndef RISCV_SIM_CACHESWEEP_H
+#define RISCV_SIM_CACHESWEEP_H
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "CacheModel.h"
+#include "Trace.h"
+
+enum class TraceFilter : uint8_t
+{
+    Data,
+    Code,
+    All,
+};
+
+struct SweepResult
+{
+    CacheConfig config;
+    CacheStats stats;
+};
+
+// Evaluates many cache configurations against one trace. Workers claim small groups of
+// configurations and walk the shared, mapped trace batch by batch, feeding every model of
+// the group from the same batch while it is still hot in the host cache.
+class CacheSweep
+{
+public:
+    CacheSweep(const TraceReader& trace, std::vector<CacheConfig> configs)
+        : _trace(trace)
+        , _configs(std::move(configs))
+    {
+
+    }
+
+    void SetThreads(unsigned threads)
+    {
+        _threads = std::max(1u, threads);
+    }
+
+    void SetBatchRecords(size_t records)
+    {
+        _batchRecords = std::max<size_t>(1, records);
+    }
+
+    void SetFilter(TraceFilter filter)
+    {
+        _filter = filter;
+    }
+
+    std::vector<SweepResult> Run()
+    {
+        std::vector<SweepResult> results(_configs.size());
+        std::atomic<size_t> nextConfig{0};
+
+        auto worker = [&]() {
+            std::vector<CacheModel> models;
+            while (true) {
+                size_t first = nextConfig.fetch_add(modelsPerGroup);
+                if (first >= _configs.size())
+                    break;
+                size_t last = std::min(first + modelsPerGroup, _configs.size());
+
+                models.clear();
+                for (size_t i = first; i < last; ++i)
+                    models.emplace_back(_configs[i]);
+
+                for (const TraceRecord* batch = _trace.begin(); batch < _trace.end(); batch += _batchRecords) {
+                    const TraceRecord* batchEnd = std::min(batch + _batchRecords, _trace.end());
+                    for (CacheModel& model : models) {
+                        for (const TraceRecord* r = batch; r < batchEnd; ++r) {
+                            if (Accepts(r->type))
+                                model.Access(r->addr, r->type == AccessType::Store);
+                        }
+                    }
+                }
+
+                for (size_t i = first; i < last; ++i)
+                    results[i] = SweepResult{_configs[i], models[i - first].Stats()};
+            }
+        };
+
+        unsigned threads = std::min<size_t>(_threads, (_configs.size() + modelsPerGroup - 1) / modelsPerGroup);
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads; ++i)
+            pool.emplace_back(worker);
+        worker();
+        for (std::thread& t : pool)
+            t.join();
+
+        return results;
+    }
+
+    // Cartesian product of the given dimensions; combinations that do not form a valid cache are
+    // dropped with a warning
+    static std::vector<CacheConfig> Grid(const std::vector<size_t>& sizes, const std::vector<size_t>& ways,
+                                         const std::vector<size_t>& lines, const std::vector<ReplacementPolicy>& policies,
+                                         const std::vector<size_t>& victims = {0})
+    {
+        std::vector<CacheConfig> configs;
+        for (size_t size : sizes)
+            for (size_t line : lines)
+                for (size_t way : ways)
+                    for (ReplacementPolicy policy : policies)
+                        for (size_t victim : victims) {
+                            CacheConfig config{size, way, line, policy, victim};
+                            if (config.IsValid())
+                                configs.push_back(config);
+                            else
+                                std::cerr << "WARNING: sweep: skipping " << size << " B, " << way << "-way, " << line
+                                          << " B lines, " << ToString(policy) << ", " << victim
+                                          << " victim entries: not a valid cache" << std::endl;
+                        }
+        return configs;
+    }
+
+    static void WriteCsv(std::ostream& out, const std::vector<SweepResult>& results)
+    {
+        out << "size_bytes,ways,line_bytes,sets,policy,victim_entries,accesses,misses,victim_hits,writebacks,miss_rate\n";
+        for (const SweepResult& r : results) {
+            out << r.config.sizeBytes << ',' << r.config.ways << ',' << r.config.lineBytes << ','
+                << r.config.Sets() << ',' << ToString(r.config.policy) << ',' << r.config.victimEntries << ','
+                << r.stats.accesses << ',' << r.stats.misses << ',' << r.stats.victimHits << ','
+                << r.stats.writebacks << ',' << r.stats.MissRate() << '\n';
+        }
+    }
+
+    static void WriteJson(std::ostream& out, const std::vector<SweepResult>& results)
+    {
+        out << "[\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const SweepResult& r = results[i];
+            out << "  {\"size_bytes\": " << r.config.sizeBytes << ", \"ways\": " << r.config.ways
+                << ", \"line_bytes\": " << r.config.lineBytes << ", \"sets\": " << r.config.Sets()
+                << ", \"policy\": \"" << ToString(r.config.policy) << "\", \"victim_entries\": "
+                << r.config.victimEntries << ", \"accesses\": " << r.stats.accesses << ", \"misses\": "
+                << r.stats.misses << ", \"victim_hits\": " << r.stats.victimHits << ", \"writebacks\": " << r.stats.writebacks
+                << ", \"miss_rate\": " << r.stats.MissRate() << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "]\n";
+    }
+
+private:
+    static constexpr size_t modelsPerGroup = 4;
+
+    bool Accepts(AccessType type) const
+    {
+        switch (_filter)
+        {
+            case TraceFilter::Data: return type != AccessType::Fetch;
+            case TraceFilter::Code: return type == AccessType::Fetch;
+            case TraceFilter::All: return true;
+        }
+        return true;
+    }
+
+    const TraceReader& _trace;
+    std::vector<CacheConfig> _configs;
+    unsigned _threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t _batchRecords = 4096;
+    TraceFilter _filter = TraceFilter::Data;
+};
+
+#endif //RISCV_SIM_CACHESWEEP_H
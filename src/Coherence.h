@@ -0,0 +1,219 @@
+#ifndef RISCV_SIM_COHERENCE_H
+#define RISCV_SIM_COHERENCE_H
+
+#include <optional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BaseTypes.h"
+
+enum class CoherenceProtocol : uint8_t
+{
+    None,
+    Mesi,
+    Moesi,
+};
+
+inline const char* ToString(CoherenceProtocol protocol)
+{
+    switch (protocol)
+    {
+        case CoherenceProtocol::None: return "none";
+        case CoherenceProtocol::Mesi: return "mesi";
+        case CoherenceProtocol::Moesi: return "moesi";
+    }
+    return "unknown";
+}
+
+inline std::optional<CoherenceProtocol> ParseCoherenceProtocol(const std::string& name)
+{
+    for (CoherenceProtocol protocol : {CoherenceProtocol::None, CoherenceProtocol::Mesi, CoherenceProtocol::Moesi}) {
+        if (name == ToString(protocol))
+            return protocol;
+    }
+    return std::nullopt;
+}
+
+struct CoherenceConfig
+{
+    CoherenceProtocol protocol = CoherenceProtocol::Mesi;
+    bool directory = false;         // probe only the caches a directory lists, instead of snooping all of them
+    size_t transferLatency = 40;    // miss served by another cache's dirty or exclusive copy
+    size_t upgradeLatency = 20;     // shared to modified on a store hit
+    size_t invalidateLatency = 10;  // extra for a store miss that invalidates other copies
+    size_t directoryLatency = 10;   // directory lookup on every coherence transaction, in directory mode
+};
+
+enum class LineState : uint8_t
+{
+    Invalid,
+    Shared,
+    Exclusive,
+    Owned,
+    Modified,
+};
+
+// The part of a private cache the coherence bus talks to
+class ICoherentCache
+{
+public:
+    ICoherentCache() = default;
+    virtual ~ICoherentCache() = default;
+    ICoherentCache(const ICoherentCache &) = delete;
+    ICoherentCache& operator=(const ICoherentCache&) = delete;
+
+    virtual LineState StateOf(Word lineAddr) = 0;
+    // Another cache reads the line, or takes it over when exclusive. The newest data is copied to
+    // supply when it is not null; writeOffset is the word the other cache is about to store to.
+    virtual void Snoop(Word lineAddr, bool exclusive, Word* supply, std::optional<Word> writeOffset) = 0;
+    // Functional write by another cache of the masked bytes of a word, into whatever copy this
+    // cache holds
+    virtual void UpdateCopy(Word addr, Word data, Word mask) = 0;
+};
+
+// Keeps the private data caches of all harts coherent. Caches report which lines they hold, so
+// the bus always knows the holders; in snoop mode every transaction still probes every cache,
+// in directory mode it probes only the holders and pays for the directory lookup.
+class CoherenceBus
+{
+public:
+    struct Holders
+    {
+        size_t count = 0;
+        bool owner = false;     // a holder with a dirty or exclusive copy can supply the data
+    };
+
+    explicit CoherenceBus(const CoherenceConfig& config)
+        : _config(config)
+    {
+
+    }
+
+    const CoherenceConfig& Config() const
+    {
+        return _config;
+    }
+
+    void Attach(ICoherentCache* cache)
+    {
+        _caches.push_back(cache);
+    }
+
+    // Harts running on their own threads must not look into each other's caches between quantum
+    // boundaries. The holder lists only change at the boundaries, so they stay safe to read.
+    void SetParallel(bool parallel)
+    {
+        _parallel = parallel;
+    }
+
+    // Other caches holding the line; used to estimate latency when a request starts
+    Holders Query(const ICoherentCache* requester, Word lineAddr) const
+    {
+        Holders holders;
+        if (_parallel) {
+            // Without the line states, any holder is assumed to be able to supply the line
+            ForEachHolder(requester, lineAddr, [&](ICoherentCache*) { ++holders.count; });
+            holders.owner = holders.count != 0;
+            return holders;
+        }
+        ForEachHolder(requester, lineAddr, [&](ICoherentCache* cache) {
+            LineState state = cache->StateOf(lineAddr);
+            if (state == LineState::Invalid)
+                return;
+            ++holders.count;
+            holders.owner = holders.owner || state != LineState::Shared;
+        });
+        return holders;
+    }
+
+    // Brings the line into the requester. Returns whether another cache supplied the data into
+    // supply and the state the requester gets.
+    std::pair<bool, LineState> Acquire(ICoherentCache* requester, Word lineAddr, bool exclusive, Word* supply,
+                                       std::optional<Word> writeOffset = std::nullopt)
+    {
+        ++_transactions;
+        _probes += _config.directory ? Query(requester, lineAddr).count : _caches.size() - 1;
+
+        bool supplied = false;
+        bool shared = false;
+        ForEachHolder(requester, lineAddr, [&](ICoherentCache* cache) {
+            LineState state = cache->StateOf(lineAddr);
+            if (state == LineState::Invalid)
+                return;
+            bool supplies = !supplied && state != LineState::Shared && supply != nullptr;
+            cache->Snoop(lineAddr, exclusive, supplies ? supply : nullptr, writeOffset);
+            supplied = supplied || supplies;
+            shared = shared || cache->StateOf(lineAddr) != LineState::Invalid;
+        });
+
+        uint32_t bit = uint32_t(1) << Index(requester);
+        uint32_t& holders = _holders[lineAddr];
+        holders = exclusive ? bit : holders | bit;
+        if (!exclusive)
+            for (size_t i = 0; i < _caches.size(); ++i)
+                if ((holders & (uint32_t(1) << i)) && _caches[i] != requester
+                    && _caches[i]->StateOf(lineAddr) == LineState::Invalid)
+                    holders &= ~(uint32_t(1) << i);
+
+        LineState state = exclusive ? LineState::Modified : shared ? LineState::Shared : LineState::Exclusive;
+        return {supplied, state};
+    }
+
+    // The cache no longer holds the line at all
+    void Evicted(const ICoherentCache* cache, Word lineAddr)
+    {
+        auto it = _holders.find(lineAddr);
+        if (it == _holders.end())
+            return;
+        it->second &= ~(uint32_t(1) << Index(cache));
+        if (it->second == 0)
+            _holders.erase(it);
+    }
+
+    // A functional write by one cache reaches all the others. Every cache is told, not only the
+    // holders: parallel harts fill lines the holder lists learn about only at the quantum
+    // boundary, and reservations may be on lines a cache does not hold.
+    void UpdateCopies(const ICoherentCache* writer, Word addr, Word data, Word mask = allBytes)
+    {
+        for (ICoherentCache* cache : _caches)
+            if (cache != writer)
+                cache->UpdateCopy(addr, data, mask);
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Coherence (" << ToString(_config.protocol) << ", " << (_config.directory ? "directory" : "snooping")
+            << "): transactions = " << _transactions << ", probes = " << _probes << std::endl;
+    }
+
+private:
+    size_t Index(const ICoherentCache* cache) const
+    {
+        for (size_t i = 0; i < _caches.size(); ++i)
+            if (_caches[i] == cache)
+                return i;
+        return 0;
+    }
+
+    template <typename F>
+    void ForEachHolder(const ICoherentCache* except, Word lineAddr, F f) const
+    {
+        auto it = _holders.find(lineAddr);
+        if (it == _holders.end())
+            return;
+        for (size_t i = 0; i < _caches.size(); ++i)
+            if ((it->second & (uint32_t(1) << i)) && _caches[i] != except)
+                f(_caches[i]);
+    }
+
+    CoherenceConfig _config;
+    std::vector<ICoherentCache*> _caches;
+    std::unordered_map<Word, uint32_t> _holders;
+    bool _parallel = false;
+    uint64_t _transactions = 0;
+    uint64_t _probes = 0;
+};
+
+#endif //RISCV_SIM_COHERENCE_H
@@ -7,58 +7,47 @@
 #include "RegisterFile.h"
 #include "CsrFile.h"
 #include "Executor.h"
+#include "MulDivUnit.h"
+#include "StoreBuffer.h"
+#include "VectorRegisterFile.h"
+#include "VectorUnit.h"
+#include "CustomUnit.h"
+#include "MacroFusion.h"
 
 class Cpu
 {
 public:
-    Cpu(CachedMem& mem)
-        : _mem(mem)
+    Cpu(CachedMem& mem, size_t storeBufferEntries = 0, const MulDivConfig& mulDiv = MulDivConfig(),
+        const VectorConfig& vector = VectorConfig(), const CustomExtensions* custom = nullptr, bool fusion = false)
+        : _decoder(custom)
+        , _mem(mem)
+        , _storeBuffer(storeBufferEntries)
+        , _mulDiv(mulDiv)
+        , _vrf(vector.vlen)
+        , _vector(vector)
+        , _custom(custom)
+        , _fusion(fusion)
     {
-
+        _mem.SetPerfEvents(&_csrf.Events());
     }
 
     void Clock()
     {
         _csrf.Clock();
-
-        if (_mem.getWaitCycles() == 0)
-        {
-            if (!_waitingInstruction) {
-                _mem.Request(this->_ip);
-                std::optional<Word> instr = _mem.Response(_csrf.getCycleNumber());
-
-                if (instr == std::optional<Word>())
-                    return;
-
-                Word instrCode = *instr;
-                _instruction = _decoder.Decode(instrCode);
-                _rf.Read(_instruction);
-                _csrf.Read(_instruction);
-                _exe.Execute(_instruction, _ip);
-                // Memory request
-                _mem.Request(_instruction);
-                _memoryWaiting = _mem.Response(_instruction, _csrf.getCycleNumber());
-                if (!_memoryWaiting) {
-                    _waitingInstruction = static_cast<std::unique_ptr<Instruction> &&>(_instruction);
-                    return;
-                }
-
-            } else {
-                _instruction = static_cast<std::unique_ptr<Instruction> &&>(_waitingInstruction);
-                _mem.Response(_instruction, _csrf.getCycleNumber());
-            }
-            // Write + Write
-            _rf.Write(_instruction);
-            _csrf.Write(_instruction);
-            _csrf.InstructionExecuted();
-            _ip = _instruction->_nextIp;
-        }
+        Step();
+        DrainStoreBuffer();
     }
 
     void Reset(Word ip)
     {
         _csrf.Reset();
         _ip = ip;
+        _busyUntil = 0;
+    }
+
+    void SetHartId(Word id)
+    {
+        _csrf.SetHartId(id);
     }
 
     std::optional<CpuToHostData> GetMessage()
@@ -66,16 +55,179 @@ public:
         return _csrf.GetMessage();
     }
 
+    void PrintStats(std::ostream& out) const
+    {
+        _mulDiv.PrintStats(out);
+        _vector.PrintStats(out);
+        _custom.PrintStats(out);
+        _fusion.PrintStats(out);
+        if (_storeBuffer.Enabled())
+            _storeBuffer.PrintStats(out);
+    }
+
 private:
-    Reg32 _ip;
+    void Step()
+    {
+        if (!_waitingInstruction) {
+            // The next instruction waits for a multiply, divide, vector or custom instruction to finish
+            if (_csrf.getCycleNumber() < _busyUntil)
+                return;
+            if (_mem.getCodeWaitCycles() != 0)
+                return;
+
+            _mem.Request(this->_ip);
+            std::optional<Word> instr = _mem.Response(_csrf.getCycleNumber());
+
+            if (instr == std::optional<Word>())
+                return;
+
+            Word instrCode = *instr;
+            _instruction = _decoder.Decode(instrCode);
+            // The second instruction of a fused pair is not fetched on its own
+            if (_fusion.TryFuse(_instruction, _ip, _mem, _decoder))
+                _csrf.CountEvent(HpmEvent::FusedPair);
+            _rf.Read(_instruction);
+            _csrf.Read(_instruction);
+            _exe.Execute(_instruction, _ip);
+            _memoryIssued = false;
+            if (_instruction->_type == IType::MulDiv)
+                _busyUntil = _mulDiv.Start(_instruction->_mulDivFunc, _csrf.getCycleNumber());
+        } else {
+            _instruction = static_cast<std::unique_ptr<Instruction> &&>(_waitingInstruction);
+        }
+
+        // Memory request
+        if (!MemoryAccess(_instruction)) {
+            _waitingInstruction = static_cast<std::unique_ptr<Instruction> &&>(_instruction);
+            return;
+        }
+
+        // Write + Write
+        _rf.Write(_instruction);
+        _csrf.Write(_instruction);
+        _csrf.InstructionExecuted(RetiredCount(*_instruction));
+        _ip = _instruction->_nextIp;
+    }
+
+    // Returns true once the instruction is done with memory
+    bool MemoryAccess(InstructionPtr& instr)
+    {
+        // Vector instructions read and write memory directly, once every buffered store is there
+        if (instr->_type == IType::Vector) {
+            bool memory = instr->_vecFunc == VecFunc::Load || instr->_vecFunc == VecFunc::Store;
+            if (memory && (!_storeBuffer.Empty() || _draining))
+                return false;
+            _vrf.Execute(*instr, _mem);
+            _busyUntil = _vector.Start(*instr, _csrf.getCycleNumber());
+            return true;
+        }
+        // So do custom instructions that access memory
+        if (instr->_type == IType::Custom) {
+            if (instr->_custom->accessesMemory && (!_storeBuffer.Empty() || _draining))
+                return false;
+            if (!_custom.Free(_csrf.getCycleNumber())) {
+                _custom.BusyStall();
+                return false;
+            }
+            CustomUnit::Execute(*instr, _mem);
+            _busyUntil = _custom.Start(*instr, _csrf.getCycleNumber());
+            return true;
+        }
+        // A fence waits until every older store has reached the cache; FENCE.I then drops the
+        // code lines, so the instructions after it are fetched again
+        if (instr->_type == IType::Fence) {
+            if (!_storeBuffer.Empty() || _draining)
+                return false;
+            if (IsFenceI(*instr))
+                _mem.FlushCode();
+            return true;
+        }
+        if (instr->_type != IType::Ld && instr->_type != IType::St && instr->_type != IType::Amo)
+            return true;
+
+        if (_storeBuffer.Enabled() && !_memoryIssued) {
+            // Atomics wait until every older store has reached the cache
+            if (instr->_type == IType::Amo && (!_storeBuffer.Empty() || _draining))
+                return false;
+            if (instr->_type == IType::St) {
+                if (_storeBuffer.Full()) {
+                    _storeBuffer.FullStall();
+                    return false;
+                }
+                _storeBuffer.Push(instr->_addr, instr->_data, instr->_memFunc);
+                return true;
+            }
+
+            std::optional<Word> forwarded;
+            if (instr->_type == IType::Ld)
+                forwarded = _storeBuffer.Forward(instr->_addr, instr->_memFunc);
+            if (forwarded) {
+                instr->_data = *forwarded;
+                return true;
+            }
+            // The data port is still busy writing back an older store, or the load needs
+            // bytes of buffered stores merged with the cached word
+            if (_draining || (instr->_type == IType::Ld && LoadWaitsForDrain(instr)))
+                return false;
+        }
+
+        if (!_memoryIssued) {
+            _mem.Request(instr);
+            _memoryIssued = true;
+        }
+        if (_mem.getDataWaitCycles() != 0)
+            return false;
+        return _mem.Response(instr, _csrf.getCycleNumber());
+    }
+
+    bool LoadWaitsForDrain(const InstructionPtr& instr) const
+    {
+        return _storeBuffer.Overlaps(instr->_addr, instr->_memFunc);
+    }
+
+    // Writes the oldest buffered store to the data cache whenever the data port is not needed by a load
+    void DrainStoreBuffer()
+    {
+        if (_draining) {
+            if (_mem.getDataWaitCycles() != 0 || !_mem.Response(_drainInstruction, _csrf.getCycleNumber()))
+                return;
+            _storeBuffer.Pop();
+            _draining = false;
+        }
+
+        bool portNeeded = _waitingInstruction && (_memoryIssued || (_waitingInstruction->_type == IType::Ld
+                                                                    && !LoadWaitsForDrain(_waitingInstruction)));
+        if (_storeBuffer.Empty() || portNeeded)
+            return;
+
+        const StoreBuffer::Entry& store = _storeBuffer.Front();
+        _drainInstruction = std::make_unique<Instruction>();
+        _drainInstruction->_type = IType::St;
+        _drainInstruction->_addr = store.addr;
+        _drainInstruction->_data = store.data;
+        _drainInstruction->_memFunc = store.func;
+        _mem.Request(_drainInstruction);
+        _draining = true;
+    }
+
+    Word _ip = 0;
     Decoder _decoder;
     RegisterFile _rf;
     CsrFile _csrf;
     Executor _exe;
     CachedMem& _mem;
-    bool _memoryWaiting;
+    StoreBuffer _storeBuffer;
+    MulDivUnit _mulDiv;
+    VectorRegisterFile _vrf;
+    VectorUnit _vector;
+    CustomUnit _custom;
+    MacroFusion _fusion;
+    uint64_t _busyUntil = 0;
+    bool _memoryIssued = false;
+    bool _draining = false;
     InstructionPtr _instruction;
     InstructionPtr _waitingInstruction;
+    InstructionPtr _drainInstruction;
 };
 
 
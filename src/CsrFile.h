@@ -2,9 +2,15 @@
 #ifndef RISCV_SIM_CSRFILE_H
 #define RISCV_SIM_CSRFILE_H
 
+#include <array>
 #include <optional>
 #include "Instruction.h"
+#include "PerfEvents.h"
 
+// Machine and user CSRs of one hart. cycle and instret are 64 bits wide; RV32 reads them in halves
+// through the h registers, which RV64 does not have. mhpmcounter3..31 count the event their
+// mhpmevent register selects. The user counter shadows are read-only; writes to them and to
+// unknown CSRs are ignored.
 class CsrFile
 {
 public:
@@ -12,7 +18,9 @@ public:
     {
         numInstr = 0;
         numCycles = 0;
-        coreId = 0;
+        cycleOffset = 0;
+        instrOffset = 0;
+        hpm.fill(HpmCounter{});
         cpuToHostData.reset();
         startReg = true;
     }
@@ -21,33 +29,53 @@ public:
         if (!instr->_csr)
             return;
 
-        switch (static_cast<CsrIdx>(instr->_csr.value()))
-        {
-            case CsrIdx::Instret: instr->_csrVal = numInstr; break;
-            case CsrIdx::Cycle  : instr->_csrVal = numCycles; break;
-            case CsrIdx::Mhartid: instr->_csrVal = coreId; break;
-            default: break;
-        }
+        instr->_csrVal = ReadCsr(Word(*instr->_csr));
     }
     void Write(InstructionPtr& instr)
     {
-        if (instr->_type == IType::Csrw && instr->_csr.value_or(CsrIdx::None) == CsrIdx::Mtohost)
+        if (instr->_type != IType::Csr || !instr->_csrData)
+            return;
+
+        if (*instr->_csr == CsrIdx::Mtohost)
         {
-            cpuToHostData = CpuToHostData{instr->_data};
+            cpuToHostData = CpuToHostData{*instr->_csrData};
+            return;
         }
+        WriteCsr(Word(*instr->_csr), *instr->_csrData);
     }
 
-    void InstructionExecuted()
+    // Reported by mhartid; survives Reset
+    void SetHartId(Word id)
     {
-        numInstr++;
+        coreId = id;
+    }
+
+    void InstructionExecuted(Word count = 1)
+    {
+        numInstr += count;
+        retiredThisCycle = true;
     }
 
     void Clock()
     {
+        if (numCycles != 0 && !retiredThisCycle)
+            events.Count(HpmEvent::IdleCycle);
+        retiredThisCycle = false;
         numCycles++;
     }
 
-    Word getCycleNumber()
+    // Where the caches and the core report the events the counters may select
+    PerfEvents& Events()
+    {
+        return events;
+    }
+
+    void CountEvent(HpmEvent event)
+    {
+        events.Count(event);
+    }
+
+    uint64_t getCycleNumber()
     {
         return this->numCycles;
     }
@@ -59,8 +87,107 @@ public:
         return ret;
     }
 private:
-    Word numInstr = 0;
-    Word numCycles = 0;
+    static constexpr Word hpmCount = 29;
+
+    // The value is base plus the events counted since start; reprogramming folds the count into base
+    struct HpmCounter
+    {
+        HpmEvent event = HpmEvent::None;
+        uint64_t base = 0;
+        uint64_t start = 0;
+    };
+
+    // Index of csr in a block of registers numbered after the first counter, if it is in the block
+    static std::optional<Word> HpmIndex(Word csr, CsrIdx first)
+    {
+        Word n = csr - Word(first);
+        return n < hpmCount ? std::optional<Word>(n) : std::nullopt;
+    }
+
+    uint64_t HpmValue(Word n) const
+    {
+        return hpm[n].base + events.Total(hpm[n].event) - hpm[n].start;
+    }
+
+    void SetHpm(Word n, uint64_t value, HpmEvent event)
+    {
+        hpm[n] = HpmCounter{event, value, events.Total(event)};
+    }
+
+    // On RV64 the low CSR holds the whole counter, and the h registers read as zero
+    static Word Low(uint64_t value)
+    {
+        return Word(value);
+    }
+
+    static Word High(uint64_t value)
+    {
+        return XLEN == 32 ? Word(value >> 32u) : 0;
+    }
+
+    static uint64_t WithLow(uint64_t value, Word low)
+    {
+        return XLEN == 32 ? (value & ~uint64_t(0xffffffffu)) | low : low;
+    }
+
+    static uint64_t WithHigh(uint64_t value, Word high)
+    {
+        return XLEN == 32 ? (value & 0xffffffffu) | uint64_t(high) << 32u : value;
+    }
+
+    Word ReadCsr(Word csr) const
+    {
+        uint64_t cycle = numCycles + cycleOffset;
+        uint64_t instret = numInstr + instrOffset;
+        switch (static_cast<CsrIdx>(csr))
+        {
+            case CsrIdx::Cycle:
+            case CsrIdx::Mcycle: return Low(cycle);
+            case CsrIdx::Cycleh:
+            case CsrIdx::Mcycleh: return High(cycle);
+            case CsrIdx::Instret:
+            case CsrIdx::Minstret: return Low(instret);
+            case CsrIdx::Instreth:
+            case CsrIdx::Minstreth: return High(instret);
+            case CsrIdx::Mhartid: return coreId;
+            default: break;
+        }
+        for (CsrIdx first : {CsrIdx::Mhpmcounter3, CsrIdx::Hpmcounter3})
+            if (auto n = HpmIndex(csr, first))
+                return Low(HpmValue(*n));
+        for (CsrIdx first : {CsrIdx::Mhpmcounter3h, CsrIdx::Hpmcounter3h})
+            if (auto n = HpmIndex(csr, first))
+                return High(HpmValue(*n));
+        if (auto n = HpmIndex(csr, CsrIdx::Mhpmevent3))
+            return Word(hpm[*n].event);
+        return 0;
+    }
+
+    void WriteCsr(Word csr, Word value)
+    {
+        switch (static_cast<CsrIdx>(csr))
+        {
+            case CsrIdx::Mcycle: cycleOffset = WithLow(numCycles + cycleOffset, value) - numCycles; return;
+            case CsrIdx::Mcycleh: cycleOffset = WithHigh(numCycles + cycleOffset, value) - numCycles; return;
+            case CsrIdx::Minstret: instrOffset = WithLow(numInstr + instrOffset, value) - numInstr; return;
+            case CsrIdx::Minstreth: instrOffset = WithHigh(numInstr + instrOffset, value) - numInstr; return;
+            default: break;
+        }
+        if (auto n = HpmIndex(csr, CsrIdx::Mhpmcounter3))
+            SetHpm(*n, WithLow(HpmValue(*n), value), hpm[*n].event);
+        else if (auto n = HpmIndex(csr, CsrIdx::Mhpmcounter3h))
+            SetHpm(*n, WithHigh(HpmValue(*n), value), hpm[*n].event);
+        else if (auto n = HpmIndex(csr, CsrIdx::Mhpmevent3))
+            SetHpm(*n, HpmValue(*n), value < Word(HpmEvent::Count) ? HpmEvent(value) : HpmEvent::None);
+    }
+
+    uint64_t numInstr = 0;
+    uint64_t numCycles = 0;
+    uint64_t cycleOffset = 0;   // mcycle and minstret writes move the guest view, not the simulator's clock
+    uint64_t instrOffset = 0;
+    bool retiredThisCycle = false;
+    std::array<HpmCounter, hpmCount> hpm{};
+    PerfEvents events;
     Word coreId = 0;
     std::optional<CpuToHostData> cpuToHostData;
     bool startReg = false;
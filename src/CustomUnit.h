@@ -0,0 +1,157 @@
+#ifndef RISCV_SIM_CUSTOMUNIT_H
+#define RISCV_SIM_CUSTOMUNIT_H
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Memory.h"
+
+// Guest memory as a custom instruction sees it: untimed loads and stores of the newest copy
+class CustomMemory
+{
+public:
+    explicit CustomMemory(CachedMem& mem)
+        : _mem(mem)
+    {
+
+    }
+
+    Word Load(MemFunc func, Word addr)
+    {
+        return LoadValue(func, _mem.Peek(addr), addr);
+    }
+
+    void Store(MemFunc func, Word addr, Word value)
+    {
+        _mem.Poke(addr, StoreValue(func, _mem.Peek(addr), addr, value), ByteMask(func, addr));
+    }
+
+private:
+    CachedMem& _mem;
+};
+
+// An instruction of an accelerator that does not exist yet. The function gets rs1 and rs2 and
+// returns the value for rd; its timing is only what is declared here.
+struct CustomInstruction
+{
+    std::string name;
+    std::function<Word(Word rs1, Word rs2, CustomMemory& mem)> function;
+    size_t latency = 1;             // cycles until rd is available
+    size_t occupancy = 1;           // cycles before the unit takes the next custom instruction
+    bool accessesMemory = false;    // the function loads or stores, so older stores must be visible first
+    size_t id = 0;                  // set by CustomExtensions::Register
+};
+
+// Binds R-type encodings of the custom-0 and custom-1 opcodes to custom instructions, by funct3
+// and funct7. Registration happens before the harts start; afterwards the table is only read.
+class CustomExtensions
+{
+public:
+    bool Register(Opcode opcode, Word funct3, Word funct7, CustomInstruction instr)
+    {
+        if ((opcode != Opcode::Custom0 && opcode != Opcode::Custom1) || funct3 > 7 || funct7 > 127) {
+            std::cerr << "ERROR: custom: " << instr.name << " is not a custom-0 or custom-1 encoding" << std::endl;
+            return false;
+        }
+        if (!instr.function || instr.latency == 0 || instr.occupancy == 0) {
+            std::cerr << "ERROR: custom: " << instr.name << " needs a function, a latency and an occupancy"
+                      << std::endl;
+            return false;
+        }
+        std::unique_ptr<CustomInstruction>& slot = _table[Index(opcode, funct3, funct7)];
+        if (slot) {
+            std::cerr << "ERROR: custom: " << instr.name << " has the encoding of " << slot->name << std::endl;
+            return false;
+        }
+        instr.id = _instructions.size();
+        slot = std::make_unique<CustomInstruction>(std::move(instr));
+        _instructions.push_back(slot.get());
+        return true;
+    }
+
+    const CustomInstruction* Find(Opcode opcode, Word funct3, Word funct7) const
+    {
+        return _table[Index(opcode, funct3, funct7)].get();
+    }
+
+    const std::vector<const CustomInstruction*>& Instructions() const
+    {
+        return _instructions;
+    }
+
+private:
+    static size_t Index(Opcode opcode, Word funct3, Word funct7)
+    {
+        return (opcode == Opcode::Custom1) << 10u | funct3 << 7u | funct7;
+    }
+
+    std::array<std::unique_ptr<CustomInstruction>, 2 * 8 * 128> _table;
+    std::vector<const CustomInstruction*> _instructions;
+};
+
+// Timing of the custom instructions: one unit that takes a new instruction once the occupancy of
+// the previous one has passed, whatever instruction it is. The memory accesses of a function are
+// not timed through the caches; its declared latency has to cover them.
+class CustomUnit
+{
+public:
+    explicit CustomUnit(const CustomExtensions* extensions)
+        : _counts(extensions ? extensions->Instructions().size() : 0)
+        , _extensions(extensions)
+    {
+
+    }
+
+    // Runs the function of the instruction
+    static void Execute(Instruction& instr, CachedMem& mem)
+    {
+        CustomMemory memory(mem);
+        instr._data = instr._custom->function(instr._src1Val, instr._src2Val, memory);
+    }
+
+    bool Free(uint64_t cycle) const
+    {
+        return _freeCycle <= cycle;
+    }
+
+    // Starts the instruction in the given cycle; returns the cycle its result is available
+    uint64_t Start(const Instruction& instr, uint64_t cycle)
+    {
+        _freeCycle = cycle + instr._custom->occupancy;
+        ++_counts[instr._custom->id];
+        return cycle + instr._custom->latency;
+    }
+
+    // An instruction waited a cycle for the unit
+    void BusyStall()
+    {
+        ++_busyStalls;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        uint64_t total = 0;
+        for (uint64_t count : _counts)
+            total += count;
+        if (total == 0)
+            return;
+        out << "Custom: instructions = " << total << ", unit busy stalls = " << _busyStalls << std::endl;
+        for (const CustomInstruction* instr : _extensions->Instructions()) {
+            if (_counts[instr->id] != 0)
+                out << "  " << instr->name << " = " << _counts[instr->id] << " (latency " << instr->latency
+                    << ", occupancy " << instr->occupancy << ")" << std::endl;
+        }
+    }
+
+private:
+    std::vector<uint64_t> _counts;
+    const CustomExtensions* _extensions;
+    uint64_t _freeCycle = 0;
+    uint64_t _busyStalls = 0;
+};
+
+#endif //RISCV_SIM_CUSTOMUNIT_H
@@ -2,21 +2,32 @@
 #ifndef RISCV_SIM_DECODER_H
 #define RISCV_SIM_DECODER_H
 
+#include "CustomUnit.h"
 #include "Instruction.h"
 
-// This decoder implementation is stateless, so it could be a function as well
+// This decoder implementation is stateless apart from the custom instructions it knows, so it
+// could be a function as well
 class Decoder
 {
 
 public:
+    explicit Decoder(const CustomExtensions* custom = nullptr)
+        : _custom(custom)
+    {
+
+    }
+
     InstructionPtr Decode(Word data)
     {
+        if (InstructionLength(data) == 2)
+            return DecodeCompressed(data & 0xffffu);
+
         DecodedInstr decoded{data};
 
         InstructionPtr instr = std::make_unique<Instruction>();
         Imm immI = SignExtend(decoded.i.imm11_0, 11);
         Imm immS = SignExtend(decoded.s.imm11_5 << 5u | decoded.s.imm4_0, 11);
-        Word immU = decoded.u.imm31_12 << 12u;
+        Word immU = Word(Imm(decoded.u.imm31_12 << 12u));
         Imm immB = SignExtend((decoded.b.imm12 << 12u) | (decoded.b.imm11 << 11u) |
                               (decoded.b.imm10_5 << 5u) | (decoded.b.imm4_1 << 1u),
                               12);
@@ -28,13 +39,15 @@ public:
         {
             case Opcode::OpImm:
             {
+                if (DecodeBitManip(instr, Opcode::OpImm, decoded))
+                    break;
                 instr->_imm = immI;
                 instr->_type = IType::Alu;
                 instr->_aluFunc = static_cast<AluFunc>(decoded.i.funct3);
                 if (instr->_aluFunc == AluFunc::Sr)
                 {
                     instr->_aluFunc = decoded.r.aluSel ? AluFunc::Sra : AluFunc::Srl;
-                    instr->_imm.value() &= 31u;
+                    instr->_imm.value() &= XLEN - 1;
                 }
                 instr->_dst = RId(decoded.i.rd);
                 instr->_src1 = RId(decoded.i.rs1);
@@ -42,6 +55,17 @@ public:
             }
             case Opcode::Op:
             {
+                if (DecodeBitManip(instr, Opcode::Op, decoded))
+                    break;
+                if (decoded.m.funct7 == f7MULDIV)
+                {
+                    instr->_type = IType::MulDiv;
+                    instr->_mulDivFunc = static_cast<MulDivFunc>(decoded.m.funct3);
+                    instr->_dst = RId(decoded.m.rd);
+                    instr->_src1 = RId(decoded.m.rs1);
+                    instr->_src2 = RId(decoded.m.rs2);
+                    break;
+                }
                 instr->_type = IType::Alu;
                 auto funct3 = AluFunc(decoded.r.funct3);
                 if (funct3 == AluFunc::Add)
@@ -68,6 +92,7 @@ public:
                 instr->_dst = RId(decoded.u.rd);
                 instr->_src1 = 0;
                 instr->_imm = immU;
+                instr->_lui = true;
                 break;
             }
             case Opcode::Auipc:
@@ -105,7 +130,11 @@ public:
             }
             case Opcode::Load:
             {
-                instr->_type = decoded.i.funct3 == fnLW ? IType::Ld : IType::Unsupported;
+                Word funct3 = decoded.i.funct3;
+                bool valid = funct3 == fnLW || funct3 == fnLB || funct3 == fnLH || funct3 == fnLBU || funct3 == fnLHU
+                             || (XLEN == 64 && (funct3 == fnLD || funct3 == fnLWU));
+                instr->_type = valid ? IType::Ld : IType::Unsupported;
+                instr->_memFunc = static_cast<MemFunc>(funct3);
                 instr->_aluFunc = AluFunc::Add;
                 instr->_dst = RId(decoded.i.rd);
                 instr->_src1 = RId(decoded.i.rs1);
@@ -114,7 +143,10 @@ public:
             }
             case Opcode::Store:
             {
-                instr->_type = decoded.i.funct3 == fnSW ? IType::St : IType::Unsupported;
+                Word funct3 = decoded.s.funct3;
+                bool valid = funct3 == fnSW || funct3 == fnSB || funct3 == fnSH || (XLEN == 64 && funct3 == fnSD);
+                instr->_type = valid ? IType::St : IType::Unsupported;
+                instr->_memFunc = static_cast<MemFunc>(funct3);
                 instr->_aluFunc = AluFunc::Add;
                 instr->_src1 = RId(decoded.s.rs1);
                 instr->_src2 = RId(decoded.s.rs2);
@@ -123,22 +155,65 @@ public:
             }
             case Opcode::System:
             {
-                if (decoded.i.funct3 == fnCSRRW && decoded.i.rd == 0)
-                {
-                    instr->_type = IType::Csrw;
-                }
-                else if (decoded.i.funct3 == fnCSRRS && decoded.i.rs1 == 0)
-                {
-                    instr->_type = IType::Csrr;
-                }
+                // ECALL, EBREAK and the other privileged instructions are not implemented
+                if (decoded.i.funct3 == fnPRIV || decoded.i.funct3 == 0b100)
+                    break;
+                instr->_type = IType::Csr;
+                instr->_csrFunc = static_cast<CsrFunc>(decoded.i.funct3);
                 instr->_dst = RId(decoded.i.rd);
-                instr->_src1 = RId(decoded.i.rs1);
+                if (decoded.i.funct3 & 0b100u)
+                    instr->_imm = Word(decoded.i.rs1);
+                else
+                    instr->_src1 = RId(decoded.i.rs1);
                 instr->_csr = static_cast<CsrIdx>(immI & 0xfff);
                 break;
             }
-            // LR SC FENCE AMO not implemented
-            case Opcode::MiscMem:
             case Opcode::Amo:
+            {
+                // aq and rl need no handling: every core performs an atomic only once everything
+                // older has reached memory, and nothing younger passes it
+                bool width = decoded.a.funct3 == fnAMOW || (XLEN == 64 && decoded.a.funct3 == fnAMOD);
+                instr->_type = width && IsAmoFunc(decoded.a.funct5) ? IType::Amo : IType::Unsupported;
+                instr->_amoFunc = static_cast<AmoFunc>(decoded.a.funct5);
+                instr->_memFunc = static_cast<MemFunc>(decoded.a.funct3);
+                instr->_dst = RId(decoded.a.rd);
+                instr->_src1 = RId(decoded.a.rs1);
+                if (instr->_amoFunc != AmoFunc::Lr)
+                    instr->_src2 = RId(decoded.a.rs2);
+                break;
+            }
+            case Opcode::OpV:
+                DecodeVector(instr, data);
+                break;
+            case Opcode::LoadFp:
+            case Opcode::StoreFp:
+                DecodeVectorMemory(instr, data);
+                break;
+            case Opcode::Custom0:
+            case Opcode::Custom1:
+            {
+                instr->_custom = _custom ? _custom->Find(static_cast<Opcode>(decoded.m.opcode), decoded.m.funct3,
+                                                         decoded.m.funct7)
+                                         : nullptr;
+                if (!instr->_custom)
+                    break;
+                instr->_type = IType::Custom;
+                instr->_dst = RId(decoded.m.rd);
+                instr->_src1 = RId(decoded.m.rs1);
+                instr->_src2 = RId(decoded.m.rs2);
+                break;
+            }
+            case Opcode::MiscMem:
+                if (decoded.i.funct3 > uint8_t(FenceFunc::FenceI))
+                    break;
+                instr->_type = IType::Fence;
+                instr->_fenceFunc = static_cast<FenceFunc>(decoded.i.funct3);
+                break;
+            case Opcode::OpImm32:
+            case Opcode::Op32:
+                if (XLEN == 64 && DecodeOp32(instr, static_cast<Opcode>(decoded.i.opcode), decoded))
+                    break;
+                [[fallthrough]];
             default:
             {
                 instr->_type = IType::Unsupported;
@@ -156,6 +231,259 @@ public:
 private:
     using Imm = int32_t;
 
+    // RV32C and RV64C: every compressed instruction is filled in as the 32-bit instruction it
+    // expands to. Floating point loads and stores and C.EBREAK are unsupported, like their 32-bit
+    // forms; RV64 has C.LD, C.SD, C.ADDIW, C.SUBW and C.ADDW in place of some of them.
+    InstructionPtr DecodeCompressed(Word code)
+    {
+        InstructionPtr instr = std::make_unique<Instruction>();
+        instr->_length = 2;
+
+        auto rd = RId(Bits(code, 11, 7));
+        auto rs2 = RId(Bits(code, 6, 2));
+        // Registers x8 to x15 in the three bit fields
+        auto rdShort = RId(8 + Bits(code, 4, 2));
+        auto rs1Short = RId(8 + Bits(code, 9, 7));
+        Imm imm6 = SignExtend(Imm(Bits(code, 12, 12) << 5u | Bits(code, 6, 2)), 5);
+        Imm immJ = SignExtend(Imm(Bits(code, 12, 12) << 11u | Bits(code, 8, 8) << 10u | Bits(code, 10, 9) << 8u |
+                                  Bits(code, 6, 6) << 7u | Bits(code, 7, 7) << 6u | Bits(code, 2, 2) << 5u |
+                                  Bits(code, 11, 11) << 4u | Bits(code, 5, 3) << 1u),
+                              11);
+        Imm immB = SignExtend(Imm(Bits(code, 12, 12) << 8u | Bits(code, 6, 5) << 6u | Bits(code, 2, 2) << 5u |
+                                  Bits(code, 11, 10) << 3u | Bits(code, 4, 3) << 1u),
+                              8);
+        Word offsetW = Bits(code, 5, 5) << 6u | Bits(code, 12, 10) << 3u | Bits(code, 6, 6) << 2u;
+
+        switch (Bits(code, 1, 0) << 3u | Bits(code, 15, 13))
+        {
+            case cADDI4SPN:
+            {
+                Word nzuimm = Bits(code, 10, 7) << 6u | Bits(code, 12, 11) << 4u | Bits(code, 5, 5) << 3u |
+                              Bits(code, 6, 6) << 2u;
+                if (nzuimm != 0)
+                    SetAlu(instr, AluFunc::Add, rdShort, 2, Imm(nzuimm));
+                break;
+            }
+            case cLW:
+                SetMemory(instr, IType::Ld, rs1Short, rdShort, Imm(offsetW));
+                break;
+            case cSW:
+                SetMemory(instr, IType::St, rs1Short, rdShort, Imm(offsetW));
+                break;
+            case cLD:
+            case cSD:
+                if (XLEN == 64) {
+                    Word offset = Bits(code, 6, 5) << 6u | Bits(code, 12, 10) << 3u;
+                    SetMemory(instr, Bits(code, 15, 13) == (cLD & 7u) ? IType::Ld : IType::St, rs1Short, rdShort,
+                              Imm(offset));
+                    instr->_memFunc = MemFunc::D;
+                }
+                break;
+            case cADDI:
+                SetAlu(instr, AluFunc::Add, rd, rd, imm6);
+                break;
+            case cJAL:
+                if (XLEN == 32) {
+                    SetJump(instr, IType::J, 1, std::nullopt, immJ);
+                } else if (rd != 0) {
+                    // C.ADDIW
+                    SetAlu(instr, AluFunc::Add, rd, rd, imm6);
+                    instr->_op32 = true;
+                }
+                break;
+            case cLI:
+                SetAlu(instr, AluFunc::Add, rd, 0, imm6);
+                break;
+            case cLUI:
+            {
+                if (rd == 2) {
+                    Imm nzimm = SignExtend(Imm(Bits(code, 12, 12) << 9u | Bits(code, 4, 3) << 7u |
+                                               Bits(code, 5, 5) << 6u | Bits(code, 2, 2) << 5u |
+                                               Bits(code, 6, 6) << 4u),
+                                           9);
+                    if (nzimm != 0)
+                        SetAlu(instr, AluFunc::Add, 2, 2, nzimm);
+                } else if (imm6 != 0) {
+                    SetAlu(instr, AluFunc::Add, rd, 0, Imm(Word(imm6) << 12u));
+                    instr->_lui = true;
+                }
+                break;
+            }
+            case cMISCALU:
+            {
+                Word funct2 = Bits(code, 11, 10);
+                Word shamt = Bits(code, 12, 12) << 5u | Bits(code, 6, 2);
+                if (funct2 == 0b00 && shamt < XLEN) {
+                    SetAlu(instr, AluFunc::Srl, rs1Short, rs1Short, Imm(shamt));
+                } else if (funct2 == 0b01 && shamt < XLEN) {
+                    SetAlu(instr, AluFunc::Sra, rs1Short, rs1Short, Imm(shamt));
+                } else if (funct2 == 0b10) {
+                    SetAlu(instr, AluFunc::And, rs1Short, rs1Short, imm6);
+                } else if (funct2 == 0b11 && Bits(code, 12, 12) == 0) {
+                    static constexpr AluFunc funcs[] = {AluFunc::Sub, AluFunc::Xor, AluFunc::Or, AluFunc::And};
+                    SetAlu(instr, funcs[Bits(code, 6, 5)], rs1Short, rs1Short, std::nullopt);
+                    instr->_src2 = rdShort;
+                } else if (funct2 == 0b11 && XLEN == 64 && Bits(code, 6, 6) == 0) {
+                    // C.SUBW and C.ADDW
+                    SetAlu(instr, Bits(code, 5, 5) ? AluFunc::Add : AluFunc::Sub, rs1Short, rs1Short, std::nullopt);
+                    instr->_src2 = rdShort;
+                    instr->_op32 = true;
+                }
+                break;
+            }
+            case cJ:
+                SetJump(instr, IType::J, std::nullopt, std::nullopt, immJ);
+                break;
+            case cBEQZ:
+            case cBNEZ:
+            {
+                instr->_type = IType::Br;
+                instr->_brFunc = Bits(code, 15, 13) == (cBEQZ & 7u) ? BrFunc::Eq : BrFunc::Neq;
+                instr->_src1 = rs1Short;
+                instr->_src2 = 0;
+                instr->_imm = immB;
+                break;
+            }
+            case cSLLI:
+            {
+                Word shamt = Bits(code, 12, 12) << 5u | rs2;
+                if (shamt < XLEN)
+                    SetAlu(instr, AluFunc::Sll, rd, rd, Imm(shamt));
+                break;
+            }
+            case cLWSP:
+            {
+                Word offset = Bits(code, 3, 2) << 6u | Bits(code, 12, 12) << 5u | Bits(code, 6, 4) << 2u;
+                if (rd != 0)
+                    SetMemory(instr, IType::Ld, 2, rd, Imm(offset));
+                break;
+            }
+            case cLDSP:
+            {
+                Word offset = Bits(code, 4, 2) << 6u | Bits(code, 12, 12) << 5u | Bits(code, 6, 5) << 3u;
+                if (XLEN == 64 && rd != 0) {
+                    SetMemory(instr, IType::Ld, 2, rd, Imm(offset));
+                    instr->_memFunc = MemFunc::D;
+                }
+                break;
+            }
+            case cJRMVADD:
+            {
+                bool bit12 = Bits(code, 12, 12) != 0;
+                if (rs2 == 0 && rd != 0)
+                    SetJump(instr, IType::Jr, bit12 ? std::optional<RId>(1) : std::nullopt, rd, 0);
+                else if (rs2 != 0) {
+                    SetAlu(instr, AluFunc::Add, rd, bit12 ? rd : RId(0), std::nullopt);
+                    instr->_src2 = rs2;
+                }
+                break;
+            }
+            case cSWSP:
+            {
+                Word offset = Bits(code, 8, 7) << 6u | Bits(code, 12, 9) << 2u;
+                SetMemory(instr, IType::St, 2, rs2, Imm(offset));
+                break;
+            }
+            case cSDSP:
+            {
+                Word offset = Bits(code, 9, 7) << 6u | Bits(code, 12, 10) << 3u;
+                if (XLEN == 64) {
+                    SetMemory(instr, IType::St, 2, rs2, Imm(offset));
+                    instr->_memFunc = MemFunc::D;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (instr->_type == IType::Unsupported) {
+            instr->_aluFunc = AluFunc::None;
+            instr->_brFunc = BrFunc::NT;
+        }
+        if (instr->_dst.value_or(0) == 0)
+            instr->_dst.reset();
+
+        return instr;
+    }
+
+    static Word Bits(Word code, unsigned hi, unsigned lo)
+    {
+        return (code >> lo) & ((1u << (hi - lo + 1)) - 1);
+    }
+
+    static void SetAlu(InstructionPtr& instr, AluFunc func, RId dst, RId src1, std::optional<Imm> imm)
+    {
+        instr->_type = IType::Alu;
+        instr->_aluFunc = func;
+        instr->_dst = dst;
+        instr->_src1 = src1;
+        if (imm)
+            instr->_imm = *imm;
+    }
+
+    // Loads write reg, stores read it
+    static void SetMemory(InstructionPtr& instr, IType type, RId base, RId reg, Imm offset)
+    {
+        instr->_type = type;
+        instr->_aluFunc = AluFunc::Add;
+        instr->_src1 = base;
+        if (type == IType::Ld)
+            instr->_dst = reg;
+        else
+            instr->_src2 = reg;
+        instr->_imm = offset;
+    }
+
+    static void SetJump(InstructionPtr& instr, IType type, std::optional<RId> link, std::optional<RId> base, Imm offset)
+    {
+        instr->_type = type;
+        instr->_brFunc = BrFunc::AT;
+        instr->_dst = link;
+        instr->_src1 = base;
+        instr->_imm = offset;
+    }
+
+    // Quadrant in bits 4:3, funct3 in bits 2:0
+    static constexpr Word cADDI4SPN = 0b00000;
+    static constexpr Word cLW       = 0b00010;
+    static constexpr Word cLD       = 0b00011;   // RV64; C.FLW on RV32
+    static constexpr Word cSW       = 0b00110;
+    static constexpr Word cSD       = 0b00111;   // RV64; C.FSW on RV32
+    static constexpr Word cADDI     = 0b01000;
+    static constexpr Word cJAL      = 0b01001;   // C.ADDIW on RV64
+    static constexpr Word cLI       = 0b01010;
+    static constexpr Word cLUI      = 0b01011;
+    static constexpr Word cMISCALU  = 0b01100;
+    static constexpr Word cJ        = 0b01101;
+    static constexpr Word cBEQZ     = 0b01110;
+    static constexpr Word cBNEZ     = 0b01111;
+    static constexpr Word cSLLI     = 0b10000;
+    static constexpr Word cLWSP     = 0b10010;
+    static constexpr Word cLDSP     = 0b10011;   // RV64; C.FLWSP on RV32
+    static constexpr Word cJRMVADD  = 0b10100;
+    static constexpr Word cSWSP     = 0b10110;
+    static constexpr Word cSDSP     = 0b10111;   // RV64; C.FSWSP on RV32
+
+    static bool IsAmoFunc(uint32_t funct5)
+    {
+        switch (static_cast<AmoFunc>(funct5))
+        {
+            case AmoFunc::Add:
+            case AmoFunc::Swap:
+            case AmoFunc::Lr:
+            case AmoFunc::Sc:
+            case AmoFunc::Xor:
+            case AmoFunc::Or:
+            case AmoFunc::And:
+            case AmoFunc::Min:
+            case AmoFunc::Max:
+            case AmoFunc::Minu:
+            case AmoFunc::Maxu: return true;
+        }
+        return false;
+    }
+
     Imm SignExtend(Imm i, unsigned sbit)
     {
         return i + ((0xffffffff << (sbit + 1)) * ((i & (1u << sbit)) >> sbit));
@@ -174,6 +502,15 @@ private:
             uint32_t aluSel : 1;
             uint32_t reserved2 : 1;
         } r;
+        struct mType
+        {
+            uint32_t opcode : 7;
+            uint32_t rd : 5;
+            uint32_t funct3 : 3;
+            uint32_t rs1 : 5;
+            uint32_t rs2 : 5;
+            uint32_t funct7 : 7;
+        } m;
         struct iType
         {
             uint32_t opcode : 7;
@@ -208,6 +545,17 @@ private:
             uint32_t rd : 5;
             uint32_t imm31_12 : 20;
         } u;
+        struct aType
+        {
+            uint32_t opcode : 7;
+            uint32_t rd : 5;
+            uint32_t funct3 : 3;
+            uint32_t rs1 : 5;
+            uint32_t rs2 : 5;
+            uint32_t rl : 1;
+            uint32_t aq : 1;
+            uint32_t funct5 : 5;
+        } a;
         struct jType
         {
             uint32_t opcode : 7;
@@ -219,6 +567,266 @@ private:
         } j;
 
     };
+
+    // Zba and Zbb live in the funct7 space of OP and the upper immediate bits of OP-IMM. The
+    // unary operations also fix the rs2 field, which the immediate forms otherwise use as shamt.
+    struct BitManipEncoding
+    {
+        Opcode opcode;
+        Word funct7;
+        Word funct3;
+        std::optional<Word> rs2;
+        AluFunc func;
+    };
+
+    static constexpr BitManipEncoding bitManipEncodings[] = {
+        {Opcode::Op,    0b0010000, 0b010, std::nullopt, AluFunc::Sh1add},
+        {Opcode::Op,    0b0010000, 0b100, std::nullopt, AluFunc::Sh2add},
+        {Opcode::Op,    0b0010000, 0b110, std::nullopt, AluFunc::Sh3add},
+        {Opcode::Op,    0b0100000, 0b111, std::nullopt, AluFunc::Andn},
+        {Opcode::Op,    0b0100000, 0b110, std::nullopt, AluFunc::Orn},
+        {Opcode::Op,    0b0100000, 0b100, std::nullopt, AluFunc::Xnor},
+        {Opcode::Op,    0b0000101, 0b100, std::nullopt, AluFunc::Min},
+        {Opcode::Op,    0b0000101, 0b101, std::nullopt, AluFunc::Minu},
+        {Opcode::Op,    0b0000101, 0b110, std::nullopt, AluFunc::Max},
+        {Opcode::Op,    0b0000101, 0b111, std::nullopt, AluFunc::Maxu},
+        {Opcode::Op,    0b0110000, 0b001, std::nullopt, AluFunc::Rol},
+        {Opcode::Op,    0b0110000, 0b101, std::nullopt, AluFunc::Ror},
+        {XLEN == 64 ? Opcode::Op32 : Opcode::Op, 0b0000100, 0b100, 0b00000, AluFunc::ZextH},
+        {Opcode::OpImm, 0b0110000, 0b001, 0b00000,      AluFunc::Clz},
+        {Opcode::OpImm, 0b0110000, 0b001, 0b00001,      AluFunc::Ctz},
+        {Opcode::OpImm, 0b0110000, 0b001, 0b00010,      AluFunc::Cpop},
+        {Opcode::OpImm, 0b0110000, 0b001, 0b00100,      AluFunc::SextB},
+        {Opcode::OpImm, 0b0110000, 0b001, 0b00101,      AluFunc::SextH},
+        {Opcode::OpImm, 0b0110000, 0b101, std::nullopt, AluFunc::Ror},
+        {Opcode::OpImm, 0b0010100, 0b101, 0b00111,      AluFunc::OrcB},
+        {Opcode::OpImm, XLEN == 64 ? 0b0110101 : 0b0110100, 0b101, 0b11000, AluFunc::Rev8},
+        // The W and uw forms of RV64
+        {Opcode::Op32,    0b0000100, 0b000, std::nullopt, AluFunc::AddUw},
+        {Opcode::Op32,    0b0010000, 0b010, std::nullopt, AluFunc::Sh1addUw},
+        {Opcode::Op32,    0b0010000, 0b100, std::nullopt, AluFunc::Sh2addUw},
+        {Opcode::Op32,    0b0010000, 0b110, std::nullopt, AluFunc::Sh3addUw},
+        {Opcode::OpImm32, 0b0000100, 0b001, std::nullopt, AluFunc::SlliUw},
+        {Opcode::Op32,    0b0110000, 0b001, std::nullopt, AluFunc::Rol},
+        {Opcode::Op32,    0b0110000, 0b101, std::nullopt, AluFunc::Ror},
+        {Opcode::OpImm32, 0b0110000, 0b001, 0b00000,      AluFunc::Clz},
+        {Opcode::OpImm32, 0b0110000, 0b001, 0b00001,      AluFunc::Ctz},
+        {Opcode::OpImm32, 0b0110000, 0b001, 0b00010,      AluFunc::Cpop},
+        {Opcode::OpImm32, 0b0110000, 0b101, std::nullopt, AluFunc::Ror},
+    };
+
+    // Fills in an ALU instruction if the encoding is in the table; OP takes rs2, OP-IMM its
+    // shift amount. RORI and SLLI.UW on RV64 keep the top bit of their 6-bit shift amount in funct7.
+    static bool DecodeBitManip(InstructionPtr& instr, Opcode opcode, DecodedInstr decoded)
+    {
+        bool reg = opcode == Opcode::Op || opcode == Opcode::Op32;
+        for (const BitManipEncoding& e : bitManipEncodings) {
+            bool shamt6 = XLEN == 64 && ((opcode == Opcode::OpImm && !e.rs2) || e.func == AluFunc::SlliUw);
+            Word funct7 = shamt6 ? decoded.m.funct7 & ~1u : decoded.m.funct7;
+            if (e.opcode != opcode || e.funct7 != funct7 || e.funct3 != decoded.m.funct3
+                || (e.rs2 && *e.rs2 != decoded.m.rs2))
+                continue;
+            instr->_type = IType::Alu;
+            instr->_aluFunc = e.func;
+            instr->_dst = RId(decoded.m.rd);
+            instr->_src1 = RId(decoded.m.rs1);
+            if (reg)
+                instr->_src2 = RId(decoded.m.rs2);
+            else
+                instr->_imm = Word(decoded.i.imm11_0 & (XLEN - 1));
+            return true;
+        }
+        return false;
+    }
+
+    // RV64 OP-32 and OP-IMM-32: add, subtract, the shifts and the multiplies and divides on the
+    // low 32 bits of the operands, with the result sign extended
+    bool DecodeOp32(InstructionPtr& instr, Opcode opcode, DecodedInstr decoded)
+    {
+        if (DecodeBitManip(instr, opcode, decoded)) {
+            // The uw forms work on all 64 bits
+            instr->_op32 = instr->_aluFunc < AluFunc::AddUw || instr->_aluFunc > AluFunc::SlliUw;
+            return true;
+        }
+
+        bool immediate = opcode == Opcode::OpImm32;
+        Word funct3 = decoded.m.funct3;
+        Word funct7 = decoded.m.funct7;
+        std::optional<AluFunc> func;
+        if (funct3 == 0b000 && (immediate || funct7 == 0b0000000))
+            func = AluFunc::Add;
+        else if (funct3 == 0b000 && funct7 == 0b0100000)
+            func = AluFunc::Sub;
+        else if (funct3 == 0b001 && funct7 == 0b0000000)
+            func = AluFunc::Sll;
+        else if (funct3 == 0b101 && funct7 == 0b0000000)
+            func = AluFunc::Srl;
+        else if (funct3 == 0b101 && funct7 == 0b0100000)
+            func = AluFunc::Sra;
+        // MULW, DIVW, DIVUW, REMW and REMUW; there are no W forms of the high multiplies
+        bool mulDiv = !immediate && funct7 == f7MULDIV && (funct3 == 0b000 || funct3 >= 0b100);
+        if (!mulDiv && !func)
+            return false;
+
+        instr->_op32 = true;
+        instr->_dst = RId(decoded.m.rd);
+        instr->_src1 = RId(decoded.m.rs1);
+        if (mulDiv) {
+            instr->_type = IType::MulDiv;
+            instr->_mulDivFunc = static_cast<MulDivFunc>(funct3);
+            instr->_src2 = RId(decoded.m.rs2);
+            return true;
+        }
+        instr->_type = IType::Alu;
+        instr->_aluFunc = *func;
+        if (!immediate)
+            instr->_src2 = RId(decoded.m.rs2);
+        else if (func == AluFunc::Add)
+            instr->_imm = Word(SignExtend(decoded.i.imm11_0, 11));
+        else
+            instr->_imm = Word(decoded.m.rs2);
+        return true;
+    }
+
+    // V extension subset, unmasked forms only: funct6 selects the operation, and each operation
+    // allows some of the vector-vector, vector-scalar and vector-immediate forms
+    struct VectorEncoding
+    {
+        Word funct6;
+        bool vv;
+        bool vx;
+        bool vi;
+        VecFunc func;
+    };
+
+    static constexpr VectorEncoding opiEncodings[] = {
+        {0b000000, true,  true,  true,  VecFunc::Add},
+        {0b000010, true,  true,  false, VecFunc::Sub},
+        {0b000011, false, true,  true,  VecFunc::Rsub},
+        {0b000100, true,  true,  false, VecFunc::Minu},
+        {0b000101, true,  true,  false, VecFunc::Min},
+        {0b000110, true,  true,  false, VecFunc::Maxu},
+        {0b000111, true,  true,  false, VecFunc::Max},
+        {0b001001, true,  true,  true,  VecFunc::And},
+        {0b001010, true,  true,  true,  VecFunc::Or},
+        {0b001011, true,  true,  true,  VecFunc::Xor},
+        {0b010111, true,  true,  true,  VecFunc::Mv},    // vmerge encoding; unmasked it is vmv.v.*
+        {0b100101, true,  true,  true,  VecFunc::Sll},
+        {0b101000, true,  true,  true,  VecFunc::Srl},
+        {0b101001, true,  true,  true,  VecFunc::Sra},
+    };
+
+    static constexpr VectorEncoding opmEncodings[] = {
+        {0b000000, true,  false, false, VecFunc::RedSum},
+        {0b000001, true,  false, false, VecFunc::RedAnd},
+        {0b000010, true,  false, false, VecFunc::RedOr},
+        {0b000011, true,  false, false, VecFunc::RedXor},
+        {0b000100, true,  false, false, VecFunc::RedMinu},
+        {0b000101, true,  false, false, VecFunc::RedMin},
+        {0b000110, true,  false, false, VecFunc::RedMaxu},
+        {0b000111, true,  false, false, VecFunc::RedMax},
+        {0b010000, true,  false, false, VecFunc::MvXS},
+        {0b010000, false, true,  false, VecFunc::MvSX},
+        {0b100100, true,  true,  false, VecFunc::Mulhu},
+        {0b100101, true,  true,  false, VecFunc::Mul},
+        {0b100111, true,  true,  false, VecFunc::Mulh},
+        {0b101101, true,  true,  false, VecFunc::Macc},
+    };
+
+    void DecodeVector(InstructionPtr& instr, Word code)
+    {
+        Word funct3 = Bits(code, 14, 12);
+        auto rd = RId(Bits(code, 11, 7));
+        auto rs1 = RId(Bits(code, 19, 15));
+        auto rs2 = RId(Bits(code, 24, 20));
+
+        if (funct3 == fnOPCFG) {
+            instr->_type = IType::Vector;
+            instr->_vecFunc = VecFunc::SetVl;
+            instr->_dst = rd;
+            if (Bits(code, 31, 31) == 0) {
+                // vsetvli
+                instr->_vecOperand = VecOperand::Scalar;
+                instr->_src1 = rs1;
+                instr->_vtype = Bits(code, 30, 20);
+            } else if (Bits(code, 30, 30) != 0) {
+                // vsetivli: the AVL is the rs1 field
+                instr->_vecOperand = VecOperand::Imm;
+                instr->_imm = Word(rs1);
+                instr->_vtype = Bits(code, 29, 20);
+            } else if (Bits(code, 30, 25) == 0) {
+                // vsetvl: vtype comes from rs2
+                instr->_vecOperand = VecOperand::Scalar;
+                instr->_src1 = rs1;
+                instr->_src2 = rs2;
+            } else {
+                instr->_type = IType::Unsupported;
+            }
+            return;
+        }
+
+        bool masked = Bits(code, 25, 25) == 0;
+        bool vv = funct3 == fnOPIVV || funct3 == fnOPMVV;
+        bool vx = funct3 == fnOPIVX || funct3 == fnOPMVX;
+        bool vi = funct3 == fnOPIVI;
+        const VectorEncoding* first = funct3 == fnOPMVV || funct3 == fnOPMVX ? std::begin(opmEncodings)
+                                                                             : std::begin(opiEncodings);
+        const VectorEncoding* last = funct3 == fnOPMVV || funct3 == fnOPMVX ? std::end(opmEncodings)
+                                                                            : std::end(opiEncodings);
+        if (masked || !(vv || vx || vi))
+            return;
+        for (const VectorEncoding* e = first; e != last; ++e) {
+            if (e->funct6 != Bits(code, 31, 26) || !((vv && e->vv) || (vx && e->vx) || (vi && e->vi)))
+                continue;
+            // The unary forms fix the register field they do not use
+            if ((e->func == VecFunc::Mv || e->func == VecFunc::MvSX) && rs2 != 0)
+                return;
+            if (e->func == VecFunc::MvXS && rs1 != 0)
+                return;
+
+            instr->_type = IType::Vector;
+            instr->_vecFunc = e->func;
+            instr->_vs2 = rs2;
+            if (e->func == VecFunc::MvXS)
+                instr->_dst = rd;
+            else
+                instr->_vd = rd;
+            if (vv) {
+                instr->_vecOperand = VecOperand::Vector;
+                instr->_vs1 = rs1;
+            } else if (vx) {
+                instr->_vecOperand = VecOperand::Scalar;
+                instr->_src1 = rs1;
+            } else {
+                instr->_vecOperand = VecOperand::Imm;
+                instr->_imm = SignExtend(rs1, 4);
+            }
+            return;
+        }
+    }
+
+    // Unit-stride and strided loads and stores of 8, 16 and 32-bit elements. Scalar floating point
+    // loads and stores share the opcodes and stay unsupported.
+    void DecodeVectorMemory(InstructionPtr& instr, Word code)
+    {
+        Word width = Bits(code, 14, 12);
+        Word mop = Bits(code, 27, 26);
+        bool unitStride = mop == 0b00 && Bits(code, 24, 20) == 0;
+        bool strided = mop == 0b10;
+        bool plain = Bits(code, 31, 28) == 0 && Bits(code, 25, 25) == 1;   // nf = 0, mew = 0, unmasked
+        if ((width != 0b000 && width != 0b101 && width != 0b110) || !plain || !(unitStride || strided))
+            return;
+
+        instr->_type = IType::Vector;
+        instr->_vecFunc = static_cast<Opcode>(Bits(code, 6, 0)) == Opcode::LoadFp ? VecFunc::Load : VecFunc::Store;
+        instr->_memFunc = width == 0b000 ? MemFunc::B : width == 0b101 ? MemFunc::H : MemFunc::W;
+        instr->_vd = RId(Bits(code, 11, 7));
+        instr->_src1 = RId(Bits(code, 19, 15));
+        if (strided)
+            instr->_src2 = RId(Bits(code, 24, 20));
+    }
+
+    const CustomExtensions* _custom;
 };
 
 #endif //RISCV_SIM_DECODER_H
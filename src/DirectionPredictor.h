@@ -0,0 +1,392 @@
+#ifndef RISCV_SIM_DIRECTIONPREDICTOR_H
+#define RISCV_SIM_DIRECTIONPREDICTOR_H
+
+#include <cmath>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "BaseTypes.h"
+
+enum class PredictorKind : uint8_t
+{
+    None,
+    Bimodal,
+    Gshare,
+    Tournament,
+    Tage,
+};
+
+inline const char* ToString(PredictorKind kind)
+{
+    switch (kind)
+    {
+        case PredictorKind::None: return "none";
+        case PredictorKind::Bimodal: return "bimodal";
+        case PredictorKind::Gshare: return "gshare";
+        case PredictorKind::Tournament: return "tournament";
+        case PredictorKind::Tage: return "tage";
+    }
+    return "unknown";
+}
+
+inline std::optional<PredictorKind> ParsePredictorKind(const std::string& name)
+{
+    for (PredictorKind kind : {PredictorKind::None, PredictorKind::Bimodal, PredictorKind::Gshare,
+                               PredictorKind::Tournament, PredictorKind::Tage}) {
+        if (name == ToString(kind))
+            return kind;
+    }
+    return std::nullopt;
+}
+
+struct PredictorConfig
+{
+    PredictorKind kind = PredictorKind::Bimodal;
+    size_t bhtEntries = 256;        // counters of the bimodal, gshare and tournament global tables, TAGE base table
+    size_t historyBits = 12;        // gshare global history, tournament local history
+    size_t localEntries = 256;      // tournament local history table
+    size_t tageTables = 4;          // tagged TAGE components
+    size_t tageEntries = 256;       // entries per tagged component
+    size_t tageTagBits = 9;
+    size_t tageMinHistory = 4;
+    size_t tageMaxHistory = 64;
+    size_t btbEntries = 64;
+    size_t rasEntries = 8;
+    size_t reportRows = 0;          // most mispredicted branches listed with the statistics
+
+    bool IsValid() const
+    {
+        auto powerOfTwo = [](size_t v) { return v != 0 && (v & (v - 1)) == 0; };
+        // A TAGE table is indexed with at least one bit, and the pc is shifted right by the index
+        // bits plus the table number, which has to stay below 32
+        size_t tageIndexBits = 0;
+        while ((size_t(2) << tageIndexBits) <= tageEntries)
+            ++tageIndexBits;
+        return powerOfTwo(bhtEntries) && powerOfTwo(btbEntries) && powerOfTwo(localEntries)
+               && powerOfTwo(tageEntries) && tageEntries >= 2 && historyBits >= 1 && historyBits <= 24
+               && tageTables >= 1 && tageIndexBits + tageTables <= 32
+               && tageTagBits >= 2 && tageTagBits <= 16 && tageMinHistory >= 1 && tageMinHistory <= tageMaxHistory
+               && tageMaxHistory <= 64;
+    }
+};
+
+// 2-bit saturating counter, taken when the upper bit is set
+inline void TrainCounter(uint8_t& counter, bool taken)
+{
+    if (taken && counter < 3)
+        ++counter;
+    else if (!taken && counter > 0)
+        --counter;
+}
+
+inline uint64_t HistoryMask(size_t bits)
+{
+    return bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+}
+
+// Taken/not-taken guess for a conditional branch. history holds the outcomes of the older
+// branches, the newest in bit 0, as they were when the branch was fetched.
+class DirectionPredictor
+{
+public:
+    DirectionPredictor() = default;
+    virtual ~DirectionPredictor() = default;
+    DirectionPredictor(const DirectionPredictor &) = delete;
+    DirectionPredictor& operator=(const DirectionPredictor&) = delete;
+
+    virtual bool Predict(Word ip, uint64_t history) const = 0;
+    virtual void Update(Word ip, uint64_t history, bool taken) = 0;
+    // Size of the prediction tables, to compare predictors at equal budget
+    virtual size_t StorageBits() const = 0;
+};
+
+class BimodalPredictor : public DirectionPredictor
+{
+public:
+    explicit BimodalPredictor(size_t entries)
+        : _counters(entries, 1)
+    {
+
+    }
+
+    bool Predict(Word ip, uint64_t) const override
+    {
+        return _counters[Index(ip)] >= 2;
+    }
+
+    void Update(Word ip, uint64_t, bool taken) override
+    {
+        TrainCounter(_counters[Index(ip)], taken);
+    }
+
+    size_t StorageBits() const override
+    {
+        return 2 * _counters.size();
+    }
+
+private:
+    size_t Index(Word ip) const
+    {
+        return (ip >> 2u) & (_counters.size() - 1);
+    }
+
+    std::vector<uint8_t> _counters;
+};
+
+// Counters indexed by the branch address xor-ed with the global history
+class GsharePredictor : public DirectionPredictor
+{
+public:
+    GsharePredictor(size_t entries, size_t historyBits)
+        : _counters(entries, 1)
+        , _historyMask(HistoryMask(historyBits))
+    {
+
+    }
+
+    bool Predict(Word ip, uint64_t history) const override
+    {
+        return _counters[Index(ip, history)] >= 2;
+    }
+
+    void Update(Word ip, uint64_t history, bool taken) override
+    {
+        TrainCounter(_counters[Index(ip, history)], taken);
+    }
+
+    size_t StorageBits() const override
+    {
+        return 2 * _counters.size();
+    }
+
+private:
+    size_t Index(Word ip, uint64_t history) const
+    {
+        return ((ip >> 2u) ^ (history & _historyMask)) & (_counters.size() - 1);
+    }
+
+    std::vector<uint8_t> _counters;
+    uint64_t _historyMask;
+};
+
+// Alpha 21264 style: a per-branch local history predictor and a global history predictor,
+// with a chooser indexed by global history picking between them
+class TournamentPredictor : public DirectionPredictor
+{
+public:
+    TournamentPredictor(size_t globalEntries, size_t localEntries, size_t historyBits)
+        : _localHistory(localEntries)
+        , _local(size_t(1) << historyBits, 1)
+        , _global(globalEntries, 1)
+        , _chooser(globalEntries, 1)
+        , _historyBits(historyBits)
+    {
+
+    }
+
+    bool Predict(Word ip, uint64_t history) const override
+    {
+        size_t g = history & (_global.size() - 1);
+        return _chooser[g] >= 2 ? _global[g] >= 2 : _local[LocalHistory(ip)] >= 2;
+    }
+
+    void Update(Word ip, uint64_t history, bool taken) override
+    {
+        size_t g = history & (_global.size() - 1);
+        Word& local = _localHistory[(ip >> 2u) & (_localHistory.size() - 1)];
+        bool localCorrect = (_local[local] >= 2) == taken;
+        bool globalCorrect = (_global[g] >= 2) == taken;
+        if (localCorrect != globalCorrect)
+            TrainCounter(_chooser[g], globalCorrect);
+
+        TrainCounter(_local[local], taken);
+        TrainCounter(_global[g], taken);
+        local = Word(((local << 1u) | Word(taken)) & HistoryMask(_historyBits));
+    }
+
+    size_t StorageBits() const override
+    {
+        return _localHistory.size() * _historyBits + 2 * (_local.size() + _global.size() + _chooser.size());
+    }
+
+private:
+    Word LocalHistory(Word ip) const
+    {
+        return _localHistory[(ip >> 2u) & (_localHistory.size() - 1)];
+    }
+
+    std::vector<Word> _localHistory;
+    std::vector<uint8_t> _local;
+    std::vector<uint8_t> _global;
+    std::vector<uint8_t> _chooser;
+    size_t _historyBits;
+};
+
+// TAGE: a bimodal base predictor and tagged tables indexed with geometrically growing
+// global history lengths. The longest matching table provides the prediction.
+class TagePredictor : public DirectionPredictor
+{
+public:
+    explicit TagePredictor(const PredictorConfig& config)
+        : _base(config.bhtEntries)
+        , _tables(config.tageTables, std::vector<TaggedEntry>(config.tageEntries))
+        , _indexBits(unsigned(std::log2(config.tageEntries)))
+        , _tagBits(unsigned(config.tageTagBits))
+    {
+        double ratio = _tables.size() == 1 ? 1.0 : std::pow(double(config.tageMaxHistory) / double(config.tageMinHistory),
+                                                            1.0 / double(_tables.size() - 1));
+        for (size_t i = 0; i < _tables.size(); ++i)
+            _lengths.push_back(unsigned(std::lround(double(config.tageMinHistory) * std::pow(ratio, double(i)))));
+    }
+
+    bool Predict(Word ip, uint64_t history) const override
+    {
+        Lookup lookup = Find(ip, history);
+        return lookup.provider ? EntryAt(lookup, *lookup.provider).counter >= 0 : _base.Predict(ip, history);
+    }
+
+    void Update(Word ip, uint64_t history, bool taken) override
+    {
+        Lookup lookup = Find(ip, history);
+        bool altPrediction = lookup.alt ? EntryAt(lookup, *lookup.alt).counter >= 0 : _base.Predict(ip, history);
+        bool prediction = altPrediction;
+
+        if (lookup.provider) {
+            TaggedEntry& provider = EntryAt(lookup, *lookup.provider);
+            prediction = provider.counter >= 0;
+            if (prediction != altPrediction) {
+                if (prediction == taken && provider.useful < 3)
+                    ++provider.useful;
+                else if (prediction != taken && provider.useful > 0)
+                    --provider.useful;
+            }
+            if (taken && provider.counter < 3)
+                ++provider.counter;
+            else if (!taken && provider.counter > -4)
+                --provider.counter;
+        } else {
+            _base.Update(ip, history, taken);
+        }
+
+        if (prediction != taken)
+            Allocate(lookup, taken);
+
+        // Periodically age the usefulness bits so stale entries can be replaced
+        if (++_updates % agingPeriod == 0) {
+            for (std::vector<TaggedEntry>& table : _tables)
+                for (TaggedEntry& e : table)
+                    e.useful >>= 1u;
+        }
+    }
+
+    size_t StorageBits() const override
+    {
+        return _base.StorageBits() + _tables.size() * _tables.front().size() * (_tagBits + 3 + 2);
+    }
+
+private:
+    static constexpr uint64_t agingPeriod = 1u << 18u;
+
+    struct TaggedEntry
+    {
+        uint16_t tag = 0;
+        int8_t counter = 0;     // 3-bit signed, taken when non-negative
+        uint8_t useful = 0;
+        bool valid = false;
+    };
+
+    struct Lookup
+    {
+        std::vector<size_t> index;
+        std::vector<uint16_t> tag;
+        std::optional<size_t> provider;
+        std::optional<size_t> alt;
+    };
+
+    static uint32_t Fold(uint64_t history, unsigned length, unsigned bits)
+    {
+        uint64_t h = history & HistoryMask(length);
+        uint32_t folded = 0;
+        for (unsigned i = 0; i < length; i += bits) {
+            folded ^= uint32_t(h & HistoryMask(bits));
+            h >>= bits;
+        }
+        return folded;
+    }
+
+    Lookup Find(Word ip, uint64_t history) const
+    {
+        Lookup lookup;
+        Word pc = ip >> 2u;
+        for (size_t i = 0; i < _tables.size(); ++i) {
+            size_t index = (pc ^ (pc >> (_indexBits + i)) ^ Fold(history, _lengths[i], _indexBits)) & (_tables[i].size() - 1);
+            uint16_t tag = uint16_t((pc ^ Fold(history, _lengths[i], _tagBits) ^ (Fold(history, _lengths[i], _tagBits - 1) << 1u))
+                                    & HistoryMask(_tagBits));
+            lookup.index.push_back(index);
+            lookup.tag.push_back(tag);
+        }
+        for (size_t i = _tables.size(); i-- > 0;) {
+            const TaggedEntry& e = _tables[i][lookup.index[i]];
+            if (!e.valid || e.tag != lookup.tag[i])
+                continue;
+            if (!lookup.provider)
+                lookup.provider = i;
+            else if (!lookup.alt)
+                lookup.alt = i;
+        }
+        return lookup;
+    }
+
+    TaggedEntry& EntryAt(const Lookup& lookup, size_t table)
+    {
+        return _tables[table][lookup.index[table]];
+    }
+
+    const TaggedEntry& EntryAt(const Lookup& lookup, size_t table) const
+    {
+        return _tables[table][lookup.index[table]];
+    }
+
+    // Claims an entry in a longer-history table than the one that mispredicted
+    void Allocate(const Lookup& lookup, bool taken)
+    {
+        size_t first = lookup.provider ? *lookup.provider + 1 : 0;
+        for (size_t i = first; i < _tables.size(); ++i) {
+            TaggedEntry& e = EntryAt(lookup, i);
+            if (e.useful == 0) {
+                e = {lookup.tag[i], int8_t(taken ? 0 : -1), 0, true};
+                return;
+            }
+        }
+        for (size_t i = first; i < _tables.size(); ++i) {
+            TaggedEntry& e = EntryAt(lookup, i);
+            if (e.useful > 0)
+                --e.useful;
+        }
+    }
+
+    BimodalPredictor _base;
+    std::vector<std::vector<TaggedEntry>> _tables;
+    std::vector<unsigned> _lengths;
+    unsigned _indexBits;
+    unsigned _tagBits;
+    uint64_t _updates = 0;
+};
+
+inline std::unique_ptr<DirectionPredictor> MakeDirectionPredictor(const PredictorConfig& config)
+{
+    switch (config.kind)
+    {
+        case PredictorKind::None: return nullptr;
+        case PredictorKind::Bimodal: return std::make_unique<BimodalPredictor>(config.bhtEntries);
+        case PredictorKind::Gshare: return std::make_unique<GsharePredictor>(config.bhtEntries, config.historyBits);
+        case PredictorKind::Tournament:
+            return std::make_unique<TournamentPredictor>(config.bhtEntries, config.localEntries, config.historyBits);
+        case PredictorKind::Tage: return std::make_unique<TagePredictor>(config);
+    }
+    return nullptr;
+}
+
+#endif //RISCV_SIM_DIRECTIONPREDICTOR_H
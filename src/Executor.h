@@ -2,49 +2,53 @@
 #ifndef RISCV_SIM_EXECUTOR_H
 #define RISCV_SIM_EXECUTOR_H
 
+#include <algorithm>
+#include <type_traits>
+
 #include "Instruction.h"
 
+// The ALU, multiply and AMO operations are templates on the operand type: Word, or uint32_t for
+// the W forms of RV64, whose result is then sign extended.
+
 class Executor
 {
 public:
     void Execute(InstructionPtr& instr, Word ip)
     {
+        if (instr->_fusion != Fusion::None)
+            instr->_src1Val = FusedFirst(*instr, ip);
+
         switch(instr->_type)
         {
             case IType::Alu: {
                 Word processing_result = alu_processing(instr);
                 instr->_data = processing_result;
-                instr->_nextIp = ip + 4;
+                instr->_nextIp = ip + instr->_length;
                 break;
             }
             case IType::Ld:
             {
                 instr->_addr = alu_processing(instr);
-                instr->_nextIp = ip + 4;
+                instr->_nextIp = ip + instr->_length;
                 break;
             }
             case IType::St:
             {
                 instr->_addr = alu_processing(instr);
                 instr->_data = instr->_src2Val;
-                instr->_nextIp = ip + 4;
+                instr->_nextIp = ip + instr->_length;
                 break;
             }
-            case IType::Csrw:
-            {
-                instr->_data = instr->_src1Val;
-                instr->_nextIp = ip + 4;
-                break;
-            }
-            case IType::Csrr:
+            case IType::Csr:
             {
                 instr->_data = instr->_csrVal;
-                instr->_nextIp = ip + 4;
+                instr->_csrData = CsrResult(*instr);
+                instr->_nextIp = ip + instr->_length;
                 break;
             }
             case IType::J:
             {
-                instr->_data = ip + 4;
+                instr->_data = ip + instr->_length;
             }
             case IType::Br:
             {
@@ -52,29 +56,211 @@ public:
                 if (processing_result)
                     instr->_nextIp = ip + *instr->_imm;
                 else
-                    instr->_nextIp = ip + 4;
+                    instr->_nextIp = ip + instr->_length;
                 break;
             }
             case IType::Jr:
             {
-                instr->_data = ip + 4;
+                instr->_data = ip + instr->_length;
 
                 bool processing_result = branching_processing(instr);
                 if (processing_result)
                     instr->_nextIp = *instr->_imm + instr->_src1Val;
                 else
-                    instr->_nextIp = ip + 4;
+                    instr->_nextIp = ip + instr->_length;
                 break;
             }
             case IType::Auipc:
             {
                 instr->_data = ip + *instr->_imm;
-                instr->_nextIp = ip + 4;
+                instr->_nextIp = ip + instr->_length;
+                break;
+            }
+            case IType::MulDiv:
+            {
+                if (XLEN == 64 && instr->_op32)
+                    instr->_data = SignExtend32(MulDivResult<uint32_t>(instr->_mulDivFunc, uint32_t(instr->_src1Val),
+                                                                       uint32_t(instr->_src2Val)));
+                else
+                    instr->_data = MulDivResult<Word>(instr->_mulDivFunc, instr->_src1Val, instr->_src2Val);
+                instr->_nextIp = ip + instr->_length;
+                break;
+            }
+            case IType::Vector:
+            {
+                // The vector register file performs the operation
+                instr->_nextIp = ip + instr->_length;
+                break;
+            }
+            case IType::Custom:
+            {
+                // The custom unit performs the operation, since it may access memory
+                instr->_nextIp = ip + instr->_length;
+                break;
+            }
+            case IType::Fence:
+            {
+                // The cores wait for older stores and, for FENCE.I, flush the code cache
+                instr->_nextIp = ip + instr->_length;
+                break;
+            }
+            case IType::Amo:
+            {
+                // The memory side performs the operation; rd gets the value it returns
+                instr->_addr = instr->_src1Val;
+                instr->_nextIp = ip + instr->_length;
                 break;
             }
         }
     }
 
+    // New memory value of an AMO of the given width, from the old one and rs2
+    static Word AmoResult(AmoFunc func, MemFunc width, Word memory, Word operand)
+    {
+        if (XLEN == 64 && width == MemFunc::W)
+            return SignExtend32(AmoResult<uint32_t>(func, uint32_t(memory), uint32_t(operand)));
+        return AmoResult<Word>(func, memory, operand);
+    }
+
+    template <typename T>
+    static T AmoResult(AmoFunc func, T memory, T operand)
+    {
+        using S = std::make_signed_t<T>;
+        switch (func)
+        {
+            case AmoFunc::Swap: return operand;
+            case AmoFunc::Add: return memory + operand;
+            case AmoFunc::Xor: return memory ^ operand;
+            case AmoFunc::And: return memory & operand;
+            case AmoFunc::Or: return memory | operand;
+            case AmoFunc::Min: return S(memory) < S(operand) ? memory : operand;
+            case AmoFunc::Max: return S(memory) > S(operand) ? memory : operand;
+            case AmoFunc::Minu: return std::min(memory, operand);
+            case AmoFunc::Maxu: return std::max(memory, operand);
+            case AmoFunc::Lr:
+            case AmoFunc::Sc: break;
+        }
+        return memory;
+    }
+
+    // New CSR value from the old one in _csrVal; CSRRS and CSRRC leave the CSR alone when the
+    // source is x0 or the immediate is zero
+    static std::optional<Word> CsrResult(const Instruction& instr)
+    {
+        bool immediate = !instr._src1;
+        Word operand = immediate ? *instr._imm : instr._src1Val;
+        bool noSource = immediate ? operand == 0 : *instr._src1 == 0;
+        switch (instr._csrFunc)
+        {
+            case CsrFunc::Rw:
+            case CsrFunc::Rwi: return operand;
+            case CsrFunc::Rs:
+            case CsrFunc::Rsi: return noSource ? std::nullopt : std::optional<Word>(instr._csrVal | operand);
+            case CsrFunc::Rc:
+            case CsrFunc::Rci: return noSource ? std::nullopt : std::optional<Word>(instr._csrVal & ~operand);
+        }
+        return std::nullopt;
+    }
+
+    // Zba and Zbb operations, on the host's bit-counting and byte-swap builtins
+    template <typename T>
+    static T BitManipResult(AluFunc func, T first, T second)
+    {
+        using S = std::make_signed_t<T>;
+        constexpr unsigned bits = 8 * sizeof(T);
+        constexpr bool wide = sizeof(T) == 8;
+        T shamt = second % bits;
+        switch (func)
+        {
+            case AluFunc::Sh1add: return (first << 1u) + second;
+            case AluFunc::Sh2add: return (first << 2u) + second;
+            case AluFunc::Sh3add: return (first << 3u) + second;
+            case AluFunc::AddUw: return T(uint32_t(first)) + second;
+            case AluFunc::Sh1addUw: return (T(uint32_t(first)) << 1u) + second;
+            case AluFunc::Sh2addUw: return (T(uint32_t(first)) << 2u) + second;
+            case AluFunc::Sh3addUw: return (T(uint32_t(first)) << 3u) + second;
+            case AluFunc::SlliUw: return T(uint32_t(first)) << shamt;
+            case AluFunc::Andn: return first & ~second;
+            case AluFunc::Orn: return first | ~second;
+            case AluFunc::Xnor: return ~(first ^ second);
+            case AluFunc::Clz: return first == 0 ? bits : T(wide ? __builtin_clzll(first) : __builtin_clz(first));
+            case AluFunc::Ctz: return first == 0 ? bits : T(wide ? __builtin_ctzll(first) : __builtin_ctz(first));
+            case AluFunc::Cpop: return T(wide ? __builtin_popcountll(first) : __builtin_popcount(first));
+            case AluFunc::Min: return S(first) < S(second) ? first : second;
+            case AluFunc::Minu: return std::min(first, second);
+            case AluFunc::Max: return S(first) > S(second) ? first : second;
+            case AluFunc::Maxu: return std::max(first, second);
+            case AluFunc::SextB: return T(int8_t(first));
+            case AluFunc::SextH: return T(int16_t(first));
+            case AluFunc::ZextH: return first & 0xffffu;
+            case AluFunc::Rol: return (first << shamt) | (first >> ((bits - shamt) % bits));
+            case AluFunc::Ror: return (first >> shamt) | (first << ((bits - shamt) % bits));
+            case AluFunc::OrcB:
+            {
+                T result = 0;
+                for (T byte = 0xffu; byte != 0; byte <<= 8u)
+                    result |= first & byte ? byte : 0;
+                return result;
+            }
+            case AluFunc::Rev8:
+                if constexpr (wide)
+                    return __builtin_bswap64(first);
+                else
+                    return __builtin_bswap32(first);
+            default: return T();
+        }
+    }
+
+    // Division by zero and the signed overflow case give the results the M extension defines
+    // instead of trapping
+    template <typename T>
+    static T MulDivResult(MulDivFunc func, T first, T second)
+    {
+        using S = std::make_signed_t<T>;
+        using Double = typename XlenTypes<8 * sizeof(T)>::DoubleWord;
+        using SignedDouble = typename XlenTypes<8 * sizeof(T)>::SignedDoubleWord;
+        constexpr unsigned bits = 8 * sizeof(T);
+        auto signedFirst = S(first);
+        auto signedSecond = S(second);
+        bool overflow = first == T(1) << (bits - 1) && signedSecond == -1;
+        switch (func)
+        {
+            case MulDivFunc::Mul: return first * second;
+            case MulDivFunc::Mulh: return T(Double(SignedDouble(signedFirst) * SignedDouble(signedSecond)) >> bits);
+            case MulDivFunc::Mulhsu: return T(Double(SignedDouble(signedFirst) * SignedDouble(second)) >> bits);
+            case MulDivFunc::Mulhu: return T((Double(first) * Double(second)) >> bits);
+            case MulDivFunc::Div:
+                if (second == 0)
+                    return ~T(0);
+                return overflow ? first : T(signedFirst / signedSecond);
+            case MulDivFunc::Divu: return second == 0 ? ~T(0) : first / second;
+            case MulDivFunc::Rem:
+                if (second == 0)
+                    return first;
+                return overflow ? 0 : T(signedFirst % signedSecond);
+            case MulDivFunc::Remu: return second == 0 ? first : first % second;
+        }
+        return 0;
+    }
+
+    static Word SignExtend32(uint32_t value)
+    {
+        return Word(SignedWord(int32_t(value)));
+    }
+
+    // Result of the first instruction of a fused pair, the first operand of the second
+    static Word FusedFirst(const Instruction& instr, Word ip)
+    {
+        switch (instr._fusion)
+        {
+            case Fusion::LuiAddi: return instr._fusedImm;
+            case Fusion::AuipcJalr:
+            case Fusion::AuipcLoad: return ip + instr._fusedImm;
+            case Fusion::SlliSrli: return instr._src1Val << (instr._fusedImm % XLEN);
+            default: return instr._src1Val;
+        }
+    }
+
 private:
     Word alu_processing (InstructionPtr& instr)
     {
@@ -94,42 +280,55 @@ private:
             is_valid = false;
 
         if (is_valid) {
-            switch (instr->_aluFunc)
-            {
-                case AluFunc::Add:
-                    return first_operand + second_operand;
-                case AluFunc::Sub:
-                    return first_operand - second_operand;
-                case AluFunc::And:
-                    return first_operand & second_operand;
-                case AluFunc::Or:
-                    return first_operand | second_operand;
-                case AluFunc::Xor:
-                    return first_operand ^ second_operand;
-
-                case AluFunc::Slt:
-                {
-                    int first_value = first_operand, second_value = second_operand;
-                    return first_value < second_value;
-                }
-                case AluFunc::Sltu:
-                    return first_operand < second_operand;
-                case AluFunc::Sll:
-                    return first_operand << (second_operand % 32);
-                case AluFunc::Srl:
-                    return first_operand >> (second_operand % 32);
-                case AluFunc::Sra:
-                {
-                    int number = first_operand;
-                    number = number >> (second_operand % 32);
-                    return Word(number);
-                }
-            }
+            if (XLEN == 64 && instr->_op32)
+                return SignExtend32(alu_result<uint32_t>(instr->_aluFunc, uint32_t(first_operand),
+                                                         uint32_t(second_operand)));
+            return alu_result<Word>(instr->_aluFunc, first_operand, second_operand);
         }
 
         return Word();
     }
 
+    template <typename T>
+    static T alu_result(AluFunc func, T first_operand, T second_operand)
+    {
+        using S = std::make_signed_t<T>;
+        constexpr unsigned bits = 8 * sizeof(T);
+        switch (func)
+        {
+            case AluFunc::Add:
+                return first_operand + second_operand;
+            case AluFunc::Sub:
+                return first_operand - second_operand;
+            case AluFunc::And:
+                return first_operand & second_operand;
+            case AluFunc::Or:
+                return first_operand | second_operand;
+            case AluFunc::Xor:
+                return first_operand ^ second_operand;
+
+            case AluFunc::Slt:
+            {
+                S first_value = first_operand, second_value = second_operand;
+                return first_value < second_value;
+            }
+            case AluFunc::Sltu:
+                return first_operand < second_operand;
+            case AluFunc::Sll:
+                return first_operand << (second_operand % bits);
+            case AluFunc::Srl:
+                return first_operand >> (second_operand % bits);
+            case AluFunc::Sra:
+            {
+                S number = first_operand;
+                number = number >> (second_operand % bits);
+                return T(number);
+            }
+            default:
+                return BitManipResult<T>(func, first_operand, second_operand);
+        }
+    }
+
     bool branching_processing(InstructionPtr& instr)
     {
         Word first_operand, second_operand;
@@ -156,7 +355,7 @@ private:
             }
             case BrFunc :: Lt:
             {
-                int first_value = first_operand, second_value = second_operand;
+                SignedWord first_value = first_operand, second_value = second_operand;
                 if (first_value < second_value)
                     return true;
                 else
@@ -170,7 +369,7 @@ private:
                     return false;
             }case BrFunc :: Ge:
             {
-                int first_value = first_operand, second_value = second_operand;
+                SignedWord first_value = first_operand, second_value = second_operand;
                 if (first_value >= second_value)
                     return true;
                 else
@@ -0,0 +1,220 @@
+#ifndef RISCV_SIM_FETCHUNIT_H
+#define RISCV_SIM_FETCHUNIT_H
+
+#include <deque>
+#include <ostream>
+
+#include "BranchPredictor.h"
+#include "Memory.h"
+#include "Decoder.h"
+#include "RegisterFile.h"
+#include "CsrFile.h"
+#include "Executor.h"
+#include "VectorRegisterFile.h"
+#include "CustomUnit.h"
+#include "MacroFusion.h"
+
+struct FetchConfig
+{
+    size_t width = 4;
+    size_t queueEntries = 16;
+    size_t latency = 2;         // cycles from fetch until the back end may take an instruction
+    bool alignGroups = false;   // a group never crosses a width-sized aligned block
+    bool fusion = false;        // fuse the pairs MacroFusion knows into one operation
+};
+
+// Front end shared by the wide timing cores. Instructions run functionally, in program order,
+// the moment they are fetched, and wait in the fetch queue for the back end to replay their
+// timing. Nothing runs down the wrong path: a mispredicted instruction stops fetch until the
+// back end resolves it and calls Resume. A FENCE.I stops fetch the same way, until the back end
+// has flushed the code cache.
+class FetchUnit
+{
+public:
+    struct Fetched
+    {
+        InstructionPtr instr;
+        Word ip;
+        Prediction prediction;
+        bool mispredicted;
+        uint64_t readyCycle;
+    };
+
+    FetchUnit(CachedMem& mem, CsrFile& csrf, BranchPredictor& predictor, const FetchConfig& config, size_t vlen,
+              const CustomExtensions* custom)
+        : _mem(mem)
+        , _csrf(csrf)
+        , _predictor(predictor)
+        , _config(config)
+        , _decoder(custom)
+        , _vrf(vlen)
+        , _fusion(config.fusion)
+    {
+
+    }
+
+    void Reset(Word ip)
+    {
+        _fetchIp = ip;
+        _blocked = false;
+        _resumeCycle.reset();
+        _queue.clear();
+    }
+
+    // Fetches one group. CSR accesses see counters and send host messages, so they are only
+    // fetched once the back end reports everything older as finished.
+    void Clock(uint64_t cycle, bool backEndIdle)
+    {
+        if (_blocked) {
+            if (!_resumeCycle || *_resumeCycle > cycle) {
+                ++(_fenceBlocked ? _fenceStalls : _mispredictStalls);
+                return;
+            }
+            _blocked = false;
+            _resumeCycle.reset();
+        }
+
+        // The I-cache only provides timing here; instruction words come from the functional view of memory
+        _mem.Request(_fetchIp);
+        if (!_mem.Response(_csrf.getCycleNumber())) {
+            ++_fetchStalls;
+            return;
+        }
+
+        Word line = _mem.CodeLineAddr(_fetchIp);
+        Word block = _fetchIp / (4 * _config.width);
+        size_t fetched = 0;
+        while (fetched < _config.width && _queue.size() < _config.queueEntries) {
+            if (_mem.CodeLineAddr(_fetchIp) != line || (_config.alignGroups && _fetchIp / (4 * _config.width) != block))
+                break;
+
+            Word ip = _fetchIp;
+            InstructionPtr instr = _decoder.Decode(_mem.PeekCode(ip));
+            if (_fusion.TryFuse(instr, ip, _mem, _decoder))
+                _csrf.CountEvent(HpmEvent::FusedPair);
+            Word length = instr->_length;
+            // Only the first instruction of a group may continue in the next line
+            if (fetched != 0 && _mem.CodeLineAddr(ip + length - 1) != line)
+                break;
+            if (instr->_type == IType::Csr && (!backEndIdle || !_queue.empty())) {
+                ++_serializeStalls;
+                break;
+            }
+
+            // An atomic of a parallel hart waits for the quantum boundary
+            if (!ExecuteFunctionally(instr, ip)) {
+                ++_atomicStalls;
+                break;
+            }
+            Prediction prediction = _predictor.Predict(ip, length);
+            _fetchIp = instr->_nextIp;
+            bool mispredicted = instr->_nextIp != prediction.nextIp;
+            if (mispredicted)
+                _csrf.CountEvent(HpmEvent::BranchMispredict);
+            _queue.push_back(Fetched{std::move(instr), ip, prediction, mispredicted, cycle + _config.latency});
+            ++fetched;
+
+            if (mispredicted || IsFenceI(*_queue.back().instr)) {
+                _blocked = true;
+                _fenceBlocked = !mispredicted;
+                break;
+            }
+            // A taken control transfer ends the fetch group
+            if (_fetchIp != ip + length)
+                break;
+        }
+
+        if (fetched != 0) {
+            ++_groups;
+            _groupInstructions += fetched;
+        }
+        _mem.Request(_fetchIp);
+    }
+
+    // The mispredicted instruction or FENCE.I resolved; fetch restarts on its real successor from the given cycle
+    void Resume(uint64_t cycle)
+    {
+        _resumeCycle = cycle;
+    }
+
+    bool Ready(uint64_t cycle) const
+    {
+        return !_queue.empty() && _queue.front().readyCycle <= cycle;
+    }
+
+    bool Empty() const
+    {
+        return _queue.empty();
+    }
+
+    Fetched& Front()
+    {
+        return _queue.front();
+    }
+
+    void Pop()
+    {
+        _queue.pop_front();
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Fetch: groups = " << _groups << ", instructions per group = "
+            << (_groups == 0 ? 0.0 : double(_groupInstructions) / double(_groups)) << ", stalls: cache = "
+            << _fetchStalls << ", mispredict = " << _mispredictStalls << ", serialize = " << _serializeStalls
+            << ", atomic = " << _atomicStalls << ", fence.i = " << _fenceStalls << std::endl;
+        _fusion.PrintStats(out);
+    }
+
+private:
+    bool ExecuteFunctionally(InstructionPtr& instr, Word ip)
+    {
+        _rf.Read(instr);
+        _csrf.Read(instr);
+        _exe.Execute(instr, ip);
+        if (instr->_type == IType::Ld) {
+            instr->_data = LoadValue(instr->_memFunc, _mem.Peek(instr->_addr), instr->_addr);
+        } else if (instr->_type == IType::St) {
+            Word word = StoreValue(instr->_memFunc, _mem.Peek(instr->_addr), instr->_addr, instr->_data);
+            _mem.Poke(instr->_addr, word, ByteMask(instr->_memFunc, instr->_addr));
+        } else if (instr->_type == IType::Amo) {
+            std::optional<Word> result = _mem.Atomic(instr->_amoFunc, instr->_memFunc, instr->_addr, instr->_src2Val);
+            if (!result)
+                return false;
+            instr->_data = *result;
+        } else if (instr->_type == IType::Vector) {
+            _vrf.Execute(*instr, _mem);
+        } else if (instr->_type == IType::Custom) {
+            CustomUnit::Execute(*instr, _mem);
+        }
+        _rf.Write(instr);
+        _csrf.Write(instr);
+        return true;
+    }
+
+    CachedMem& _mem;
+    CsrFile& _csrf;
+    BranchPredictor& _predictor;
+    FetchConfig _config;
+    Decoder _decoder;
+    RegisterFile _rf;
+    Executor _exe;
+    VectorRegisterFile _vrf;
+    MacroFusion _fusion;
+
+    Word _fetchIp = 0;
+    bool _blocked = false;
+    bool _fenceBlocked = false;     // blocked by a FENCE.I rather than a misprediction
+    std::optional<uint64_t> _resumeCycle;
+    std::deque<Fetched> _queue;
+
+    uint64_t _groups = 0;
+    uint64_t _groupInstructions = 0;
+    uint64_t _fetchStalls = 0;
+    uint64_t _mispredictStalls = 0;
+    uint64_t _serializeStalls = 0;
+    uint64_t _atomicStalls = 0;
+    uint64_t _fenceStalls = 0;
+};
+
+#endif //RISCV_SIM_FETCHUNIT_H
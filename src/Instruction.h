@@ -2,6 +2,7 @@
 #ifndef RISCV_SIM_INSTRUCTION_H
 #define RISCV_SIM_INSTRUCTION_H
 
+#include <array>
 #include <optional>
 #include <memory>
 
@@ -12,13 +13,20 @@
 enum class Opcode : uint8_t
 {
     Load    = 0b0000011,
+    LoadFp  = 0b0000111,
+    Custom0 = 0b0001011,
     MiscMem = 0b0001111,
     OpImm   = 0b0010011,
     Auipc   = 0b0010111,
+    OpImm32 = 0b0011011,
     Store   = 0b0100011,
+    StoreFp = 0b0100111,
+    Custom1 = 0b0101011,
     Amo     = 0b0101111,
     Op      = 0b0110011,
     Lui     = 0b0110111,
+    Op32    = 0b0111011,
+    OpV     = 0b1010111,
     Branch  = 0b1100011,
     Jalr    = 0b1100111,
     Jal     = 0b1101111,
@@ -27,20 +35,24 @@ enum class Opcode : uint8_t
 
 enum class CsrIdx : RId
 {
-    Instret = 0xc02,
-    Cycle   = 0xc00,
-    Mhartid = 0xf10,
-    Mtohost = 0x780,
-    None    = 0xfff,
+    Instret       = 0xc02,
+    Cycle         = 0xc00,
+    Instreth      = 0xc82,
+    Cycleh        = 0xc80,
+    Hpmcounter3   = 0xc03,
+    Hpmcounter3h  = 0xc83,
+    Mcycle        = 0xb00,
+    Minstret      = 0xb02,
+    Mcycleh       = 0xb80,
+    Minstreth     = 0xb82,
+    Mhpmcounter3  = 0xb03,
+    Mhpmcounter3h = 0xb83,
+    Mhpmevent3    = 0x323,
+    Mhartid       = 0xf10,
+    Mtohost       = 0x780,
+    None          = 0xfff,
 };
 
-// LR, SC, FENCE not implemented
-// LB(U), LH(U), SB, SH not implemented
-
-// For CSR, only following two are implemented
-// CSRR rd csr (i.e. CSRRS rd csr x0)
-// CSRW csr rs1 (i.e. CSRRW x0 csr rs1)
-
 // SCALL, SBREAK not implemented
 
 enum class IType
@@ -52,9 +64,13 @@ enum class IType
     J,
     Jr,
     Br,
-    Csrr,
-    Csrw,
-    Auipc
+    Csr,
+    Auipc,
+    Amo,
+    MulDiv,
+    Vector,
+    Custom,
+    Fence,
 };
 
 enum class BrFunc : uint8_t
@@ -69,6 +85,112 @@ enum class BrFunc : uint8_t
     NT,
 };
 
+// funct5 of the A extension; LR and SC are handled as AMOs too
+enum class AmoFunc : uint8_t
+{
+    Add  = 0b00000,
+    Swap = 0b00001,
+    Lr   = 0b00010,
+    Sc   = 0b00011,
+    Xor  = 0b00100,
+    Or   = 0b01000,
+    And  = 0b01100,
+    Min  = 0b10000,
+    Max  = 0b10100,
+    Minu = 0b11000,
+    Maxu = 0b11100,
+};
+
+// funct3 of the M extension
+enum class MulDivFunc : uint8_t
+{
+    Mul    = 0b000,
+    Mulh   = 0b001,
+    Mulhsu = 0b010,
+    Mulhu  = 0b011,
+    Div    = 0b100,
+    Divu   = 0b101,
+    Rem    = 0b110,
+    Remu   = 0b111,
+};
+
+// funct3 of the Zicsr instructions; the I forms take a 5-bit immediate in place of rs1
+enum class CsrFunc : uint8_t
+{
+    Rw  = 0b001,
+    Rs  = 0b010,
+    Rc  = 0b011,
+    Rwi = 0b101,
+    Rsi = 0b110,
+    Rci = 0b111,
+};
+
+// funct3 of MISC-MEM. The predecessor and successor sets of FENCE are not looked at: every
+// fence orders all older memory accesses before all younger ones.
+enum class FenceFunc : uint8_t
+{
+    Fence  = 0b000,
+    FenceI = 0b001,
+};
+
+// Operations of the V extension subset. Element-wise ones combine vs2 with vs1, rs1 or an
+// immediate; reductions fold vs2 into element 0 of vs1.
+enum class VecFunc : uint8_t
+{
+    SetVl,
+    Load,
+    Store,
+    Add,
+    Sub,
+    Rsub,
+    Minu,
+    Min,
+    Maxu,
+    Max,
+    And,
+    Or,
+    Xor,
+    Sll,
+    Srl,
+    Sra,
+    Mv,
+    Mul,
+    Mulh,
+    Mulhu,
+    Macc,
+    RedSum,
+    RedAnd,
+    RedOr,
+    RedXor,
+    RedMinu,
+    RedMin,
+    RedMaxu,
+    RedMax,
+    MvXS,   // rd = vs2[0]
+    MvSX,   // vd[0] = rs1
+};
+
+// Where the second operand of a vector instruction comes from
+enum class VecOperand : uint8_t
+{
+    Vector,
+    Scalar,
+    Imm,
+};
+
+// funct3 of loads and stores: the access size, and for loads whether the value is zero extended.
+// D, and Wu, exist on RV64 only.
+enum class MemFunc : uint8_t
+{
+    B  = 0b000,
+    H  = 0b001,
+    W  = 0b010,
+    D  = 0b011,
+    Bu = 0b100,
+    Hu = 0b101,
+    Wu = 0b110,
+};
+
 enum class AluFunc
 {
     Add  = 0b000,
@@ -82,53 +204,211 @@ enum class AluFunc
     Sub  = 0b1000,
     Sra,
     Srl,
+    // Zba; the uw forms of RV64 zero extend the low 32 bits of the first operand
+    Sh1add,
+    Sh2add,
+    Sh3add,
+    AddUw,
+    Sh1addUw,
+    Sh2addUw,
+    Sh3addUw,
+    SlliUw,
+    // Zbb; the unary ones ignore the second operand
+    Andn,
+    Orn,
+    Xnor,
+    Clz,
+    Ctz,
+    Cpop,
+    Min,
+    Minu,
+    Max,
+    Maxu,
+    SextB,
+    SextH,
+    ZextH,
+    Rol,
+    Ror,
+    OrcB,
+    Rev8,
     None,
 };
 
+// Pairs of instructions the front end may fuse into one operation. The fused instruction is the
+// second of the pair; its first operand is the result of the first, which the Executor works out
+// from _fusedImm.
+enum class Fusion : uint8_t
+{
+    None,
+    LuiAddi,        // lui rd, hi; addi rd, rd, lo
+    AuipcJalr,      // auipc rd, hi; jalr rd, lo(rd)
+    AuipcLoad,      // auipc rd, hi; l* rd, lo(rd)
+    SlliSrli,       // slli rd, rs, a; srli rd, rd, b
+    Count,
+};
+
+struct CustomInstruction;
+
 struct Instruction : public PoolAllocated<Instruction>
 {
     IType _type = IType::Unsupported;
     BrFunc _brFunc = BrFunc::NT;
     AluFunc _aluFunc;
+    AmoFunc _amoFunc = AmoFunc::Add;
+    MulDivFunc _mulDivFunc = MulDivFunc::Mul;
+    MemFunc _memFunc = MemFunc::W;
+    CsrFunc _csrFunc = CsrFunc::Rs;
+    FenceFunc _fenceFunc = FenceFunc::Fence;
     std::optional<RId> _dst;
     std::optional<RId> _src1;
     std::optional<RId> _src2;
     std::optional<CsrIdx> _csr;
     std::optional<Word> _imm;
+    bool _op32 = false;             // RV64 W form: works on the low 32 bits and sign extends the result
+    bool _lui = false;              // decoded from lui or c.lui, which run as an add to x0
 
     Word _src1Val;
     Word _src2Val;
     Word _csrVal;
+    std::optional<Word> _csrData;   // new CSR value, for the forms that write it
+    VecFunc _vecFunc = VecFunc::Add;
+    VecOperand _vecOperand = VecOperand::Vector;
+    RId _vd = 0;                    // vector registers, separate from _dst and _src; a store's data is in _vd
+    RId _vs1 = 0;
+    RId _vs2 = 0;
+    Word _vtype = 0;                // vtypei of vsetvli and vsetivli
+    Word _vl = 0;                   // element count and width the vector instruction ran with, for its timing
+    Word _eew = 32;
+    const CustomInstruction* _custom = nullptr;     // what a custom-0 or custom-1 instruction does
+    Fusion _fusion = Fusion::None;
+    Word _fusedImm = 0;             // immediate of the first instruction of a fused pair
     Word _data = 0xdeadbeaf;
     Word _addr = 0xdeadbeaf;
     Word _nextIp = 0xdeadbeaf;
+    Word _length = 4;
 };
 
 using InstructionPtr = std::unique_ptr<Instruction>;
 
+// Bytes a load or store moves
+inline Word AccessBytes(MemFunc func)
+{
+    return Word(1) << (Word(func) & 3u);
+}
+
+// Address of the word holding addr
+inline Word WordAddr(Word addr)
+{
+    return addr & ~(wordBytes - 1);
+}
+
+// Memory is kept in words of XLEN bits; a narrower access works on the bytes of the word holding
+// its address. Accesses never cross into the next word, and a word access ignores the low bits.
+constexpr Word allBytes = (Word(1) << wordBytes) - 1;
+
+inline Word ByteMask(MemFunc func, Word addr)
+{
+    if (AccessBytes(func) >= wordBytes)
+        return allBytes;
+    Word bytes = (Word(1) << AccessBytes(func)) - 1;
+    return (bytes << (addr & (wordBytes - 1))) & allBytes;
+}
+
+// The bits of a word the bytes of a ByteMask cover
+inline Word ByteBits(Word mask)
+{
+    Word bits = 0;
+    for (unsigned byte = 0; byte < wordBytes; ++byte)
+        if (mask & (1u << byte))
+            bits |= Word(0xffu) << (8 * byte);
+    return bits;
+}
+
+// The word with the bytes of the mask taken from data
+inline Word MergeBytes(Word word, Word data, Word mask)
+{
+    Word bits = ByteBits(mask);
+    return (word & ~bits) | (data & bits);
+}
+
+// Value a load returns, from the word holding its address
+inline Word LoadValue(MemFunc func, Word word, Word addr)
+{
+    if (AccessBytes(func) >= wordBytes)
+        return word;
+    Word shifted = word >> (8 * (addr & (wordBytes - 1)));
+    switch (func)
+    {
+        case MemFunc::B: return Word(SignedWord(int8_t(shifted)));
+        case MemFunc::Bu: return shifted & 0xffu;
+        case MemFunc::H: return Word(SignedWord(int16_t(shifted)));
+        case MemFunc::Hu: return shifted & 0xffffu;
+        case MemFunc::W: return Word(SignedWord(int32_t(shifted)));
+        case MemFunc::Wu: return shifted & 0xffffffffu;
+        case MemFunc::D: break;
+    }
+    return word;
+}
+
+// The word holding addr after a store of data to addr
+inline Word StoreValue(MemFunc func, Word word, Word addr, Word data)
+{
+    if (AccessBytes(func) >= wordBytes)
+        return data;
+    Word bits = ByteBits(ByteMask(func, addr));
+    return (word & ~bits) | ((data << (8 * (addr & (wordBytes - 1)))) & bits);
+}
+
+// Instructions the operation stands for in instret
+inline Word RetiredCount(const Instruction& instr)
+{
+    return instr._fusion == Fusion::None ? 1 : 2;
+}
+
+// FENCE.I: the instructions after it have to be fetched again
+inline bool IsFenceI(const Instruction& instr)
+{
+    return instr._type == IType::Fence && instr._fenceFunc == FenceFunc::FenceI;
+}
+
+// Instructions whose two lowest bits are not both set are 16-bit compressed ones
+inline Word InstructionLength(Word code)
+{
+    return (code & 3u) == 3u ? 4 : 2;
+}
+
 // Load
 constexpr uint8_t fnLW    = 0b010;
-//constexpr uint8_t fnLB    = 0b000;
-//constexpr uint8_t fnLH    = 0b001;
-//constexpr uint8_t fnLBU   = 0b100;
-//constexpr uint8_t fnLHU   = 0b101;
+constexpr uint8_t fnLB    = 0b000;
+constexpr uint8_t fnLH    = 0b001;
+constexpr uint8_t fnLBU   = 0b100;
+constexpr uint8_t fnLHU   = 0b101;
+constexpr uint8_t fnLD    = 0b011;
+constexpr uint8_t fnLWU   = 0b110;
 // Store
 constexpr uint8_t fnSW    = 0b010;
-//constexpr uint8_t fnSB    = 0b000;
-//constexpr uint8_t fnSH    = 0b001;
+constexpr uint8_t fnSB    = 0b000;
+constexpr uint8_t fnSH    = 0b001;
+constexpr uint8_t fnSD    = 0b011;
+// Op
+constexpr uint8_t f7MULDIV = 0b0000001;
 // Amo
-constexpr uint8_t fnLR    = 0b00010;
-constexpr uint8_t fnSC    = 0b00011;
-//MiscMem
-constexpr uint8_t fnFENCE  = 0b000;
-//constexpr uint8_t fnFENCEI = 0b001;
+constexpr uint8_t fnAMOW  = 0b010;
+constexpr uint8_t fnAMOD  = 0b011;
+// OpV
+constexpr uint8_t fnOPIVV = 0b000;
+constexpr uint8_t fnOPMVV = 0b010;
+constexpr uint8_t fnOPIVI = 0b011;
+constexpr uint8_t fnOPIVX = 0b100;
+constexpr uint8_t fnOPMVX = 0b110;
+constexpr uint8_t fnOPCFG = 0b111;
 // System
 constexpr uint8_t fnCSRRW  = 0b001;
 constexpr uint8_t fnCSRRS  = 0b010;
-//constexpr uint8_t fnCSRRC  = 0b011;
-//constexpr uint8_t fnCSRRWI = 0b101;
-//constexpr uint8_t fnCSRRSI = 0b110;
-//constexpr uint8_t fnCSRRCI = 0b111;
+constexpr uint8_t fnCSRRC  = 0b011;
+constexpr uint8_t fnCSRRWI = 0b101;
+constexpr uint8_t fnCSRRSI = 0b110;
+constexpr uint8_t fnCSRRCI = 0b111;
 constexpr uint8_t fnPRIV   = 0b000;
 constexpr uint8_t privSCALL    = 0b000;
 
@@ -0,0 +1,128 @@
+#ifndef RISCV_SIM_MACROFUSION_H
+#define RISCV_SIM_MACROFUSION_H
+
+#include <array>
+#include <ostream>
+
+#include "Decoder.h"
+#include "Memory.h"
+
+// Macro-op fusion in the front end. Two adjacent instructions fuse when the second consumes and
+// overwrites the register the first writes, so the pair writes a single register:
+//
+//   lui rd, hi; addi rd, rd, lo         rd = constant
+//   auipc rd, hi; jalr rd, lo(rd)       call
+//   auipc rd, hi; l* rd, lo(rd)         pc-relative load
+//   slli rd, rs, a; srli rd, rd, b      zero extension and bit-field extract
+//
+// The fused instruction runs once in the Executor and moves through the timing model as one
+// operation, while instret still counts both.
+class MacroFusion
+{
+public:
+    explicit MacroFusion(bool enabled)
+        : _enabled(enabled)
+    {
+
+    }
+
+    bool Enabled() const
+    {
+        return _enabled;
+    }
+
+    // Whether the instruction may be the first of a pair, before the next one is decoded
+    bool MayStart(const Instruction& first) const
+    {
+        return _enabled && FirstKind(first) != Fusion::None;
+    }
+
+    // Decodes the instruction after first and fuses the two if they pair up; both have to be in
+    // the same code line
+    bool TryFuse(InstructionPtr& first, Word ip, CachedMem& mem, Decoder& decoder)
+    {
+        if (!MayStart(*first))
+            return false;
+        Word next = ip + first->_length;
+        Word code = mem.PeekCode(next);
+        if (mem.CodeLineAddr(next + InstructionLength(code) - 1) != mem.CodeLineAddr(ip))
+            return false;
+        InstructionPtr second = decoder.Decode(code);
+        return Fuse(first, second);
+    }
+
+    // Replaces first with the fused pair if first and second fuse
+    bool Fuse(InstructionPtr& first, InstructionPtr& second)
+    {
+        Fusion fusion = Pair(*first, *second);
+        if (fusion == Fusion::None)
+            return false;
+
+        second->_fusion = fusion;
+        second->_fusedImm = Word(*first->_imm);
+        second->_length += first->_length;
+        // The lui and auipc forms read no register; the shift pair reads the source of slli
+        second->_src1 = fusion == Fusion::SlliSrli ? first->_src1 : RId(0);
+        first = std::move(second);
+        ++_pairs[size_t(fusion)];
+        return true;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        if (!_enabled)
+            return;
+        uint64_t total = 0;
+        for (uint64_t n : _pairs)
+            total += n;
+        out << "Fusion: pairs = " << total << ", lui+addi = " << _pairs[size_t(Fusion::LuiAddi)]
+            << ", auipc+jalr = " << _pairs[size_t(Fusion::AuipcJalr)] << ", auipc+load = "
+            << _pairs[size_t(Fusion::AuipcLoad)] << ", slli+srli = " << _pairs[size_t(Fusion::SlliSrli)]
+            << std::endl;
+    }
+
+private:
+    static Fusion FirstKind(const Instruction& first)
+    {
+        if (!first._dst || first._fusion != Fusion::None)
+            return Fusion::None;
+        if (first._type == IType::Auipc)
+            return Fusion::AuipcJalr;
+        if (first._type != IType::Alu || first._op32 || !first._imm)
+            return Fusion::None;
+        if (first._lui)
+            return Fusion::LuiAddi;
+        if (first._aluFunc == AluFunc::Sll)
+            return Fusion::SlliSrli;
+        return Fusion::None;
+    }
+
+    static Fusion Pair(const Instruction& first, const Instruction& second)
+    {
+        Fusion kind = FirstKind(first);
+        if (kind == Fusion::None || second._dst != first._dst || second._src1 != first._dst
+            || second._fusion != Fusion::None)
+            return Fusion::None;
+
+        switch (kind)
+        {
+            case Fusion::LuiAddi:
+                return second._type == IType::Alu && second._aluFunc == AluFunc::Add && second._imm
+                       ? Fusion::LuiAddi : Fusion::None;
+            case Fusion::AuipcJalr:
+                if (second._type == IType::Jr)
+                    return Fusion::AuipcJalr;
+                return second._type == IType::Ld ? Fusion::AuipcLoad : Fusion::None;
+            case Fusion::SlliSrli:
+                return second._type == IType::Alu && second._aluFunc == AluFunc::Srl && second._imm && !second._op32
+                       ? Fusion::SlliSrli : Fusion::None;
+            default:
+                return Fusion::None;
+        }
+    }
+
+    bool _enabled;
+    std::array<uint64_t, size_t(Fusion::Count)> _pairs{};
+};
+
+#endif //RISCV_SIM_MACROFUSION_H
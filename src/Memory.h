@@ -2,6 +2,11 @@
 #define RISCV_SIM_DATAMEMORY_H
 
 #include "Instruction.h"
+#include "Executor.h"
+#include "Cache.h"
+#include "Coherence.h"
+#include "Trace.h"
+#include "PerfEvents.h"
 #include <iostream>
 #include <algorithm>
 #include <fstream>
@@ -10,19 +15,65 @@
 #include <vector>
 #include <cassert>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 
-//static constexpr size_t memSize = 4*1024*1024; // memory size in 4-byte words
-static constexpr size_t memSize = 1024*1024; // memory size in 4-byte words
+//static constexpr size_t memSize = 16*1024*1024 / wordBytes; // memory size in words
+static constexpr size_t memSize = 4*1024*1024 / wordBytes; // memory size in words
 
-static constexpr size_t lineSizeBytes = 128;
-static constexpr size_t lineSizeWords = lineSizeBytes / sizeof(Word);
-using Line = std::array<Word, lineSizeWords>;
-static constexpr size_t dataCacheBytes = 4096;
-static constexpr size_t codeCacheBytes = 1024;
-static Word ToWordAddr(Word ip) { return ip >> 2u; }
-static Word ToLineAddr(Word ip) { return ip & ~(lineSizeBytes - 1); }
-static Word ToLineOffset(Word ip) { return ToWordAddr(ip) & (lineSizeWords - 1); }
+static Word ToWordAddr(Word ip) { return ip / wordBytes; }
+
+// Cache geometry and latencies. The defaults are the configuration the simulator has always modelled.
+struct MemoryConfig
+{
+    size_t lineSizeBytes = 128;
+    size_t dataCacheBytes = 4096;
+    size_t codeCacheBytes = 1024;
+    size_t dataCacheWays = 0; // 0 means fully associative
+    size_t codeCacheWays = 0;
+    ReplacementPolicy cachePolicy = ReplacementPolicy::Lru;
+    size_t failLatency = 152;
+    size_t codeLatency = 1;
+    size_t dataLatency = 3;
+    size_t writebackLatency = 120;
+    size_t victimLatency = 4;
+    size_t victimEntries = 0;
+    size_t atomicLatency = 2;   // read-modify-write of an AMO in the data cache
+
+    CacheShape DataShape() const
+    {
+        return Shape(dataCacheBytes, dataCacheWays);
+    }
+
+    CacheShape CodeShape() const
+    {
+        return Shape(codeCacheBytes, codeCacheWays);
+    }
+
+    bool IsValid() const
+    {
+        bool pow2Line = lineSizeBytes >= sizeof(Word) && (lineSizeBytes & (lineSizeBytes - 1)) == 0;
+        return pow2Line && IsValid(dataCacheBytes, dataCacheWays) && IsValid(codeCacheBytes, codeCacheWays);
+    }
+
+private:
+    CacheShape Shape(size_t bytes, size_t ways) const
+    {
+        size_t lines = bytes / lineSizeBytes;
+        ways = ways == 0 ? lines : ways;
+        return CacheShape{lines / ways, ways, lineSizeBytes, cachePolicy};
+    }
+
+    bool IsValid(size_t bytes, size_t ways) const
+    {
+        size_t lines = bytes / lineSizeBytes;
+        if (bytes < lineSizeBytes || bytes % lineSizeBytes != 0 || (ways != 0 && lines % ways != 0))
+            return false;
+        size_t sets = Shape(bytes, ways).sets;
+        return (sets & (sets - 1)) == 0;
+    }
+};
 
 class MemoryStorage {
 public:
@@ -70,12 +121,17 @@ public:
             return false;
         }
 
-        if (e_ident[EI_CLASS] == ELFCLASS32) {
+        // The class has to match the XLEN the simulator is built for
+        if (e_ident[EI_CLASS] == ELFCLASS32 && XLEN == 32) {
             // 32-bit ELF
             return this->LoadElfSpecific<Elf32_Ehdr, Elf32_Phdr>(buf.data(), buf_sz);
-        } else if (e_ident[EI_CLASS] == ELFCLASS64) {
+        } else if (e_ident[EI_CLASS] == ELFCLASS64 && XLEN == 64) {
             // 64-bit ELF
             return this->LoadElfSpecific<Elf64_Ehdr, Elf64_Phdr>(buf.data(), buf_sz);
+        } else if (e_ident[EI_CLASS] == ELFCLASS32 || e_ident[EI_CLASS] == ELFCLASS64) {
+            std::cerr << "ERROR: load_elf: " << (e_ident[EI_CLASS] == ELFCLASS32 ? "32" : "64")
+                      << "-bit program, but the simulator is built for RV" << XLEN << std::endl;
+            return false;
         } else {
             std::cerr << "ERROR: load_elf: file is neither 32-bit nor 64-bit" << std::endl;
             return false;
@@ -196,30 +252,37 @@ public:
             return false;
 
         if (instr->_type == IType::Ld)
-            instr->_data = _mem.Read(instr->_addr);
+            instr->_data = LoadValue(instr->_memFunc, _mem.Read(instr->_addr), instr->_addr);
         else if (instr->_type == IType::St)
-            _mem.Write(instr->_addr, instr->_data);
+            _mem.Write(instr->_addr, StoreValue(instr->_memFunc, _mem.Read(instr->_addr), instr->_addr, instr->_data));
 
         return true;
     }
 
-    Line readLineFromMemory(Word ip)
+    void readLineFromMemory(Word ip, Word* memoryLine, size_t lineWords)
     {
-        Line memoryLine = { 0 };
-        for (int i = 0; i < lineSizeWords; ++i) {
-            memoryLine[i] = _mem.Read(ip + 4 * i);
+        for (int i = 0; i < lineWords; ++i) {
+            memoryLine[i] = _mem.Read(ip + wordBytes * i);
         }
-
-        return memoryLine;
     }
 
-    void writeLineToMemory(Line memoryLine, Word lineAddr)
+    void writeLineToMemory(const Word* memoryLine, size_t lineWords, Word lineAddr)
     {
-        for (int i = 0; i < lineSizeWords; ++i) {
-            _mem.Write(lineAddr + 4 * i, memoryLine[i]);
+        for (int i = 0; i < lineWords; ++i) {
+            _mem.Write(lineAddr + wordBytes * i, memoryLine[i]);
         }
     }
 
+    Word Peek(Word addr)
+    {
+        return _mem.Read(addr);
+    }
+
+    void Poke(Word addr, Word data)
+    {
+        _mem.Write(addr, data);
+    }
+
     void Clock() override
     {
         if (_waitCycles > 0)
@@ -239,182 +302,783 @@ private:
     MemoryStorage& _mem;
 };
 
+// Small fully associative buffer holding lines recently evicted from the data cache.
+// Lines move back into the data cache on a hit, so a line is never held by both.
+class VictimCache
+{
+public:
+    explicit VictimCache(size_t entries)
+        : _entries(entries)
+    {
+
+    }
+
+    bool Enabled() const
+    {
+        return !_entries.empty();
+    }
+
+    bool Full() const
+    {
+        return std::all_of(_entries.begin(), _entries.end(), [](const Entry& e) { return e.valid; });
+    }
+
+    // Called on every data cache miss
+    bool Lookup(Word lineAddr)
+    {
+        ++_lookups;
+        bool hit = std::any_of(_entries.begin(), _entries.end(),
+                               [lineAddr](const Entry& e) { return e.valid && e.lineAddr == lineAddr; });
+        _hits += hit;
+        return hit;
+    }
+
+    // Removes the line from the buffer and hands it back to the data cache
+    std::optional<std::vector<Word>> Take(Word lineAddr)
+    {
+        for (Entry& e : _entries) {
+            if (e.valid && e.lineAddr == lineAddr) {
+                e.valid = false;
+                return e.line;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Contents of a buffered line, without counting a lookup
+    Word* Find(Word lineAddr)
+    {
+        for (Entry& e : _entries) {
+            if (e.valid && e.lineAddr == lineAddr)
+                return e.line.data();
+        }
+        return nullptr;
+    }
+
+    // Returns the least recently inserted entry if it had to be pushed out to make room
+    std::optional<std::pair<std::vector<Word>, Word>> Insert(const Word* line, size_t lineWords, Word lineAddr)
+    {
+        Entry* slot = &_entries.front();
+        for (Entry& e : _entries) {
+            if (!e.valid) {
+                slot = &e;
+                break;
+            }
+            if (e.stamp < slot->stamp)
+                slot = &e;
+        }
+
+        std::optional<std::pair<std::vector<Word>, Word>> spilled;
+        if (slot->valid)
+            spilled = std::pair<std::vector<Word>, Word>(std::move(slot->line), slot->lineAddr);
+
+        *slot = Entry{std::vector<Word>(line, line + lineWords), lineAddr, ++_clock, true};
+        return spilled;
+    }
+
+    size_t Size() const
+    {
+        return _entries.size();
+    }
+
+    uint64_t Lookups() const
+    {
+        return _lookups;
+    }
+
+    uint64_t Hits() const
+    {
+        return _hits;
+    }
+
+private:
+    struct Entry
+    {
+        std::vector<Word> line;
+        Word lineAddr = 0;
+        uint64_t stamp = 0;
+        bool valid = false;
+    };
+
+    std::vector<Entry> _entries;
+    uint64_t _clock = 0;
+    uint64_t _lookups = 0;
+    uint64_t _hits = 0;
+};
+
 // TODO: Create cache for data and for code that works for 1 and 3 ticks
-class CachedMem
+class CachedMem : public ICoherentCache
 {
 public:
-    explicit CachedMem(UncachedMem& uncachedMem): _mem(uncachedMem)
+    explicit CachedMem(UncachedMem& uncachedMem, const MemoryConfig& config = MemoryConfig())
+        : _mem(uncachedMem)
+        , _config(config)
+        , _code(CacheRegistry::Make(config.CodeShape()))
+        , _data(CacheRegistry::Make(config.DataShape()))
+        , _state(_data->Slots(), LineState::Invalid)
+        , _victim(config.victimEntries)
     {
 
     }
 
+    // Keeps the data cache coherent with the other caches on the bus
+    void AttachBus(CoherenceBus* bus)
+    {
+        _bus = bus;
+        _bus->Attach(this);
+    }
+
+    // From now on stores and coherence transactions stay private to this cache until the next
+    // quantum boundary, so harts can run on their own threads between boundaries. Memory is only
+    // read in between; write-backs are dropped because every store reaches memory by itself.
+    void DeferSharedAccesses()
+    {
+        _deferred = true;
+    }
+
+    // First step at a quantum boundary, taken for one hart at a time in hart order while no hart
+    // runs: the stores of the quantum go to memory and to every cached copy, and then the atomic
+    // the hart waits for is performed.
+    void PublishStores()
+    {
+        for (const auto& [addr, store] : _pendingStores) {
+            _mem.Poke(addr, MergeBytes(_mem.Peek(addr), store.data, store.mask));
+            if (_bus)
+                _bus->UpdateCopies(this, addr, store.data, store.mask);
+        }
+        _pendingStores.clear();
+        if (_queuedAtomic) {
+            _atomicResult = PerformAtomic(_queuedAtomic->func, _queuedAtomic->width, _queuedAtomic->addr,
+                                          _queuedAtomic->operand);
+            _queuedAtomic.reset();
+        }
+    }
+
+    // Second step: the coherence transactions of the quantum are replayed on the bus, which
+    // invalidates or downgrades the other harts' copies as if they had happened at the boundary.
+    void ReplayCoherence()
+    {
+        for (const DeferredBusOp& op : _busLog) {
+            if (op.kind == DeferredBusOp::Evict) {
+                _bus->Evicted(this, op.lineAddr);
+                continue;
+            }
+            bool exclusive = op.kind == DeferredBusOp::Write;
+            LineState state = _bus->Acquire(this, op.lineAddr, exclusive, nullptr).second;
+            // Another hart may have taken the same line in the same quantum
+            std::optional<size_t> slot = _data->Find(op.lineAddr);
+            if (!exclusive && slot && _state[*slot] == LineState::Exclusive)
+                _state[*slot] = state;
+        }
+        _busLog.clear();
+    }
+
     void Request(Word ip)
     {
         if (ip != _memoryRequestIp) {
             _memoryRequestIp = ip;
-            Word lineAddr = ToLineAddr(_memoryRequestIp);
-            Word offset = ToLineOffset(_memoryRequestIp);
-
-            bool inCache = false;
-            for (int i = 0; i < codeCacheBytes / lineSizeBytes; ++i) {
-                if (_codeMem[i].second == lineAddr) {
-                    lineAddr = i;
-                    inCache = true;
-                    break;
-                }
-            }
-
-            if (inCache) {
-                _waitCycles = codeLatency;
-                _cacheMiss = false;
-            } else {
-                _cacheMiss = true;
-                _waitCycles = failLatency;
-            }
-            _requestedIp = lineAddr;
-            _requestedOffset = offset;
+            _codeLowHalf.reset();
+            StartCodeAccess(ip);
         }
     }
 
-    std::optional<Word> Response(Word responseTime)
+    // The instruction at the requested ip, in the low 32 bits. A 32-bit instruction in the last
+    // halfword of a word continues in the next word, and perhaps in the next line, which then
+    // takes an access of its own.
+    std::optional<Word> Response(uint64_t responseTime)
     {
-        if (_waitCycles > 0)
+        if (_codeWaitCycles > 0)
             return std::optional<Word>();
 
-        if (_cacheMiss)
+        if (!_codeSlot)
         {
-            Line memoryLine = _mem.readLineFromMemory(_requestedIp);
-
-            Word latestUsage = *min_element(_lastCodeUsage.begin(), _lastCodeUsage.end());
-            //Word index = std::find(_lastCodeUsage.begin(), _lastCodeUsage.end(), latestUsage) - _lastCodeUsage.begin();
-            Word index = 0;
-            for (int j = 0; j < codeCacheBytes / lineSizeWords; ++j) {
-                if (_lastCodeUsage[j] == latestUsage)
-                {
-                    index = j;
-                    break;
-                }
-            }
+            // Code lines are never written, so the evicted one is simply dropped. The line is
+            // filled with the newest copy of its words, stores still in the data cache included;
+            // lines already cached only see them after a FENCE.I.
+            size_t slot = _code->Victim(_codeLineAddr);
+            _code->Fill(slot, _codeLineAddr, responseTime);
+            Word* line = _code->LineData(slot);
+            for (size_t i = 0; i < _code->LineWords(); ++i)
+                line[i] = Peek(_codeLineAddr + wordBytes * i);
+            _codeSlot = slot;
+        }
 
-            if (latestUsage != 0)
-            {
-                _mem.writeLineToMemory(_codeMem[index].first, _codeMem[index].second);
-            }
+        Word word = _code->Access(*_codeSlot, _codeOffset, responseTime);
+        if (_codeLowHalf)
+            return Word(uint32_t(*_codeLowHalf | word << 16u));
+        Word byte = _memoryRequestIp & (wordBytes - 1);
+        if (byte != wordBytes - 2)
+            return Word(uint32_t(word >> (8 * byte)));
+
+        Word low = word >> (8 * byte);
+        if (InstructionLength(low) == 2)
+            return low;
+        if (_codeOffset + 1 < _code->LineWords())
+            return Word(uint32_t(low | _code->LineData(*_codeSlot)[_codeOffset + 1] << 16u));
+        ++_codeStraddles;
+        _codeLowHalf = low;
+        StartCodeAccess(_memoryRequestIp + 2);
+        return std::optional<Word>();
+    }
+
+    // FENCE.I: every line of the code cache is dropped and the next fetch starts a new access.
+    // The fence itself is a flash invalidation; its cost is the misses on the dropped lines
+    // when they are fetched again.
+    void FlushCode()
+    {
+        ++_codeFlushes;
+        for (size_t slot = 0; slot < _code->Slots(); ++slot) {
+            if (!_code->IsValid(slot))
+                continue;
+            _flushedCodeLines.insert(_code->LineAddr(slot));
+            _code->Invalidate(slot);
+            ++_flushedLines;
+        }
+        // No instruction starts at an odd address, so the next Request cannot match
+        _memoryRequestIp = 1;
+        _codeSlot.reset();
+        _codeLowHalf.reset();
+        _codeWaitCycles = 0;
+    }
 
-            _codeMem[index] = std::pair<Line, Word>(memoryLine, _requestedIp);
-            _lastCodeUsage[index] = responseTime;
-            return memoryLine[_requestedOffset];
+    void Request(InstructionPtr &instr)
+    {
+        if (instr->_type != IType::Ld && instr->_type != IType::St && instr->_type != IType::Amo)
+            return;
 
+        bool store = Writes(*instr);
+        if (_trace)
+            _trace->Record(instr->_addr, store ? AccessType::Store : AccessType::Load);
+
+        _dataLineAddr = _data->ToLineAddr(instr->_addr);
+        _dataOffset = _data->ToLineOffset(instr->_addr);
+        _dataSlot = _data->Find(_dataLineAddr);
+
+        ++_dataAccesses;
+        if (_events)
+            _events->Count(HpmEvent::DataAccess);
+        _victimHit = false;
+        if (_dataSlot) {
+            _dataWaitCycles = _config.dataLatency;
+            LineState state = _state[*_dataSlot];
+            if (_bus && store && (state == LineState::Shared || state == LineState::Owned))
+                _dataWaitCycles += _bus->Config().upgradeLatency + DirectoryLatency();
         } else {
-            _lastCodeUsage[_requestedIp] = responseTime;
-            return _codeMem[_requestedIp].first[_requestedOffset];
+            ++_dataMisses;
+            if (_events)
+                _events->Count(HpmEvent::DataMiss);
+            CountCoherenceMiss();
+            _victimHit = _victim.Enabled() && _victim.Lookup(_dataLineAddr);
+            _dataWaitCycles = _victimHit ? _config.victimLatency : _config.failLatency;
+            if (_bus) {
+                CoherenceBus::Holders holders = _bus->Query(this, _dataLineAddr);
+                if (holders.owner && !_victimHit)
+                    _dataWaitCycles = _bus->Config().transferLatency;
+                if (store && holders.count != 0)
+                    _dataWaitCycles += _bus->Config().invalidateLatency;
+                _dataWaitCycles += DirectoryLatency();
+            }
+            // A store miss that evicts a line pays for writing it back, unless the victim cache absorbs it
+            bool evicts = _data->IsValid(_data->Victim(_dataLineAddr));
+            bool absorbed = _victim.Enabled() && (_victimHit || !_victim.Full());
+            if (store && evicts && !absorbed)
+                _dataWaitCycles += _config.writebackLatency;
         }
+        if (instr->_type == IType::Amo && instr->_amoFunc != AmoFunc::Lr && instr->_amoFunc != AmoFunc::Sc)
+            _dataWaitCycles += _config.atomicLatency;
     }
 
-    void Request(InstructionPtr &instr)
+    bool Response(InstructionPtr &instr, uint64_t responseTime)
     {
-        if (instr->_type != IType::Ld && instr->_type != IType::St)
+        return Complete(instr, responseTime, true);
+    }
+
+    // Timing of an access a core already performed with Peek and Poke: the line is fetched and
+    // the coherence transactions happen as for Response, but no data moves
+    bool Replay(InstructionPtr &instr, uint64_t responseTime)
+    {
+        return Complete(instr, responseTime, false);
+    }
+
+    // Performs an AMO, LR or SC on the newest copy of the word and returns the value for rd.
+    // Parallel harts perform them at the quantum boundary, which keeps them atomic across harts;
+    // until then nothing is returned and the hart has to wait.
+    std::optional<Word> Atomic(AmoFunc func, MemFunc width, Word addr, Word operand)
+    {
+        if (!_deferred)
+            return PerformAtomic(func, width, addr, operand);
+
+        if (_atomicResult) {
+            Word result = *_atomicResult;
+            _atomicResult.reset();
+            return result;
+        }
+        _queuedAtomic = QueuedAtomic{func, width, addr, operand};
+        return std::nullopt;
+    }
+
+    void Clock()
+    {
+        if (_codeWaitCycles > 0)
+            --_codeWaitCycles;
+        if (_dataWaitCycles > 0)
+            --_dataWaitCycles;
+    }
+
+    // Fetches and data accesses are served by separate ports and may be in flight at the same time
+    size_t getCodeWaitCycles()
+    {
+        return _codeWaitCycles;
+    }
+
+    size_t getDataWaitCycles()
+    {
+        return _dataWaitCycles;
+    }
+
+    // Untimed access to the newest copy of a word, wherever it lives. Cores that execute
+    // functionally ahead of their timing model use it; it touches neither statistics nor LRU state.
+    Word Peek(Word addr)
+    {
+        Word* word = Locate(addr);
+        if (word)
+            return *word;
+        if (_deferred) {
+            auto it = _pendingStores.find(WordAddr(addr));
+            if (it != _pendingStores.end())
+                return MergeBytes(_mem.Peek(addr), it->second.data, it->second.mask);
+        }
+        return _mem.Peek(addr);
+    }
+
+    // Writes the whole word; mask tells which of its bytes the store changed, so that stores of
+    // parallel harts to other bytes of the word survive the quantum boundary
+    void Poke(Word addr, Word data, Word mask = allBytes)
+    {
+        if (_deferred) {
+            if (Word* word = Locate(addr))
+                *word = data;
+            DeferStore(addr, data, mask);
             return;
+        }
+        Write(addr, data);
+    }
 
-        Word lineAddr = ToLineAddr(instr->_addr);
-        Word offset = ToLineOffset(instr->_addr);
+    LineState StateOf(Word lineAddr) override
+    {
+        if (std::optional<size_t> slot = _data->Find(lineAddr))
+            return _state[*slot];
+        // Lines in the victim cache are treated as dirty
+        return _victim.Find(lineAddr) ? LineState::Modified : LineState::Invalid;
+    }
 
-        bool inCache = false;
-        for (int i = 0; i < dataCacheBytes / lineSizeBytes; ++i) {
-            if (_dataMem[i].second == lineAddr) {
-                lineAddr = i;
-                inCache = true;
-                break;
+    void Snoop(Word lineAddr, bool exclusive, Word* supply, std::optional<Word> writeOffset) override
+    {
+        size_t words = _data->LineWords();
+        if (std::optional<size_t> slot = _data->Find(lineAddr)) {
+            LineState& state = _state[*slot];
+            if (supply)
+                std::copy(_data->LineData(*slot), _data->LineData(*slot) + words, supply);
+
+            if (exclusive) {
+                _data->Invalidate(*slot);
+                state = LineState::Invalid;
+                LoseLine(lineAddr, writeOffset);
+                // Replayed transactions only model timing; the stores published before them
+                // already broke the reservations they had to
+                if (!_deferred)
+                    BreakReservation(lineAddr);
+            } else if (state == LineState::Modified) {
+                bool moesi = _bus->Config().protocol == CoherenceProtocol::Moesi;
+                if (!moesi)
+                    _mem.writeLineToMemory(_data->LineData(*slot), words, lineAddr);
+                state = moesi ? LineState::Owned : LineState::Shared;
+            } else if (state == LineState::Exclusive) {
+                state = LineState::Shared;
             }
+            return;
         }
 
-        if (inCache) {
-            _waitCycles = dataLatency;
-            _cacheMiss = false;
-        } else {
-            _cacheMiss = true;
-            _waitCycles = failLatency;
-            if (instr->_type == IType::St && (*min_element(_lastDataUsage.begin(), _lastDataUsage.end())))
-                _waitCycles += 120;
+        if (std::optional<std::vector<Word>> line = _victim.Take(lineAddr)) {
+            if (supply)
+                std::copy(line->begin(), line->end(), supply);
+            _mem.writeLineToMemory(line->data(), words, lineAddr);
+            BreakReservation(lineAddr);
+            if (exclusive)
+                LoseLine(lineAddr, writeOffset);
         }
-        _requestedIp = lineAddr;
-        _requestedOffset = offset;
     }
 
-    bool Response(InstructionPtr &instr, Word responseTime)
+    void UpdateCopy(Word addr, Word data, Word mask) override
     {
-        if (instr->_type != IType::Ld && instr->_type != IType::St)
+        if (Word* word = Locate(addr))
+            *word = MergeBytes(*word, data, mask);
+        BreakReservation(_data->ToLineAddr(addr));
+    }
+
+    // Untimed read of the instruction at ip, which may start in the middle of a word
+    Word PeekCode(Word ip)
+    {
+        Word byte = ip & (wordBytes - 1);
+        if (byte != wordBytes - 2)
+            return Word(uint32_t(Peek(ip) >> (8 * byte)));
+        return Word(uint32_t(Peek(ip) >> (8 * byte) | Peek(ip + 2) << 16u));
+    }
+
+    Word CodeLineAddr(Word ip) const
+    {
+        return _code->ToLineAddr(ip);
+    }
+
+    // Every fetch and data access is appended to the trace, for offline cache studies
+    void SetTrace(TraceWriter* trace)
+    {
+        _trace = trace;
+    }
+
+    // Accesses and misses are also reported to the hart's performance counters
+    void SetPerfEvents(PerfEvents* events)
+    {
+        _events = events;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "L1I: " << _code->Shape().ToString() << (_code->IsSpecialised() ? " (specialised)" : "")
+            << ", accesses = " << _codeAccesses << ", misses = " << _codeMisses;
+        if (_codeStraddles != 0)
+            out << ", line-crossing instructions = " << _codeStraddles;
+        out << std::endl;
+        if (_codeFlushes != 0)
+            out << "FENCE.I: flushes = " << _codeFlushes << ", L1I lines invalidated = " << _flushedLines
+                << ", refetch misses = " << _refetchMisses << " (" << _refetchMisses * _config.failLatency
+                << " cycles)" << std::endl;
+        out << "L1D: " << _data->Shape().ToString() << (_data->IsSpecialised() ? " (specialised)" : "")
+            << ", accesses = " << _dataAccesses << ", misses = " << _dataMisses << std::endl;
+        if (_victim.Enabled())
+            out << "Victim cache (" << _victim.Size() << " entries): lookups = " << _victim.Lookups()
+                << ", hits = " << _victim.Hits() << std::endl;
+        if (_atomics != 0)
+            out << "Atomics: performed = " << _atomics << ", failed sc = " << _failedScs << std::endl;
+        if (_bus)
+            out << "L1D coherence: invalidations = " << _invalidations << ", coherence misses = " << _coherenceMisses
+                << " (false sharing " << _falseSharingMisses << "), upgrades = " << _upgrades
+                << ", cache-to-cache fills = " << _transfers << std::endl;
+    }
+private:
+    void StartCodeAccess(Word ip)
+    {
+        if (_trace)
+            _trace->Record(ip, AccessType::Fetch);
+
+        _codeLineAddr = _code->ToLineAddr(ip);
+        _codeOffset = _code->ToLineOffset(ip);
+        _codeSlot = _code->Find(_codeLineAddr);
+        _codeWaitCycles = _codeSlot ? _config.codeLatency : _config.failLatency;
+        ++_codeAccesses;
+        _codeMisses += !_codeSlot;
+        if (!_codeSlot && !_flushedCodeLines.empty())
+            _refetchMisses += _flushedCodeLines.erase(_codeLineAddr);
+        if (_events) {
+            _events->Count(HpmEvent::CodeAccess);
+            _events->Count(HpmEvent::CodeMiss, !_codeSlot);
+        }
+    }
+
+    // Finishes the data access once its latency has passed; perform is false for a replay
+    bool Complete(InstructionPtr &instr, uint64_t responseTime, bool perform)
+    {
+        if (instr->_type != IType::Ld && instr->_type != IType::St && instr->_type != IType::Amo)
             return true;
 
-        if (_waitCycles != 0)
+        if (_dataWaitCycles != 0)
             return false;
 
-        if (_cacheMiss)
+        bool store = Writes(*instr);
+        // Another cache may have taken the line away since the request
+        if (_bus)
+            _dataSlot = _data->Find(_dataLineAddr);
+
+        if (!_dataSlot)
         {
-            Line memoryLine = _mem.readLineFromMemory(_requestedIp);
-
-            if (instr->_type == IType::St)
-                memoryLine[ToLineOffset(instr->_addr)] = instr->_data;
-
-            Word latestUsage = *min_element(_lastDataUsage.begin(), _lastDataUsage.end());
-            Word index = 0;
-            for (int j = 0; j < dataCacheBytes / lineSizeWords; ++j) {
-                if (_lastDataUsage[j] == latestUsage)
-                {
-                    index = j;
-                    break;
-                }
+            // Take the line out of the victim cache before the eviction below can push it out
+            std::optional<std::vector<Word>> victimLine;
+            if (_victimHit)
+                victimLine = _victim.Take(_dataLineAddr);
+
+            size_t slot = _data->Victim(_dataLineAddr);
+            if (_data->IsValid(slot))
+                Evict(slot);
+
+            _data->Fill(slot, _dataLineAddr, responseTime);
+            bool supplied = false;
+            if (_bus && _deferred) {
+                // Counted as the request charged it; the data itself comes from memory and the
+                // stores published at the boundary
+                _transfers += !_victimHit && _bus->Query(this, _dataLineAddr).owner;
+                _state[slot] = DeferAcquire(store);
+            } else if (_bus) {
+                auto [fromCache, state] = _bus->Acquire(this, _dataLineAddr, store,
+                                                        victimLine ? nullptr : _data->LineData(slot), _dataOffset);
+                supplied = fromCache;
+                _transfers += fromCache;
+                _state[slot] = state;
+            }
+            if (victimLine) {
+                std::copy(victimLine->begin(), victimLine->end(), _data->LineData(slot));
+                // The victim copy may be dirty; memory must hold it before the line is clean or shared
+                if (_bus && !_deferred && _state[slot] != LineState::Modified)
+                    _mem.writeLineToMemory(victimLine->data(), victimLine->size(), _dataLineAddr);
+            }
+            else if (!supplied) {
+                _mem.readLineFromMemory(_dataLineAddr, _data->LineData(slot), _data->LineWords());
+                ApplyPendingStores(slot);
+            }
+            _dataSlot = slot;
+        }
+        else if (_bus && store)
+        {
+            LineState state = _state[*_dataSlot];
+            if (state == LineState::Shared || state == LineState::Owned) {
+                if (_deferred)
+                    DeferAcquire(true);
+                else
+                    _bus->Acquire(this, _dataLineAddr, true, nullptr, _dataOffset);
+                ++_upgrades;
             }
+        }
+        if (store)
+            _state[*_dataSlot] = LineState::Modified;
+
+        Word& word = _data->Access(*_dataSlot, _dataOffset, responseTime);
+        if (!perform)
+            return true;
+        if (instr->_type == IType::Ld) {
+            instr->_data = LoadValue(instr->_memFunc, word, instr->_addr);
+        } else if (instr->_type == IType::St) {
+            word = StoreValue(instr->_memFunc, word, instr->_addr, instr->_data);
+            if (_deferred)
+                DeferStore(instr->_addr, word, ByteMask(instr->_memFunc, instr->_addr));
+        } else {
+            std::optional<Word> result = Atomic(instr->_amoFunc, instr->_memFunc, instr->_addr, instr->_src2Val);
+            if (!result)
+                return false;
+            instr->_data = *result;
+        }
+        return true;
+    }
+
 
-            if (latestUsage != 0)
-            {
-                _mem.writeLineToMemory(_dataMem[index].first, _dataMem[index].second);
+    static bool Writes(const Instruction& instr)
+    {
+        return instr._type == IType::St || (instr._type == IType::Amo && instr._amoFunc != AmoFunc::Lr);
+    }
+
+    // With coherent caches every copy and memory get the value, so all harts see it at once
+    void Write(Word addr, Word data)
+    {
+        Word* word = Locate(addr);
+        if (word)
+            *word = data;
+        if (_bus)
+            _bus->UpdateCopies(this, addr, data);
+        if (!word || _bus || _deferred)
+            _mem.Poke(addr, data);
+    }
+
+    // A W-sized AMO on RV64 works on half of a memory word
+    std::optional<Word> PerformAtomic(AmoFunc func, MemFunc width, Word addr, Word operand)
+    {
+        Word lineAddr = _data->ToLineAddr(addr);
+        Word word = Peek(addr);
+        Word old = LoadValue(width, word, addr);
+        ++_atomics;
+        if (func == AmoFunc::Lr) {
+            _reservation = lineAddr;
+            return old;
+        }
+        if (func == AmoFunc::Sc) {
+            bool reserved = _reservation == lineAddr;
+            _reservation.reset();
+            if (!reserved) {
+                ++_failedScs;
+                return 1;
             }
+            Write(addr, StoreValue(width, word, addr, operand));
+            return 0;
+        }
+        Write(addr, StoreValue(width, word, addr, Executor::AmoResult(func, width, old, operand)));
+        return old;
+    }
 
-            _dataMem[index] = std::pair<Line, Word>(memoryLine, _requestedIp);
-            _lastDataUsage[index] = responseTime;
+    // A store of another hart, or losing the line, ends the reservation of an LR
+    void BreakReservation(Word lineAddr)
+    {
+        if (_reservation == lineAddr)
+            _reservation.reset();
+    }
+
+    Word* Locate(Word addr)
+    {
+        Word lineAddr = _data->ToLineAddr(addr);
+        Word offset = _data->ToLineOffset(addr);
+        if (std::optional<size_t> slot = _data->Find(lineAddr))
+            return _data->LineData(*slot) + offset;
+        if (Word* line = _victim.Find(lineAddr))
+            return line + offset;
+        return nullptr;
+    }
 
-            if (instr->_type == IType::Ld)
-                instr->_data = memoryLine[_requestedOffset];
+    void Evict(size_t slot)
+    {
+        _state[slot] = LineState::Invalid;
+        if (_victim.Enabled()) {
+            auto spilled = _victim.Insert(_data->LineData(slot), _data->LineWords(), _data->LineAddr(slot));
+            if (spilled)
+                WriteBack(spilled->first.data(), spilled->second);
+        } else {
+            WriteBack(_data->LineData(slot), _data->LineAddr(slot));
         }
-        else
-        {
-            _lastDataUsage[_requestedIp] = responseTime;
-            if (instr->_type == IType::Ld)
-                instr->_data = _dataMem[_requestedIp].first[_requestedOffset];
-            else if (instr->_type == IType::St)
-                _dataMem[_requestedIp].first[_requestedOffset] = instr->_data;
+    }
+
+    // The line leaves the cache hierarchy
+    void WriteBack(const Word* line, Word lineAddr)
+    {
+        BreakReservation(lineAddr);
+        if (!_deferred)
+            _mem.writeLineToMemory(line, _data->LineWords(), lineAddr);
+        if (_bus && _deferred)
+            _busLog.push_back(DeferredBusOp{lineAddr, DeferredBusOp::Evict});
+        else if (_bus)
+            _bus->Evicted(this, lineAddr);
+    }
+
+    // A coherence transaction of a hart running on its own thread. The line state is judged from
+    // the holder lists as of the last boundary, and the transaction is replayed there.
+    LineState DeferAcquire(bool exclusive)
+    {
+        _busLog.push_back(DeferredBusOp{_dataLineAddr, exclusive ? DeferredBusOp::Write : DeferredBusOp::Read});
+        if (exclusive)
+            return LineState::Modified;
+        return _bus->Query(this, _dataLineAddr).count != 0 ? LineState::Shared : LineState::Exclusive;
+    }
+
+    // Holds a store back until the quantum boundary. Only the bytes it wrote are published.
+    void DeferStore(Word addr, Word word, Word mask)
+    {
+        PendingStore& store = _pendingStores[WordAddr(addr)];
+        store.data = word;
+        store.mask |= mask;
+    }
+
+    // A line read from memory during a quantum must still show this hart's own stores
+    void ApplyPendingStores(size_t slot)
+    {
+        if (_pendingStores.empty())
+            return;
+        Word* line = _data->LineData(slot);
+        for (size_t i = 0; i < _data->LineWords(); ++i) {
+            auto it = _pendingStores.find(_dataLineAddr + Word(wordBytes * i));
+            if (it != _pendingStores.end())
+                line[i] = MergeBytes(line[i], it->second.data, it->second.mask);
         }
+    }
 
-        return true;
+    size_t DirectoryLatency() const
+    {
+        return _bus->Config().directory ? _bus->Config().directoryLatency : 0;
     }
 
-    void Clock()
+    // Remembers a line another hart's store took away, and which word that store wrote
+    void LoseLine(Word lineAddr, std::optional<Word> writeOffset)
     {
-        if (_waitCycles > 0)
-            --_waitCycles;
+        ++_invalidations;
+        _lostLines[lineAddr] |= writeOffset && *writeOffset < 64 ? uint64_t(1) << *writeOffset : 0;
     }
 
-    size_t getWaitCycles()
+    // A miss on a line another hart's store took away is a coherence miss; when this access
+    // is to a different word than the ones written, the line was only falsely shared
+    void CountCoherenceMiss()
     {
-        return _waitCycles;
+        auto it = _lostLines.find(_dataLineAddr);
+        if (it == _lostLines.end())
+            return;
+        ++_coherenceMisses;
+        if (_dataOffset >= 64 || (it->second & (uint64_t(1) << _dataOffset)) == 0)
+            ++_falseSharingMisses;
+        _lostLines.erase(it);
     }
-private:
-    static constexpr size_t failLatency = 152;
-    static constexpr size_t codeLatency = 1;
-    static constexpr size_t dataLatency = 3;
+
+    UncachedMem& _mem;
+    MemoryConfig _config;
+    std::unique_ptr<ICache> _code;
+    std::unique_ptr<ICache> _data;
 
     Word _memoryRequestIp = 0;
-    Word _requestedIp = 0;
-    Word _requestedOffset = 0;
-    size_t _waitCycles = 0;
-    bool _cacheMiss = false;
+    Word _codeLineAddr = 0;
+    Word _codeOffset = 0;
+    std::optional<size_t> _codeSlot;
+    size_t _codeWaitCycles = 0;
+    std::optional<Word> _codeLowHalf;   // first half of a line-crossing instruction
+
+    Word _dataLineAddr = 0;
+    Word _dataOffset = 0;
+    std::optional<size_t> _dataSlot;
+    size_t _dataWaitCycles = 0;
+    bool _victimHit = false;
+    uint64_t _codeAccesses = 0;
+    uint64_t _codeMisses = 0;
+    uint64_t _codeStraddles = 0;
+    uint64_t _codeFlushes = 0;
+    uint64_t _flushedLines = 0;
+    uint64_t _refetchMisses = 0;
+    std::unordered_set<Word> _flushedCodeLines;   // dropped by a FENCE.I and not fetched since
+    uint64_t _dataAccesses = 0;
+    uint64_t _dataMisses = 0;
+
+    std::vector<LineState> _state;
+    VictimCache _victim;
+    TraceWriter* _trace = nullptr;
+    PerfEvents* _events = nullptr;
+
+    struct DeferredBusOp
+    {
+        enum Kind : uint8_t { Read, Write, Evict };
+        Word lineAddr;
+        Kind kind;
+    };
 
-    std::vector<std::pair<Line, Word>> _dataMem = std::vector<std::pair<Line, Word>>(dataCacheBytes/lineSizeBytes);;
-    std::vector<std::pair<Line, Word>> _codeMem = std::vector<std::pair<Line, Word>>(codeCacheBytes/lineSizeBytes);;
-    std::vector<Word> _lastDataUsage = std::vector<Word> (dataCacheBytes/lineSizeBytes);
-    std::vector<Word> _lastCodeUsage = std::vector<Word> (codeCacheBytes/lineSizeBytes);
-    UncachedMem& _mem;
+    // A word stored during the quantum, and the bytes of it the stores wrote
+    struct PendingStore
+    {
+        Word data = 0;
+        Word mask = 0;
+    };
+
+    struct QueuedAtomic
+    {
+        AmoFunc func;
+        MemFunc width;
+        Word addr;
+        Word operand;
+    };
+
+    std::optional<Word> _reservation;  // line address of the last LR
+    std::optional<QueuedAtomic> _queuedAtomic;
+    std::optional<Word> _atomicResult;
+    uint64_t _atomics = 0;
+    uint64_t _failedScs = 0;
+
+    CoherenceBus* _bus = nullptr;
+    bool _deferred = false;
+    std::unordered_map<Word, PendingStore> _pendingStores;
+    std::vector<DeferredBusOp> _busLog;
+    std::unordered_map<Word, uint64_t> _lostLines;
+    uint64_t _invalidations = 0;
+    uint64_t _coherenceMisses = 0;
+    uint64_t _falseSharingMisses = 0;
+    uint64_t _upgrades = 0;
+    uint64_t _transfers = 0;
 };
 
-#endif //RISCV_SIM_DATAMEMORY_H
\ No newline at end of file
+#endif //RISCV_SIM_DATAMEMORY_H
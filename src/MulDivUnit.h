@@ -0,0 +1,79 @@
+#ifndef RISCV_SIM_MULDIVUNIT_H
+#define RISCV_SIM_MULDIVUNIT_H
+
+#include <array>
+#include <ostream>
+
+#include "Instruction.h"
+
+struct MulDivConfig
+{
+    size_t mulLatency = 3;
+    size_t divLatency = 20;
+    bool mulPipelined = true;   // a new multiply may start every cycle
+    bool divPipelined = false;  // the divider is iterative and busy until the result is out
+
+    bool IsValid() const
+    {
+        return mulLatency != 0 && divLatency != 0;
+    }
+};
+
+// Timing of the multiplier and the divider of the M extension, two separate units. A pipelined
+// unit accepts an operation every cycle; otherwise it is busy for the whole latency.
+class MulDivUnit
+{
+public:
+    explicit MulDivUnit(const MulDivConfig& config)
+        : _config(config)
+    {
+
+    }
+
+    static bool IsDivide(MulDivFunc func)
+    {
+        return func >= MulDivFunc::Div;
+    }
+
+    size_t Latency(MulDivFunc func) const
+    {
+        return IsDivide(func) ? _config.divLatency : _config.mulLatency;
+    }
+
+    bool Free(MulDivFunc func, uint64_t cycle) const
+    {
+        return _freeCycle[IsDivide(func)] <= cycle;
+    }
+
+    // Starts the operation in the given cycle; returns the cycle its result is available
+    uint64_t Start(MulDivFunc func, uint64_t cycle)
+    {
+        bool divide = IsDivide(func);
+        bool pipelined = divide ? _config.divPipelined : _config.mulPipelined;
+        _freeCycle[divide] = cycle + (pipelined ? 1 : Latency(func));
+        ++_operations[divide];
+        return cycle + Latency(func);
+    }
+
+    // An operation waited a cycle for its unit
+    void BusyStall()
+    {
+        ++_busyStalls;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        if (_operations[0] == 0 && _operations[1] == 0)
+            return;
+        out << "Multiply/divide: multiplies = " << _operations[0] << ", divides = " << _operations[1]
+            << ", unit busy stalls = " << _busyStalls << std::endl;
+    }
+
+private:
+    MulDivConfig _config;
+    std::array<uint64_t, 2> _freeCycle{};
+    std::array<uint64_t, 2> _operations{};
+    uint64_t _busyStalls = 0;
+};
+
+#endif //RISCV_SIM_MULDIVUNIT_H
@@ -0,0 +1,451 @@
+#ifndef RISCV_SIM_OOOCPU_H
+#define RISCV_SIM_OOOCPU_H
+
+#include <deque>
+#include <limits>
+#include <list>
+#include <vector>
+
+#include "FetchUnit.h"
+#include "MulDivUnit.h"
+#include "VectorUnit.h"
+#include "CustomUnit.h"
+#include "StoreBuffer.h"
+
+struct OooConfig
+{
+    size_t fetchWidth = 4;
+    size_t dispatchWidth = 4;
+    size_t issueWidth = 4;
+    size_t commitWidth = 4;
+    size_t robEntries = 64;
+    size_t iqEntries = 32;
+    size_t lsqEntries = 16;
+    size_t physRegs = 96;
+    size_t fetchQueueEntries = 16;
+    size_t frontendLatency = 2;     // decode and rename, between fetch and dispatch
+    bool alignFetch = false;
+    bool fusion = false;
+
+    bool IsValid() const
+    {
+        return fetchWidth != 0 && dispatchWidth != 0 && issueWidth != 0 && commitWidth != 0 && robEntries != 0
+               && iqEntries != 0 && lsqEntries != 0 && fetchQueueEntries != 0 && physRegs > 32;
+    }
+};
+
+// Out-of-order timing model. The FetchUnit runs instructions functionally as it fetches them;
+// the back end replays them through register renaming, a unified issue queue, the reorder
+// buffer and the load/store queue to find out when each could have executed and retired.
+class OooCpu
+{
+public:
+    OooCpu(CachedMem& mem, const OooConfig& config = OooConfig(), const PredictorConfig& predictor = PredictorConfig(),
+           size_t storeBufferEntries = 0, const MulDivConfig& mulDiv = MulDivConfig(),
+           const VectorConfig& vector = VectorConfig(), const CustomExtensions* custom = nullptr)
+        : _mem(mem)
+        , _config(config)
+        , _predictor(predictor)
+        , _fetch(mem, _csrf, _predictor,
+                 FetchConfig{config.fetchWidth, config.fetchQueueEntries, config.frontendLatency, config.alignFetch,
+                             config.fusion},
+                 vector.vlen, custom)
+        , _storeBuffer(storeBufferEntries)
+        , _mulDiv(mulDiv)
+        , _vector(vector)
+        , _custom(custom)
+    {
+        _mem.SetPerfEvents(&_csrf.Events());
+    }
+
+    void Clock()
+    {
+        _csrf.Clock();
+        ++_cycles;
+
+        Commit();
+        DataPort();
+        Issue();
+        DrainStoreBuffer();
+        Dispatch();
+        _fetch.Clock(_cycles, _rob.empty());
+    }
+
+    void Reset(Word ip)
+    {
+        _csrf.Reset();
+        _fetch.Reset(ip);
+        _rob.clear();
+        _iq.clear();
+        _lsqUsed = 0;
+
+        // Architectural register i starts out in physical register i, all values available
+        _readyCycle.assign(_config.physRegs, 0);
+        _freeList.clear();
+        for (size_t r = 0; r < _renameTable.size(); ++r)
+            _renameTable[r] = r;
+        for (size_t r = _renameTable.size(); r < _config.physRegs; ++r)
+            _freeList.push_back(r);
+    }
+
+    void SetHartId(Word id)
+    {
+        _csrf.SetHartId(id);
+    }
+
+    std::optional<CpuToHostData> GetMessage()
+    {
+        return _csrf.GetMessage();
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Out-of-order core: cycles = " << _cycles << ", instructions = " << _retired << ", IPC = "
+            << (_cycles == 0 ? 0.0 : double(_retired) / double(_cycles)) << std::endl;
+        _fetch.PrintStats(out);
+        out << "Dispatch stalls: rob full = " << _robFullStalls << ", iq full = " << _iqFullStalls << ", lsq full = "
+            << _lsqFullStalls << ", no free register = " << _regStalls << std::endl;
+        out << "Load/store queue: loads = " << _loads << ", forwarded = " << _forwardedLoads
+            << ", blocked on older stores = " << _disambiguationStalls << std::endl;
+        _predictor.PrintStats(out, _retired);
+        _mulDiv.PrintStats(out);
+        _vector.PrintStats(out);
+        _custom.PrintStats(out);
+        if (_storeBuffer.Enabled())
+            _storeBuffer.PrintStats(out);
+    }
+
+private:
+    static constexpr uint64_t notReady = std::numeric_limits<uint64_t>::max();
+
+    struct RobEntry
+    {
+        InstructionPtr instr;
+        Word ip = 0;
+        Prediction prediction;
+        bool mispredicted = false;
+        std::optional<size_t> src1;
+        std::optional<size_t> src2;
+        std::optional<size_t> dst;
+        std::optional<size_t> oldDst;   // freed when this instruction commits
+        bool issued = false;
+        bool written = false;           // store performed by the commit stage, without a store buffer
+        uint64_t doneCycle = notReady;
+    };
+
+    enum class PortUser
+    {
+        None,
+        Load,
+        Store,
+        Drain,
+    };
+
+    RobEntry& Entry(uint64_t seq)
+    {
+        return _rob[seq - _headSeq];
+    }
+
+    static bool IsMemory(const InstructionPtr& instr)
+    {
+        return instr->_type == IType::Ld || instr->_type == IType::St || instr->_type == IType::Amo;
+    }
+
+    static bool SameWord(Word a, Word b)
+    {
+        return WordAddr(a) == WordAddr(b);
+    }
+
+    // Renames and allocates back end resources for fetched instructions, in order
+    void Dispatch()
+    {
+        for (size_t n = 0; n < _config.dispatchWidth && _fetch.Ready(_cycles); ++n) {
+            FetchUnit::Fetched& f = _fetch.Front();
+
+            bool memory = IsMemory(f.instr);
+            if (_rob.size() >= _config.robEntries) {
+                ++_robFullStalls;
+                break;
+            }
+            if (_iq.size() >= _config.iqEntries) {
+                ++_iqFullStalls;
+                break;
+            }
+            if (memory && _lsqUsed >= _config.lsqEntries) {
+                ++_lsqFullStalls;
+                break;
+            }
+            if (f.instr->_dst && _freeList.empty()) {
+                ++_regStalls;
+                break;
+            }
+
+            RobEntry e;
+            if (f.instr->_src1)
+                e.src1 = _renameTable[*f.instr->_src1];
+            if (f.instr->_src2)
+                e.src2 = _renameTable[*f.instr->_src2];
+            if (f.instr->_dst) {
+                e.oldDst = _renameTable[*f.instr->_dst];
+                e.dst = _freeList.front();
+                _freeList.pop_front();
+                _renameTable[*f.instr->_dst] = *e.dst;
+                _readyCycle[*e.dst] = notReady;
+            }
+            e.instr = std::move(f.instr);
+            e.ip = f.ip;
+            e.prediction = f.prediction;
+            e.mispredicted = f.mispredicted;
+
+            _iq.push_back(_headSeq + _rob.size());
+            _rob.push_back(std::move(e));
+            _lsqUsed += memory;
+            _fetch.Pop();
+        }
+    }
+
+    bool OperandReady(const std::optional<size_t>& reg) const
+    {
+        return !reg || _readyCycle[*reg] <= _cycles;
+    }
+
+    // Oldest ready instructions first, up to the issue width. Vector instructions keep program
+    // order among themselves, since the vector unit does not rename vector registers.
+    void Issue()
+    {
+        size_t issued = 0;
+        bool olderVector = false;
+        for (auto it = _iq.begin(); it != _iq.end() && issued < _config.issueWidth;) {
+            RobEntry& e = Entry(*it);
+            bool vector = e.instr->_type == IType::Vector;
+            if ((vector && olderVector) || !OperandReady(e.src1) || !OperandReady(e.src2) || !Execute(*it, e)) {
+                olderVector |= vector;
+                ++it;
+                continue;
+            }
+            e.issued = true;
+            it = _iq.erase(it);
+            ++issued;
+        }
+    }
+
+    bool Execute(uint64_t seq, RobEntry& e)
+    {
+        if (e.instr->_type == IType::Ld)
+            return ExecuteLoad(seq, e);
+        if (e.instr->_type == IType::Amo)
+            return ExecuteAtomic(seq, e);
+
+        if (e.instr->_type == IType::MulDiv) {
+            if (!_mulDiv.Free(e.instr->_mulDivFunc, _cycles)) {
+                _mulDiv.BusyStall();
+                return false;
+            }
+            Complete(e, _mulDiv.Start(e.instr->_mulDivFunc, _cycles));
+            return true;
+        }
+        if (e.instr->_type == IType::Vector) {
+            if (!_vector.Free(_cycles)) {
+                _vector.BusyStall();
+                return false;
+            }
+            Complete(e, _vector.Start(*e.instr, _cycles));
+            return true;
+        }
+        if (e.instr->_type == IType::Custom) {
+            if (!_custom.Free(_cycles)) {
+                _custom.BusyStall();
+                return false;
+            }
+            Complete(e, _custom.Start(*e.instr, _cycles));
+            return true;
+        }
+
+        // Fences execute from the head of the reorder buffer, once every older store has left
+        // the store buffer; fetch waits for a FENCE.I to flush the code cache
+        if (e.instr->_type == IType::Fence && (seq != _headSeq || !_storeBuffer.Empty() || _port != PortUser::None))
+            return false;
+
+        // Everything else, stores included, takes one cycle; stores write memory at commit
+        Complete(e, _cycles + 1);
+        if (IsFenceI(*e.instr)) {
+            _mem.FlushCode();
+            _fetch.Resume(e.doneCycle);
+        }
+        if (e.mispredicted) {
+            _predictor.Recover(e.ip, *e.instr, e.prediction);
+            _fetch.Resume(e.doneCycle);
+        }
+        return true;
+    }
+
+    // Loads wait until every older store knows its address, then take the youngest matching
+    // stores' data or go to the data cache. A load that needs bytes of older stores merged with
+    // the cached word waits until they have been written.
+    bool ExecuteLoad(uint64_t seq, RobEntry& e)
+    {
+        Word needed = ByteMask(e.instr->_memFunc, e.instr->_addr);
+        Word covered = 0;
+        for (uint64_t older = seq; older-- > _headSeq;) {
+            const RobEntry& store = Entry(older);
+            if (store.instr->_type != IType::St && store.instr->_type != IType::Amo)
+                continue;
+            if (!store.issued || (store.instr->_type == IType::Amo && store.doneCycle > _cycles)) {
+                ++_disambiguationStalls;
+                return false;
+            }
+            if (SameWord(store.instr->_addr, e.instr->_addr))
+                covered |= ByteMask(store.instr->_memFunc, store.instr->_addr) & needed;
+        }
+
+        bool forwarded = covered == needed
+                         || (covered == 0 && _storeBuffer.Forward(e.instr->_addr, e.instr->_memFunc));
+        if (!forwarded && (covered != 0 || _storeBuffer.Overlaps(e.instr->_addr, e.instr->_memFunc))) {
+            ++_disambiguationStalls;
+            return false;
+        }
+        if (forwarded) {
+            ++_loads;
+            ++_forwardedLoads;
+            Complete(e, _cycles + 1);
+            return true;
+        }
+
+        if (_port != PortUser::None || _mem.getDataWaitCycles() != 0)
+            return false;
+        ++_loads;
+        _mem.Request(e.instr);
+        _port = PortUser::Load;
+        _portSeq = seq;
+        return true;
+    }
+
+    // Atomics go to the data cache from the head of the reorder buffer, once every older store
+    // has left the store buffer
+    bool ExecuteAtomic(uint64_t seq, RobEntry& e)
+    {
+        if (seq != _headSeq || !_storeBuffer.Empty() || _port != PortUser::None || _mem.getDataWaitCycles() != 0)
+            return false;
+        _mem.Request(e.instr);
+        _port = PortUser::Load;
+        _portSeq = seq;
+        return true;
+    }
+
+    void Complete(RobEntry& e, uint64_t cycle)
+    {
+        e.doneCycle = cycle;
+        if (e.dst)
+            _readyCycle[*e.dst] = cycle;
+    }
+
+    // Finishes the access in flight on the single data port
+    void DataPort()
+    {
+        if (_port == PortUser::None)
+            return;
+
+        // Memory already holds the functional result
+        InstructionPtr& instr = _port == PortUser::Drain ? _drainInstruction : Entry(_portSeq).instr;
+        if (_mem.getDataWaitCycles() != 0 || !_mem.Replay(instr, _csrf.getCycleNumber()))
+            return;
+
+        if (_port == PortUser::Load)
+            Complete(Entry(_portSeq), _cycles);
+        else if (_port == PortUser::Store)
+            Entry(_portSeq).written = true;
+        else
+            _storeBuffer.Pop();
+        _port = PortUser::None;
+    }
+
+    void DrainStoreBuffer()
+    {
+        if (_port != PortUser::None || _storeBuffer.Empty() || _mem.getDataWaitCycles() != 0)
+            return;
+
+        _drainInstruction = std::make_unique<Instruction>();
+        _drainInstruction->_type = IType::St;
+        _drainInstruction->_addr = _storeBuffer.Front().addr;
+        _drainInstruction->_memFunc = _storeBuffer.Front().func;
+        _mem.Request(_drainInstruction);
+        _port = PortUser::Drain;
+    }
+
+    // Stores leave the load/store queue into the store buffer, or write the cache themselves without one
+    bool CommitStore(uint64_t seq, RobEntry& e)
+    {
+        if (_storeBuffer.Enabled()) {
+            if (_storeBuffer.Full()) {
+                _storeBuffer.FullStall();
+                return false;
+            }
+            _storeBuffer.Push(e.instr->_addr, e.instr->_data, e.instr->_memFunc);
+            return true;
+        }
+
+        if (e.written)
+            return true;
+        if (_port == PortUser::None && _mem.getDataWaitCycles() == 0) {
+            _mem.Request(e.instr);
+            _port = PortUser::Store;
+            _portSeq = seq;
+        }
+        return false;
+    }
+
+    void Commit()
+    {
+        for (size_t n = 0; n < _config.commitWidth && !_rob.empty(); ++n) {
+            RobEntry& head = _rob.front();
+            if (head.doneCycle > _cycles)
+                break;
+            if (head.instr->_type == IType::St && !CommitStore(_headSeq, head))
+                break;
+
+            _predictor.Update(head.ip, *head.instr, head.prediction);
+            if (head.oldDst)
+                _freeList.push_back(*head.oldDst);
+            _lsqUsed -= IsMemory(head.instr);
+            _csrf.InstructionExecuted(RetiredCount(*head.instr));
+            _retired += RetiredCount(*head.instr);
+
+            _rob.pop_front();
+            ++_headSeq;
+        }
+    }
+
+    CachedMem& _mem;
+    OooConfig _config;
+    CsrFile _csrf;
+    BranchPredictor _predictor;
+    FetchUnit _fetch;
+    StoreBuffer _storeBuffer;
+    MulDivUnit _mulDiv;
+    VectorUnit _vector;
+    CustomUnit _custom;
+
+    std::array<size_t, 32> _renameTable{};
+    std::deque<size_t> _freeList;
+    std::vector<uint64_t> _readyCycle;
+    std::deque<RobEntry> _rob;
+    uint64_t _headSeq = 0;
+    std::list<uint64_t> _iq;
+    size_t _lsqUsed = 0;
+
+    PortUser _port = PortUser::None;
+    uint64_t _portSeq = 0;
+    InstructionPtr _drainInstruction;
+
+    uint64_t _cycles = 0;
+    uint64_t _retired = 0;
+    uint64_t _robFullStalls = 0;
+    uint64_t _iqFullStalls = 0;
+    uint64_t _lsqFullStalls = 0;
+    uint64_t _regStalls = 0;
+    uint64_t _loads = 0;
+    uint64_t _forwardedLoads = 0;
+    uint64_t _disambiguationStalls = 0;
+};
+
+#endif //RISCV_SIM_OOOCPU_H
@@ -0,0 +1,476 @@
+#ifndef RISCV_SIM_OPTIONS_H
+#define RISCV_SIM_OPTIONS_H
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "CacheModel.h"
+#include "CacheSweep.h"
+#include "Memory.h"
+#include "OooCpu.h"
+#include "PipelinedCpu.h"
+#include "SuperscalarCpu.h"
+
+enum class CoreModel
+{
+    Simple,
+    Pipelined,
+    OutOfOrder,
+    Superscalar,
+};
+
+// crt.S gives every hart a 128 KiB stack above the program image; 16 of them fit in memory
+constexpr size_t maxHarts = 16;
+
+struct SimOptions
+{
+    CoreModel core = CoreModel::Simple;
+    PipelineConfig pipeline;
+    OooConfig ooo;
+    SuperscalarConfig superscalar;
+    PredictorConfig predictor;
+    MulDivConfig mulDiv;
+    VectorConfig vector;
+    std::string traceFile;
+    std::string sweepTrace;
+    MemoryConfig memory;
+    size_t storeBufferEntries = 0;
+    bool fusion = false;    // simple core; the superscalar and ooo configs have their own
+    bool stats = false;
+    size_t harts = 1;
+    size_t quantum = 0;     // cycles between synchronisations of parallel harts, 0 to run them on one thread
+    CoherenceConfig coherence;
+
+    std::vector<size_t> sweepSizes = {1024, 2048, 4096, 8192, 16384};
+    std::vector<size_t> sweepWays = {1, 2, 4, 8};
+    std::vector<size_t> sweepLines = {32, 64, 128};
+    std::vector<ReplacementPolicy> sweepPolicies = {ReplacementPolicy::Lru, ReplacementPolicy::Fifo,
+                                                    ReplacementPolicy::Random};
+    std::vector<size_t> sweepVictims = {0};
+    unsigned sweepThreads = 0;
+    TraceFilter sweepFilter = TraceFilter::Data;
+    bool sweepJson = false;
+    std::string sweepOut;
+};
+
+inline void PrintUsage(const char* name)
+{
+    std::cerr << "usage: " << name << " [options]\n"
+              << "  --config FILE            read options from FILE, one \"name = value\" per line\n"
+              << "  --stats                  print core and cache statistics when the program exits\n"
+              << "  --harts N                run N harts with private L1 caches over shared memory (default 1, max 16)\n"
+              << "  --quantum N              run every hart on its own host thread, meeting the others every N\n"
+              << "                           cycles (e.g. 1000); 0 clocks them in turn on one thread (default 0)\n"
+              << "  --coherence P            none, mesi or moesi between the harts' data caches (default mesi)\n"
+              << "  --coherence-mode M       snoop (probe every cache) or directory (probe holders only)\n"
+              << "  --transfer-latency N     miss served by another cache (default 40)\n"
+              << "  --upgrade-latency N      store hit to a shared line (default 20)\n"
+              << "  --invalidate-latency N   extra for a store miss that invalidates other copies (default 10)\n"
+              << "  --directory-latency N    directory lookup per coherence transaction (default 10)\n"
+              << "  --core C                 simple (one instruction at a time), pipelined (5-stage), superscalar\n"
+              << "                           (in-order, N-wide) or ooo\n"
+              << "  --issue-width N          superscalar core fetch and issue width (default 2)\n"
+              << "  --pairing A,M,B,S        superscalar core ALU, memory, branch and system instructions issued\n"
+              << "                           per cycle (default 2,1,1,1)\n"
+              << "  --fetch-align B          superscalar and ooo fetch groups stay in a width-aligned block, 0 or 1\n"
+              << "                           (defaults 1 and 0)\n"
+              << "  --fusion B               simple, superscalar and ooo cores fuse lui+addi, auipc+jalr, auipc+load\n"
+              << "                           and slli+srli pairs into one operation, 0 or 1 (default 0);\n"
+              << "                           not with the pipelined core\n"
+              << "  --forwarding F           pipelined core bypass paths: none, wb or full (default full)\n"
+              << "  --branch-stage S         pipelined core resolves branches in ex or mem (default ex)\n"
+              << "  --flush-penalty N        extra fetch bubbles after a pipeline flush (default 0)\n"
+              << "  --ooo-width N            ooo core fetch, dispatch, issue and commit width (default 4)\n"
+              << "  --rob-entries N          ooo core reorder buffer entries (default 64)\n"
+              << "  --iq-entries N           ooo core issue queue entries (default 32)\n"
+              << "  --lsq-entries N          ooo core load/store queue entries (default 16)\n"
+              << "  --phys-regs N            ooo core physical registers, more than 32 (default 96)\n"
+              << "  --frontend-latency N     ooo core cycles from fetch to dispatch (default 2)\n"
+              << "  --mul-latency N          multiply latency in cycles (default 3)\n"
+              << "  --div-latency N          divide and remainder latency in cycles (default 20)\n"
+              << "  --mul-pipelined B        a multiply may start every cycle, 0 or 1 (default 1)\n"
+              << "  --div-pipelined B        a divide may start every cycle, 0 or 1 (default 0)\n"
+              << "  --vlen N                 bits in a vector register, a power of two from 32 to 65536 (default 128)\n"
+              << "  --vector-lanes N         32-bit lanes of the vector unit (default 4)\n"
+              << "  --vector-mem-bytes N     bytes a cycle the vector memory port moves (default 16)\n"
+              << "  --vector-mem-latency N   cycles before a vector load or store starts moving data (default 4)\n"
+              << "  --bpred P                pipelined and ooo core direction predictor: none, bimodal, gshare, tournament\n"
+              << "                           or tage (default bimodal)\n"
+              << "  --bht-entries N          2-bit counters of the bimodal, gshare, tournament global and TAGE\n"
+              << "                           base tables (default 256)\n"
+              << "  --bpred-history N        gshare global / tournament local history bits (default 12)\n"
+              << "  --local-entries N        tournament local history table entries (default 256)\n"
+              << "  --tage-tables N          tagged TAGE tables, at most 32 less log2 of the entries (default 4)\n"
+              << "  --tage-entries N         entries per tagged TAGE table, at least 2 (default 256)\n"
+              << "  --tage-tag-bits N        TAGE tag width (default 9)\n"
+              << "  --tage-history MIN,MAX   shortest and longest TAGE history, up to 64 (default 4,64)\n"
+              << "  --btb-entries N          branch target buffer entries (default 64)\n"
+              << "  --ras-entries N          return address stack depth (default 8)\n"
+              << "  --bpred-report N         print the N most mispredicted branches with the statistics\n"
+              << "  --line-size N            cache line size in bytes (default 128)\n"
+              << "  --dcache-size N          data cache size in bytes (default 4096)\n"
+              << "  --icache-size N          code cache size in bytes (default 1024)\n"
+              << "  --dcache-ways N          data cache associativity, 0 for fully associative (default 0)\n"
+              << "  --icache-ways N          code cache associativity, 0 for fully associative (default 0)\n"
+              << "  --cache-policy P         lru, fifo or random replacement (default lru)\n"
+              << "  --dcache-latency N       data cache hit latency in cycles (default 3)\n"
+              << "  --icache-latency N       code cache hit latency in cycles (default 1)\n"
+              << "  --miss-latency N         cache miss latency in cycles (default 152)\n"
+              << "  --writeback-latency N    extra latency of a store miss that evicts a line (default 120)\n"
+              << "  --atomic-latency N       extra cycles of an AMO read-modify-write in the data cache (default 2)\n"
+              << "  --victim-latency N       victim cache hit latency in cycles (default 4)\n"
+              << "  --victim-entries N       add an N-entry victim cache behind the data cache\n"
+              << "  --store-buffer N         retire stores into an N-entry store buffer (0 blocks on stores);\n"
+              << "                           not with the pipelined core, whose stores complete in MEM\n"
+              << "  --trace FILE             record the memory access trace of hart 0\n"
+              << "  --sweep FILE             evaluate cache configurations over a recorded trace\n"
+              << "  --sweep-sizes LIST       cache sizes in bytes, e.g. 1024,4096\n"
+              << "  --sweep-ways LIST        associativities\n"
+              << "  --sweep-lines LIST       line sizes in bytes\n"
+              << "  --sweep-policies LIST    any of lru,fifo,random\n"
+              << "  --sweep-victims LIST     victim cache sizes in entries, 0 for none\n"
+              << "  --sweep-threads N        worker threads (default: all host cores)\n"
+              << "  --sweep-stream S         data, code or all accesses (default: data)\n"
+              << "  --sweep-format F         csv or json (default: csv)\n"
+              << "  --sweep-out FILE         write the table to FILE instead of stdout\n";
+}
+
+inline std::vector<std::string> SplitList(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+inline bool ParseNumber(const std::string& text, size_t& value)
+{
+    char* end = nullptr;
+    unsigned long long parsed = std::strtoull(text.c_str(), &end, 0);
+    if (text.empty() || *end != '\0')
+        return false;
+    value = parsed;
+    return true;
+}
+
+inline bool ParseNumberList(const std::string& text, std::vector<size_t>& values)
+{
+    values.clear();
+    for (const std::string& item : SplitList(text)) {
+        size_t value;
+        if (!ParseNumber(item, value))
+            return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+inline std::string Trim(const std::string& text)
+{
+    size_t first = text.find_first_not_of(" \t\r");
+    if (first == std::string::npos)
+        return std::string();
+    size_t last = text.find_last_not_of(" \t\r");
+    return text.substr(first, last - first + 1);
+}
+
+// Applies one option, named without the leading dashes. Command line and config files share it.
+inline bool ApplyOption(const std::string& name, const std::string& value, SimOptions& options)
+{
+    MemoryConfig& memory = options.memory;
+    bool ok = true;
+    if (name == "stats") {
+        ok = value == "1" || value == "0" || value == "true" || value == "false";
+        options.stats = value == "1" || value == "true";
+    } else if (name == "harts") {
+        ok = ParseNumber(value, options.harts) && options.harts >= 1 && options.harts <= maxHarts;
+    } else if (name == "quantum") {
+        ok = ParseNumber(value, options.quantum);
+    } else if (name == "coherence") {
+        std::optional<CoherenceProtocol> protocol = ParseCoherenceProtocol(value);
+        ok = protocol.has_value();
+        options.coherence.protocol = protocol.value_or(options.coherence.protocol);
+    } else if (name == "coherence-mode") {
+        ok = value == "snoop" || value == "directory";
+        options.coherence.directory = value == "directory";
+    } else if (name == "transfer-latency") {
+        ok = ParseNumber(value, options.coherence.transferLatency);
+    } else if (name == "upgrade-latency") {
+        ok = ParseNumber(value, options.coherence.upgradeLatency);
+    } else if (name == "invalidate-latency") {
+        ok = ParseNumber(value, options.coherence.invalidateLatency);
+    } else if (name == "directory-latency") {
+        ok = ParseNumber(value, options.coherence.directoryLatency);
+    } else if (name == "core") {
+        ok = value == "simple" || value == "pipelined" || value == "superscalar" || value == "ooo";
+        options.core = value == "pipelined"     ? CoreModel::Pipelined
+                       : value == "superscalar" ? CoreModel::Superscalar
+                       : value == "ooo"         ? CoreModel::OutOfOrder
+                                                : CoreModel::Simple;
+    } else if (name == "issue-width") {
+        size_t width;
+        ok = ParseNumber(value, width);
+        options.superscalar.fetchWidth = options.superscalar.issueWidth = width;
+    } else if (name == "pairing") {
+        std::vector<size_t> slots;
+        ok = ParseNumberList(value, slots) && slots.size() == options.superscalar.perCycle.size();
+        if (ok)
+            std::copy(slots.begin(), slots.end(), options.superscalar.perCycle.begin());
+    } else if (name == "fetch-align") {
+        ok = value == "0" || value == "1";
+        options.superscalar.alignFetch = options.ooo.alignFetch = value == "1";
+    } else if (name == "fusion") {
+        ok = value == "0" || value == "1";
+        options.fusion = options.superscalar.fusion = options.ooo.fusion = value == "1";
+    } else if (name == "forwarding") {
+        ok = value == "none" || value == "wb" || value == "full";
+        options.pipeline.forwardExMem = value == "full";
+        options.pipeline.forwardMemWb = value != "none";
+    } else if (name == "branch-stage") {
+        ok = value == "ex" || value == "mem";
+        options.pipeline.branchStage = value == "mem" ? BranchStage::Mem : BranchStage::Ex;
+    } else if (name == "flush-penalty") {
+        ok = ParseNumber(value, options.pipeline.flushPenalty);
+    } else if (name == "ooo-width") {
+        size_t width;
+        ok = ParseNumber(value, width);
+        options.ooo.fetchWidth = options.ooo.dispatchWidth = options.ooo.issueWidth = options.ooo.commitWidth = width;
+    } else if (name == "rob-entries") {
+        ok = ParseNumber(value, options.ooo.robEntries);
+    } else if (name == "iq-entries") {
+        ok = ParseNumber(value, options.ooo.iqEntries);
+    } else if (name == "lsq-entries") {
+        ok = ParseNumber(value, options.ooo.lsqEntries);
+    } else if (name == "phys-regs") {
+        ok = ParseNumber(value, options.ooo.physRegs);
+    } else if (name == "frontend-latency") {
+        ok = ParseNumber(value, options.ooo.frontendLatency);
+    } else if (name == "mul-latency") {
+        ok = ParseNumber(value, options.mulDiv.mulLatency);
+    } else if (name == "div-latency") {
+        ok = ParseNumber(value, options.mulDiv.divLatency);
+    } else if (name == "mul-pipelined") {
+        ok = value == "0" || value == "1";
+        options.mulDiv.mulPipelined = value == "1";
+    } else if (name == "div-pipelined") {
+        ok = value == "0" || value == "1";
+        options.mulDiv.divPipelined = value == "1";
+    } else if (name == "vlen") {
+        ok = ParseNumber(value, options.vector.vlen);
+    } else if (name == "vector-lanes") {
+        ok = ParseNumber(value, options.vector.lanes);
+    } else if (name == "vector-mem-bytes") {
+        ok = ParseNumber(value, options.vector.memBytes);
+    } else if (name == "vector-mem-latency") {
+        ok = ParseNumber(value, options.vector.memLatency);
+    } else if (name == "bpred") {
+        std::optional<PredictorKind> kind = ParsePredictorKind(value);
+        ok = kind.has_value();
+        options.predictor.kind = kind.value_or(options.predictor.kind);
+    } else if (name == "bht-entries") {
+        ok = ParseNumber(value, options.predictor.bhtEntries);
+    } else if (name == "bpred-history") {
+        ok = ParseNumber(value, options.predictor.historyBits);
+    } else if (name == "local-entries") {
+        ok = ParseNumber(value, options.predictor.localEntries);
+    } else if (name == "tage-tables") {
+        ok = ParseNumber(value, options.predictor.tageTables);
+    } else if (name == "tage-entries") {
+        ok = ParseNumber(value, options.predictor.tageEntries);
+    } else if (name == "tage-tag-bits") {
+        ok = ParseNumber(value, options.predictor.tageTagBits);
+    } else if (name == "tage-history") {
+        std::vector<size_t> lengths;
+        ok = ParseNumberList(value, lengths) && lengths.size() == 2;
+        if (ok) {
+            options.predictor.tageMinHistory = lengths[0];
+            options.predictor.tageMaxHistory = lengths[1];
+        }
+    } else if (name == "btb-entries") {
+        ok = ParseNumber(value, options.predictor.btbEntries);
+    } else if (name == "ras-entries") {
+        ok = ParseNumber(value, options.predictor.rasEntries);
+    } else if (name == "bpred-report") {
+        ok = ParseNumber(value, options.predictor.reportRows);
+    } else if (name == "line-size") {
+        ok = ParseNumber(value, memory.lineSizeBytes);
+    } else if (name == "dcache-size") {
+        ok = ParseNumber(value, memory.dataCacheBytes);
+    } else if (name == "icache-size") {
+        ok = ParseNumber(value, memory.codeCacheBytes);
+    } else if (name == "dcache-ways") {
+        ok = ParseNumber(value, memory.dataCacheWays);
+    } else if (name == "icache-ways") {
+        ok = ParseNumber(value, memory.codeCacheWays);
+    } else if (name == "cache-policy") {
+        std::optional<ReplacementPolicy> policy = ParseReplacementPolicy(value);
+        ok = policy.has_value();
+        memory.cachePolicy = policy.value_or(memory.cachePolicy);
+    } else if (name == "miss-latency") {
+        ok = ParseNumber(value, memory.failLatency);
+    } else if (name == "icache-latency") {
+        ok = ParseNumber(value, memory.codeLatency);
+    } else if (name == "dcache-latency") {
+        ok = ParseNumber(value, memory.dataLatency);
+    } else if (name == "writeback-latency") {
+        ok = ParseNumber(value, memory.writebackLatency);
+    } else if (name == "atomic-latency") {
+        ok = ParseNumber(value, memory.atomicLatency);
+    } else if (name == "victim-latency") {
+        ok = ParseNumber(value, memory.victimLatency);
+    } else if (name == "victim-entries") {
+        ok = ParseNumber(value, memory.victimEntries);
+    } else if (name == "store-buffer") {
+        ok = ParseNumber(value, options.storeBufferEntries);
+    } else if (name == "trace") {
+        options.traceFile = value;
+    } else if (name == "sweep") {
+        options.sweepTrace = value;
+    } else if (name == "sweep-sizes") {
+        ok = ParseNumberList(value, options.sweepSizes);
+    } else if (name == "sweep-ways") {
+        ok = ParseNumberList(value, options.sweepWays);
+    } else if (name == "sweep-lines") {
+        ok = ParseNumberList(value, options.sweepLines);
+    } else if (name == "sweep-victims") {
+        ok = ParseNumberList(value, options.sweepVictims);
+    } else if (name == "sweep-policies") {
+        options.sweepPolicies.clear();
+        for (const std::string& item : SplitList(value)) {
+            std::optional<ReplacementPolicy> policy = ParseReplacementPolicy(item);
+            ok = ok && policy.has_value();
+            if (policy)
+                options.sweepPolicies.push_back(*policy);
+        }
+        ok = ok && !options.sweepPolicies.empty();
+    } else if (name == "sweep-threads") {
+        size_t threads;
+        ok = ParseNumber(value, threads);
+        options.sweepThreads = unsigned(threads);
+    } else if (name == "sweep-stream") {
+        if (value == "data")
+            options.sweepFilter = TraceFilter::Data;
+        else if (value == "code")
+            options.sweepFilter = TraceFilter::Code;
+        else if (value == "all")
+            options.sweepFilter = TraceFilter::All;
+        else
+            ok = false;
+    } else if (name == "sweep-format") {
+        ok = value == "csv" || value == "json";
+        options.sweepJson = value == "json";
+    } else if (name == "sweep-out") {
+        options.sweepOut = value;
+    } else {
+        std::cerr << "ERROR: options: unknown option \"" << name << "\"" << std::endl;
+        return false;
+    }
+
+    if (!ok)
+        std::cerr << "ERROR: options: bad value \"" << value << "\" for " << name << std::endl;
+    return ok;
+}
+
+// Config files hold one "name = value" per line, using the command line option names; '#' starts a comment
+inline bool ParseConfigFile(const std::string& fileName, SimOptions& options)
+{
+    std::ifstream file(fileName);
+    if (!file.is_open()) {
+        std::cerr << "ERROR: options: failed opening config file \"" << fileName << "\"" << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (int lineNo = 1; std::getline(file, line); ++lineNo) {
+        line = Trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "ERROR: options: " << fileName << ":" << lineNo << ": expected \"name = value\"" << std::endl;
+            return false;
+        }
+        if (!ApplyOption(Trim(line.substr(0, eq)), Trim(line.substr(eq + 1)), options))
+            return false;
+    }
+    return true;
+}
+
+inline bool ParseOptions(int argc, char** argv, SimOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            PrintUsage(argv[0]);
+            return false;
+        }
+        if (arg.compare(0, 2, "--") != 0) {
+            std::cerr << "ERROR: options: unexpected argument \"" << arg << "\"" << std::endl;
+            return false;
+        }
+
+        std::string name = arg.substr(2);
+        if (name == "stats") {
+            options.stats = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: options: missing value for \"" << arg << "\"" << std::endl;
+            return false;
+        }
+
+        std::string value = argv[++i];
+        bool ok = name == "config" ? ParseConfigFile(value, options) : ApplyOption(name, value, options);
+        if (!ok)
+            return false;
+    }
+
+    if (!options.memory.IsValid()) {
+        std::cerr << "ERROR: options: line size must be a power of two and divide both cache sizes, "
+                  << "ways must divide the number of lines, and the number of sets must be a power of two" << std::endl;
+        return false;
+    }
+    if (!options.superscalar.IsValid()) {
+        std::cerr << "ERROR: options: superscalar core widths and pairing limits must be non-zero" << std::endl;
+        return false;
+    }
+    if (!options.ooo.IsValid()) {
+        std::cerr << "ERROR: options: ooo core widths and queue sizes must be non-zero, with more than 32 physical "
+                  << "registers" << std::endl;
+        return false;
+    }
+    if (options.core == CoreModel::Pipelined && options.storeBufferEntries != 0) {
+        std::cerr << "ERROR: options: the pipelined core has no store buffer" << std::endl;
+        return false;
+    }
+    if (options.core == CoreModel::Pipelined && options.fusion) {
+        std::cerr << "ERROR: options: the pipelined core does not fuse instructions" << std::endl;
+        return false;
+    }
+    if (!options.mulDiv.IsValid()) {
+        std::cerr << "ERROR: options: multiply and divide latencies must be non-zero" << std::endl;
+        return false;
+    }
+    if (!options.vector.IsValid()) {
+        std::cerr << "ERROR: options: vlen must be a power of two from 32 to 65536, vector lanes and memory bytes "
+                  << "non-zero" << std::endl;
+        return false;
+    }
+    if (!options.predictor.IsValid()) {
+        std::cerr << "ERROR: options: predictor table sizes must be powers of two, history up to 24 bits "
+                  << "(TAGE: 64), TAGE tags 2 to 16 bits, at least 2 entries per TAGE table, "
+                  << "TAGE tables plus log2 of the entries at most 32" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif //RISCV_SIM_OPTIONS_H
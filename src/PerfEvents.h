@@ -0,0 +1,43 @@
+#ifndef RISCV_SIM_PERFEVENTS_H
+#define RISCV_SIM_PERFEVENTS_H
+
+#include <array>
+#include <cstdint>
+
+#include "BaseTypes.h"
+
+// Simulator events the programmable counters mhpmcounter3..31 can count. Guest code selects one
+// by writing its number to the matching mhpmevent register; 0 stops the counter.
+enum class HpmEvent : Word
+{
+    None             = 0,
+    CodeAccess       = 1,   // L1I lookups
+    CodeMiss         = 2,
+    DataAccess       = 3,   // L1D lookups
+    DataMiss         = 4,
+    BranchMispredict = 5,
+    IdleCycle        = 6,   // cycles in which no instruction retired
+    FusedPair        = 7,   // instruction pairs the front end fused into one operation
+    Count,
+};
+
+// Running totals of the events of one hart. The caches and the core report into it; the CSR
+// file turns the totals into counter values when guest code reads them.
+class PerfEvents
+{
+public:
+    void Count(HpmEvent event, uint64_t n = 1)
+    {
+        _totals[size_t(event)] += n;
+    }
+
+    uint64_t Total(HpmEvent event) const
+    {
+        return event < HpmEvent::Count ? _totals[size_t(event)] : 0;
+    }
+
+private:
+    std::array<uint64_t, size_t(HpmEvent::Count)> _totals{};
+};
+
+#endif //RISCV_SIM_PERFEVENTS_H
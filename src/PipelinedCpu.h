@@ -0,0 +1,340 @@
+#ifndef RISCV_SIM_PIPELINEDCPU_H
+#define RISCV_SIM_PIPELINEDCPU_H
+
+#include "BranchPredictor.h"
+#include "Memory.h"
+#include "Decoder.h"
+#include "RegisterFile.h"
+#include "CsrFile.h"
+#include "Executor.h"
+#include "MulDivUnit.h"
+#include "VectorRegisterFile.h"
+#include "VectorUnit.h"
+#include "CustomUnit.h"
+
+enum class BranchStage
+{
+    Ex,
+    Mem,
+};
+
+struct PipelineConfig
+{
+    bool forwardExMem = true;   // ALU results to the next instruction
+    bool forwardMemWb = true;   // load and ALU results to the instruction after next
+    BranchStage branchStage = BranchStage::Ex;
+    size_t flushPenalty = 0;    // extra fetch bubbles after a redirect
+};
+
+// Classic IF/ID/EX/MEM/WB pipeline. Decoder, Executor and RegisterFile do the work of their
+// stages; this class moves instructions between the stage latches and detects hazards.
+// Fetch follows the branch predictor; a wrong guess costs the flushed stages plus flushPenalty.
+// Multiplies, divides, vector and custom instructions hold EX for the latency of their unit;
+// vector and custom instructions also access memory in EX. Stores complete in MEM, so FENCE
+// only has to be ordered against them, which the pipeline does by itself.
+class PipelinedCpu
+{
+public:
+    PipelinedCpu(CachedMem& mem, const PipelineConfig& config = PipelineConfig(),
+                 const PredictorConfig& predictor = PredictorConfig(), const MulDivConfig& mulDiv = MulDivConfig(),
+                 const VectorConfig& vector = VectorConfig(), const CustomExtensions* custom = nullptr)
+        : _mem(mem)
+        , _config(config)
+        , _decoder(custom)
+        , _predictor(predictor)
+        , _mulDiv(mulDiv)
+        , _vrf(vector.vlen)
+        , _vector(vector)
+        , _custom(custom)
+    {
+        _mem.SetPerfEvents(&_csrf.Events());
+    }
+
+    // Stages are evaluated back to front, so every stage sees its input latch as the previous cycle left it
+    void Clock()
+    {
+        _csrf.Clock();
+        ++_cycles;
+        _redirected = false;
+
+        // Values the instruction in EX may bypass from, as they are at the start of the cycle
+        _bypassMem = BypassFrom(_exMem, !_exMem || (_exMem->instr->_type != IType::Ld
+                                                     && _exMem->instr->_type != IType::Amo));
+        _bypassWb = BypassFrom(_memWb, true);
+
+        WriteBack();
+        MemoryAccess();
+        Execute();
+        Decode();
+        Fetch();
+    }
+
+    void Reset(Word ip)
+    {
+        _csrf.Reset();
+        _fetchIp = ip;
+        _ifId.reset();
+        _idEx.reset();
+        _exMem.reset();
+        _memWb.reset();
+        _exDoneCycle.reset();
+    }
+
+    void SetHartId(Word id)
+    {
+        _csrf.SetHartId(id);
+    }
+
+    std::optional<CpuToHostData> GetMessage()
+    {
+        return _csrf.GetMessage();
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Pipeline: cycles = " << _cycles << ", instructions = " << _retired << ", CPI = "
+            << (_retired == 0 ? 0.0 : double(_cycles) / double(_retired)) << std::endl;
+        out << "Pipeline stalls: data hazard = " << _dataStalls << ", memory = " << _memoryStalls
+            << ", fetch = " << _fetchStalls << ", multiply/divide = " << _mulDivStalls << ", vector = "
+            << _vectorStalls << ", custom = " << _customStalls << ", flushes = " << _flushes << ", fence.i refetches = "
+            << _fenceFlushes << std::endl;
+        _predictor.PrintStats(out, _retired);
+        _mulDiv.PrintStats(out);
+        _vector.PrintStats(out);
+        _custom.PrintStats(out);
+    }
+
+private:
+    struct Latch
+    {
+        InstructionPtr instr;
+        Word ip = 0;
+        Prediction prediction;
+    };
+
+    struct Fetched
+    {
+        Word code;
+        Word ip;
+        Prediction prediction;
+    };
+
+    struct Bypass
+    {
+        std::optional<RId> dst;
+        Word data = 0;
+        bool ready = false;
+    };
+
+    static Bypass BypassFrom(const std::optional<Latch>& latch, bool ready)
+    {
+        if (!latch)
+            return Bypass{};
+        return Bypass{latch->instr->_dst, latch->instr->_data, ready};
+    }
+
+    void WriteBack()
+    {
+        if (!_memWb)
+            return;
+
+        _rf.Write(_memWb->instr);
+        _csrf.Write(_memWb->instr);
+        _csrf.InstructionExecuted();
+        ++_retired;
+        _memWb.reset();
+    }
+
+    void MemoryAccess()
+    {
+        if (!_exMem)
+            return;
+
+        InstructionPtr& instr = _exMem->instr;
+        if (instr->_type == IType::Ld || instr->_type == IType::St || instr->_type == IType::Amo) {
+            if (!_memoryIssued) {
+                _mem.Request(instr);
+                _memoryIssued = true;
+            }
+            if (_mem.getDataWaitCycles() != 0 || !_mem.Response(instr, _csrf.getCycleNumber())) {
+                ++_memoryStalls;
+                return;
+            }
+            _memoryIssued = false;
+        }
+
+        if (_config.branchStage == BranchStage::Mem)
+            Resolve(*_exMem);
+
+        _memWb = std::move(_exMem);
+        _exMem.reset();
+    }
+
+    void Execute()
+    {
+        if (!_idEx || _exMem)
+            return;
+
+        InstructionPtr& instr = _idEx->instr;
+        if (!_exDoneCycle) {
+            // A CSR access waits until everything older has retired, so that it sees their CSR
+            // writes and instret counts them
+            bool csrHazard = instr->_type == IType::Csr && _memWb;
+            if (csrHazard || !OperandsReady(instr->_src1) || !OperandsReady(instr->_src2)) {
+                ++_dataStalls;
+                return;
+            }
+            if (instr->_type == IType::Custom && !_custom.Free(_cycles)) {
+                _custom.BusyStall();
+                ++_customStalls;
+                return;
+            }
+
+            // The register file already holds what the instruction in WB wrote this cycle
+            _rf.Read(instr);
+            if (instr->_src1 && _bypassMem.dst == instr->_src1)
+                instr->_src1Val = _bypassMem.data;
+            if (instr->_src2 && _bypassMem.dst == instr->_src2)
+                instr->_src2Val = _bypassMem.data;
+            _csrf.Read(instr);
+            _exe.Execute(instr, _idEx->ip);
+            _exDoneCycle = _cycles + 1;
+            if (instr->_type == IType::MulDiv) {
+                _exDoneCycle = _mulDiv.Start(instr->_mulDivFunc, _cycles);
+            } else if (instr->_type == IType::Vector) {
+                // Everything older has left MEM, so memory is up to date
+                _vrf.Execute(*instr, _mem);
+                _exDoneCycle = _vector.Start(*instr, _cycles);
+            } else if (instr->_type == IType::Custom) {
+                CustomUnit::Execute(*instr, _mem);
+                _exDoneCycle = _custom.Start(*instr, _cycles);
+            }
+        }
+        if (*_exDoneCycle > _cycles + 1) {
+            if (instr->_type == IType::Custom)
+                ++_customStalls;
+            else
+                ++(instr->_type == IType::Vector ? _vectorStalls : _mulDivStalls);
+            return;
+        }
+        _exDoneCycle.reset();
+
+        if (_config.branchStage == BranchStage::Ex)
+            Resolve(*_idEx);
+        if (IsFenceI(*instr))
+            Refetch(*_idEx);
+
+        _exMem = std::move(_idEx);
+        _idEx.reset();
+    }
+
+    bool OperandsReady(const std::optional<RId>& src) const
+    {
+        if (!src || *src == 0)
+            return true;
+        if (_bypassMem.dst == src)
+            return _config.forwardExMem && _bypassMem.ready;
+        if (_bypassWb.dst == src)
+            return _config.forwardMemWb;
+        return true;
+    }
+
+    void Decode()
+    {
+        if (_redirected || !_ifId || _idEx)
+            return;
+
+        _idEx = Latch{_decoder.Decode(_ifId->code), _ifId->ip, _ifId->prediction};
+        _ifId.reset();
+    }
+
+    void Fetch()
+    {
+        if (_fetchBubbles > 0 && !_redirected) {
+            --_fetchBubbles;
+        } else if (!_redirected && !_ifId) {
+            _mem.Request(_fetchIp);
+            std::optional<Word> code = _mem.Response(_csrf.getCycleNumber());
+            if (code) {
+                Prediction prediction = _predictor.Predict(_fetchIp, InstructionLength(*code));
+                _ifId = Fetched{*code, _fetchIp, prediction};
+                _fetchIp = prediction.nextIp;
+            } else {
+                ++_fetchStalls;
+            }
+        }
+
+        // Start the next access right away, so that cache hits stream at one instruction per cycle
+        if (_fetchBubbles == 0)
+            _mem.Request(_fetchIp);
+    }
+
+    // Squashes everything younger than a mispredicted instruction and restarts fetch at its real successor
+    void Resolve(const Latch& latch)
+    {
+        _predictor.Recover(latch.ip, *latch.instr, latch.prediction);
+        _predictor.Update(latch.ip, *latch.instr, latch.prediction);
+        if (latch.instr->_nextIp == latch.prediction.nextIp)
+            return;
+
+        ++_flushes;
+        _csrf.CountEvent(HpmEvent::BranchMispredict);
+        _ifId.reset();
+        if (_config.branchStage == BranchStage::Mem) {
+            _idEx.reset();
+            _exDoneCycle.reset();
+        }
+        _fetchIp = latch.instr->_nextIp;
+        _fetchBubbles = _config.flushPenalty;
+        _redirected = true;
+    }
+
+    // FENCE.I in EX: everything older has left MEM, so its stores are in the data cache. The
+    // code cache is flushed, and the instruction fetched after the fence is dropped and fetched again.
+    void Refetch(const Latch& latch)
+    {
+        _mem.FlushCode();
+        ++_fenceFlushes;
+        _ifId.reset();
+        _fetchIp = latch.instr->_nextIp;
+        _fetchBubbles = _config.flushPenalty;
+        _redirected = true;
+    }
+
+    CachedMem& _mem;
+    PipelineConfig _config;
+    Decoder _decoder;
+    RegisterFile _rf;
+    CsrFile _csrf;
+    Executor _exe;
+    BranchPredictor _predictor;
+    MulDivUnit _mulDiv;
+    VectorRegisterFile _vrf;
+    VectorUnit _vector;
+    CustomUnit _custom;
+
+    Word _fetchIp = 0;
+    std::optional<Fetched> _ifId;
+    std::optional<Latch> _idEx;
+    std::optional<Latch> _exMem;
+    std::optional<Latch> _memWb;
+    std::optional<uint64_t> _exDoneCycle;   // the instruction in EX has executed and leaves it then
+    Bypass _bypassMem;
+    Bypass _bypassWb;
+    bool _memoryIssued = false;
+    bool _redirected = false;
+    size_t _fetchBubbles = 0;
+
+    uint64_t _cycles = 0;
+    uint64_t _retired = 0;
+    uint64_t _dataStalls = 0;
+    uint64_t _memoryStalls = 0;
+    uint64_t _fetchStalls = 0;
+    uint64_t _mulDivStalls = 0;
+    uint64_t _vectorStalls = 0;
+    uint64_t _customStalls = 0;
+    uint64_t _flushes = 0;
+    uint64_t _fenceFlushes = 0;     // refetches after a FENCE.I, apart from mispredict flushes
+};
+
+#endif //RISCV_SIM_PIPELINEDCPU_H
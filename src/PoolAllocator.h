@@ -116,7 +116,8 @@ public:
         return allocator.deallocate(ptr, size);
     }
 private:
-    static PoolAllocator<T> allocator;
+    // One pool per host thread, so harts simulated on their own threads never share one
+    static thread_local PoolAllocator<T> allocator;
 };
 
 #endif //RISCV_SIM_POOLALLOCATOR_H
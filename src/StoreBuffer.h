@@ -0,0 +1,109 @@
+#ifndef RISCV_SIM_STOREBUFFER_H
+#define RISCV_SIM_STOREBUFFER_H
+
+#include <deque>
+#include <optional>
+#include <ostream>
+
+#include "Instruction.h"
+
+// FIFO of retired stores waiting to be written to the data cache. Younger loads to a
+// buffered address take their data from here instead of going to the cache.
+class StoreBuffer
+{
+public:
+    struct Entry
+    {
+        Word addr;
+        Word data;
+        MemFunc func;
+    };
+
+    explicit StoreBuffer(size_t capacity)
+        : _capacity(capacity)
+    {
+
+    }
+
+    bool Enabled() const
+    {
+        return _capacity != 0;
+    }
+
+    bool Empty() const
+    {
+        return _entries.empty();
+    }
+
+    bool Full() const
+    {
+        return _entries.size() >= _capacity;
+    }
+
+    void Push(Word addr, Word data, MemFunc func)
+    {
+        ++_stores;
+        _entries.push_back(Entry{addr, data, func});
+    }
+
+    // Value of a load whose bytes all come from buffered stores, the youngest one for each byte.
+    // A load that only some of its bytes can be forwarded to gets nothing; see Overlaps.
+    std::optional<Word> Forward(Word addr, MemFunc func)
+    {
+        Word needed = ByteMask(func, addr);
+        Word covered = 0;
+        Word word = 0;
+        for (auto it = _entries.rbegin(); it != _entries.rend(); ++it) {
+            if (WordAddr(it->addr) != WordAddr(addr))
+                continue;
+            Word bits = ByteBits(ByteMask(it->func, it->addr) & needed & ~covered);
+            word = (word & ~bits) | (StoreValue(it->func, 0, it->addr, it->data) & bits);
+            covered |= ByteMask(it->func, it->addr) & needed;
+            if (covered == needed) {
+                ++_forwards;
+                return LoadValue(func, word, addr);
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Whether a buffered store writes any byte the load reads. A load that overlaps stores it
+    // cannot be forwarded from has to wait until they are drained.
+    bool Overlaps(Word addr, MemFunc func) const
+    {
+        for (const Entry& entry : _entries)
+            if (WordAddr(entry.addr) == WordAddr(addr) && (ByteMask(entry.func, entry.addr) & ByteMask(func, addr)) != 0)
+                return true;
+        return false;
+    }
+
+    const Entry& Front() const
+    {
+        return _entries.front();
+    }
+
+    void Pop()
+    {
+        _entries.pop_front();
+    }
+
+    void FullStall()
+    {
+        ++_fullStalls;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Store buffer (" << _capacity << " entries): stores = " << _stores << ", forwards = " << _forwards
+            << ", full stall cycles = " << _fullStalls << std::endl;
+    }
+
+private:
+    size_t _capacity;
+    std::deque<Entry> _entries;
+    uint64_t _stores = 0;
+    uint64_t _forwards = 0;
+    uint64_t _fullStalls = 0;
+};
+
+#endif //RISCV_SIM_STOREBUFFER_H
@@ -0,0 +1,340 @@
+#ifndef RISCV_SIM_SUPERSCALARCPU_H
+#define RISCV_SIM_SUPERSCALARCPU_H
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include "FetchUnit.h"
+#include "MulDivUnit.h"
+#include "VectorUnit.h"
+#include "CustomUnit.h"
+#include "StoreBuffer.h"
+
+// Issue slot an instruction competes for
+enum class IssueClass : uint8_t
+{
+    Alu,
+    Memory,
+    Branch,
+    System,
+};
+
+inline IssueClass ToIssueClass(IType type)
+{
+    switch (type)
+    {
+        case IType::Ld:
+        case IType::St:
+        case IType::Amo: return IssueClass::Memory;
+        case IType::J:
+        case IType::Jr:
+        case IType::Br: return IssueClass::Branch;
+        case IType::Csr:
+        case IType::Fence:
+        case IType::Unsupported: return IssueClass::System;
+        default: return IssueClass::Alu;
+    }
+}
+
+struct SuperscalarConfig
+{
+    size_t fetchWidth = 2;
+    size_t issueWidth = 2;
+    size_t fetchQueueEntries = 8;
+    size_t decodeLatency = 1;
+    bool alignFetch = true;
+    bool fusion = false;
+    // Pairing rules: how many instructions of each IssueClass may issue in one cycle
+    std::array<size_t, 4> perCycle = {2, 1, 1, 1};
+
+    bool IsValid() const
+    {
+        return fetchWidth != 0 && issueWidth != 0 && fetchQueueEntries != 0
+               && std::all_of(perCycle.begin(), perCycle.end(), [](size_t n) { return n != 0; });
+    }
+};
+
+// N-wide in-order core. The FetchUnit runs instructions functionally as it fetches them; issue
+// takes them in program order, up to the issue width, and stops at the first one held back by a
+// data hazard, a used-up issue slot for its class, or the busy data port. Results are tracked
+// with a scoreboard, so independent instructions keep issuing under an outstanding load.
+class SuperscalarCpu
+{
+public:
+    SuperscalarCpu(CachedMem& mem, const SuperscalarConfig& config = SuperscalarConfig(),
+                   const PredictorConfig& predictor = PredictorConfig(), size_t storeBufferEntries = 0,
+                   const MulDivConfig& mulDiv = MulDivConfig(), const VectorConfig& vector = VectorConfig(),
+                   const CustomExtensions* custom = nullptr)
+        : _mem(mem)
+        , _config(config)
+        , _predictor(predictor)
+        , _fetch(mem, _csrf, _predictor,
+                 FetchConfig{config.fetchWidth, config.fetchQueueEntries, config.decodeLatency, config.alignFetch,
+                             config.fusion},
+                 vector.vlen, custom)
+        , _storeBuffer(storeBufferEntries)
+        , _mulDiv(mulDiv)
+        , _vector(vector)
+        , _custom(custom)
+    {
+        _mem.SetPerfEvents(&_csrf.Events());
+    }
+
+    void Clock()
+    {
+        _csrf.Clock();
+        ++_cycles;
+
+        DataPort();
+        Issue();
+        DrainStoreBuffer();
+        _fetch.Clock(_cycles, Idle());
+    }
+
+    void Reset(Word ip)
+    {
+        _csrf.Reset();
+        _fetch.Reset(ip);
+        _readyCycle.fill(0);
+        _port = PortUser::None;
+    }
+
+    void SetHartId(Word id)
+    {
+        _csrf.SetHartId(id);
+    }
+
+    std::optional<CpuToHostData> GetMessage()
+    {
+        return _csrf.GetMessage();
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        out << "Superscalar core (" << _config.issueWidth << "-wide): cycles = " << _cycles << ", instructions = "
+            << _retired << ", IPC = " << (_cycles == 0 ? 0.0 : double(_retired) / double(_cycles)) << std::endl;
+        out << "Issue: cycles issuing";
+        for (size_t n = 0; n < _issueHistogram.size(); ++n)
+            out << " " << n << " = " << _issueHistogram[n];
+        out << std::endl;
+        out << "Issue stalls: data hazard = " << _dataStalls << ", pairing = " << _pairingStalls
+            << ", data port = " << _portStalls << std::endl;
+        _fetch.PrintStats(out);
+        _predictor.PrintStats(out, _retired);
+        _mulDiv.PrintStats(out);
+        _vector.PrintStats(out);
+        _custom.PrintStats(out);
+        if (_storeBuffer.Enabled())
+            _storeBuffer.PrintStats(out);
+    }
+
+private:
+    static constexpr uint64_t notReady = std::numeric_limits<uint64_t>::max();
+
+    enum class PortUser
+    {
+        None,
+        Load,
+        Store,
+        Drain,
+    };
+
+    bool Ready(const std::optional<RId>& reg) const
+    {
+        return !reg || _readyCycle[*reg] <= _cycles;
+    }
+
+    // Nothing older is still executing or writing memory
+    bool Idle() const
+    {
+        return _port == PortUser::None
+               && std::all_of(_readyCycle.begin(), _readyCycle.end(), [this](uint64_t c) { return c <= _cycles; });
+    }
+
+    void Issue()
+    {
+        std::array<size_t, 4> used = {};
+        size_t issued = 0;
+        while (issued < _config.issueWidth && _fetch.Ready(_cycles)) {
+            FetchUnit::Fetched& f = _fetch.Front();
+            InstructionPtr& instr = f.instr;
+            size_t slot = size_t(ToIssueClass(instr->_type));
+
+            if (used[slot] >= _config.perCycle[slot]) {
+                ++_pairingStalls;
+                break;
+            }
+            // Register x0 is never a destination, so its entry always stays ready
+            if (!Ready(instr->_src1) || !Ready(instr->_src2) || !Ready(instr->_dst)) {
+                ++_dataStalls;
+                break;
+            }
+            if (instr->_type == IType::MulDiv && !_mulDiv.Free(instr->_mulDivFunc, _cycles)) {
+                _mulDiv.BusyStall();
+                break;
+            }
+            if (instr->_type == IType::Vector && !_vector.Free(_cycles)) {
+                _vector.BusyStall();
+                break;
+            }
+            if (instr->_type == IType::Custom && !_custom.Free(_cycles)) {
+                _custom.BusyStall();
+                break;
+            }
+            if (IsMemory(instr) && !IssueMemory(instr)) {
+                ++_portStalls;
+                break;
+            }
+            // A fence issues once every older access has finished and every buffered store has
+            // reached the cache
+            if (instr->_type == IType::Fence && (!_storeBuffer.Empty() || _port != PortUser::None)) {
+                ++_portStalls;
+                break;
+            }
+
+            if (instr->_type == IType::MulDiv) {
+                uint64_t ready = _mulDiv.Start(instr->_mulDivFunc, _cycles);
+                if (instr->_dst)
+                    _readyCycle[*instr->_dst] = ready;
+            } else if (instr->_type == IType::Vector) {
+                uint64_t ready = _vector.Start(*instr, _cycles);
+                if (instr->_dst)
+                    _readyCycle[*instr->_dst] = ready;
+            } else if (instr->_type == IType::Custom) {
+                uint64_t ready = _custom.Start(*instr, _cycles);
+                if (instr->_dst)
+                    _readyCycle[*instr->_dst] = ready;
+            } else if (instr->_type != IType::Ld && instr->_type != IType::Amo && instr->_dst) {
+                _readyCycle[*instr->_dst] = _cycles + 1;
+            }
+            if (f.mispredicted) {
+                _predictor.Recover(f.ip, *instr, f.prediction);
+                _fetch.Resume(_cycles + 1);
+            }
+            if (IsFenceI(*instr)) {
+                _mem.FlushCode();
+                _fetch.Resume(_cycles + 1);
+            }
+            _predictor.Update(f.ip, *instr, f.prediction);
+            _csrf.InstructionExecuted(RetiredCount(*instr));
+            _retired += RetiredCount(*instr);
+
+            // A load or store that went to the data port stays with it until the access completes
+            if (_port != PortUser::None && !_portInstruction)
+                _portInstruction = std::move(instr);
+            _fetch.Pop();
+            ++used[slot];
+            ++issued;
+        }
+        ++_issueHistogram[std::min(issued, _issueHistogram.size() - 1)];
+    }
+
+    static bool IsMemory(const InstructionPtr& instr)
+    {
+        return instr->_type == IType::Ld || instr->_type == IType::St || instr->_type == IType::Amo;
+    }
+
+    bool PortFree() const
+    {
+        return _port == PortUser::None && _mem.getDataWaitCycles() == 0;
+    }
+
+    bool IssueMemory(InstructionPtr& instr)
+    {
+        // Atomics wait until every older store has reached the cache
+        if (instr->_type == IType::Amo) {
+            if (!_storeBuffer.Empty() || !PortFree())
+                return false;
+            _mem.Request(instr);
+            _port = PortUser::Load;
+            if (instr->_dst)
+                _readyCycle[*instr->_dst] = notReady;
+            return true;
+        }
+        if (instr->_type == IType::St) {
+            if (_storeBuffer.Enabled()) {
+                if (_storeBuffer.Full()) {
+                    _storeBuffer.FullStall();
+                    return false;
+                }
+                _storeBuffer.Push(instr->_addr, instr->_data, instr->_memFunc);
+                return true;
+            }
+            if (!PortFree())
+                return false;
+            _mem.Request(instr);
+            _port = PortUser::Store;
+            return true;
+        }
+
+        if (_storeBuffer.Forward(instr->_addr, instr->_memFunc)) {
+            if (instr->_dst)
+                _readyCycle[*instr->_dst] = _cycles + 1;
+            return true;
+        }
+        // Bytes of buffered stores can't be merged with the cached word; they drain first
+        if (!PortFree() || _storeBuffer.Overlaps(instr->_addr, instr->_memFunc))
+            return false;
+        _mem.Request(instr);
+        _port = PortUser::Load;
+        if (instr->_dst)
+            _readyCycle[*instr->_dst] = notReady;
+        return true;
+    }
+
+    // Finishes the access in flight on the single data port
+    void DataPort()
+    {
+        if (_port == PortUser::None)
+            return;
+
+        // Memory already holds the functional result
+        InstructionPtr& instr = _portInstruction;
+        if (_mem.getDataWaitCycles() != 0 || !_mem.Replay(instr, _csrf.getCycleNumber()))
+            return;
+
+        if (_port == PortUser::Load && instr->_dst)
+            _readyCycle[*instr->_dst] = _cycles;
+        else if (_port == PortUser::Drain)
+            _storeBuffer.Pop();
+        _port = PortUser::None;
+        _portInstruction.reset();
+    }
+
+    void DrainStoreBuffer()
+    {
+        if (!PortFree() || _storeBuffer.Empty())
+            return;
+
+        _portInstruction = std::make_unique<Instruction>();
+        _portInstruction->_type = IType::St;
+        _portInstruction->_addr = _storeBuffer.Front().addr;
+        _portInstruction->_memFunc = _storeBuffer.Front().func;
+        _mem.Request(_portInstruction);
+        _port = PortUser::Drain;
+    }
+
+    CachedMem& _mem;
+    SuperscalarConfig _config;
+    CsrFile _csrf;
+    BranchPredictor _predictor;
+    FetchUnit _fetch;
+    StoreBuffer _storeBuffer;
+    MulDivUnit _mulDiv;
+    VectorUnit _vector;
+    CustomUnit _custom;
+
+    std::array<uint64_t, 32> _readyCycle{};
+    PortUser _port = PortUser::None;
+    InstructionPtr _portInstruction;
+
+    uint64_t _cycles = 0;
+    uint64_t _retired = 0;
+    uint64_t _dataStalls = 0;
+    uint64_t _pairingStalls = 0;
+    uint64_t _portStalls = 0;
+    std::array<uint64_t, 5> _issueHistogram{};
+};
+
+#endif //RISCV_SIM_SUPERSCALARCPU_H
@@ -0,0 +1,160 @@
+#ifndef RISCV_SIM_TRACE_H
+#define RISCV_SIM_TRACE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BaseTypes.h"
+
+enum class AccessType : uint8_t
+{
+    Fetch = 0,
+    Load  = 1,
+    Store = 2,
+};
+
+// On-disk record of a single memory access. The layout is fixed (8 bytes, no padding
+// surprises) so a trace file can be mapped and used as an array directly. Addresses take
+// 32 bits on RV64 too; simulated memory is far smaller than 4 GiB.
+struct TraceRecord
+{
+    uint32_t addr;
+    AccessType type;
+    uint8_t reserved[3];
+};
+static_assert(sizeof(TraceRecord) == 8, "TraceRecord must stay 8 bytes");
+
+// Appends access records to a file, buffering them to keep the simulator hot loop cheap.
+class TraceWriter
+{
+public:
+    explicit TraceWriter(const std::string& fileName)
+        : _fileName(fileName)
+    {
+        _file = std::fopen(fileName.c_str(), "wb");
+        if (_file == nullptr)
+            std::cerr << "ERROR: trace: failed opening file \"" << fileName << "\"" << std::endl;
+        _buffer.reserve(bufferRecords);
+    }
+
+    ~TraceWriter()
+    {
+        Flush();
+        if (_file != nullptr)
+            std::fclose(_file);
+    }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool IsOpen() const
+    {
+        return _file != nullptr;
+    }
+
+    void Record(Word addr, AccessType type)
+    {
+        _buffer.push_back(TraceRecord{uint32_t(addr), type, {0, 0, 0}});
+        if (_buffer.size() == bufferRecords)
+            Flush();
+    }
+
+    // A failed write is reported once and ends the trace; the simulation itself goes on
+    void Flush()
+    {
+        if (_file != nullptr && !_buffer.empty() &&
+            std::fwrite(_buffer.data(), sizeof(TraceRecord), _buffer.size(), _file) != _buffer.size()) {
+            std::cerr << "ERROR: trace: failed writing file \"" << _fileName << "\"" << std::endl;
+            std::fclose(_file);
+            _file = nullptr;
+        }
+        _buffer.clear();
+    }
+
+private:
+    static constexpr size_t bufferRecords = 64 * 1024;
+
+    std::string _fileName;
+    std::FILE* _file = nullptr;
+    std::vector<TraceRecord> _buffer;
+};
+
+// Read-only view of a trace file. The file is mapped once and shared between all readers,
+// so any number of worker threads can walk it without copying.
+class TraceReader
+{
+public:
+    explicit TraceReader(const std::string& fileName)
+    {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "ERROR: trace: failed opening file \"" << fileName << "\"" << std::endl;
+            return;
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size % sizeof(TraceRecord) != 0) {
+            std::cerr << "ERROR: trace: \"" << fileName << "\" is not a valid trace file" << std::endl;
+            close(fd);
+            return;
+        }
+
+        _size = st.st_size / sizeof(TraceRecord);
+        if (_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                std::cerr << "ERROR: trace: failed mapping \"" << fileName << "\"" << std::endl;
+                _size = 0;
+                close(fd);
+                return;
+            }
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+            _records = static_cast<const TraceRecord*>(mapped);
+        }
+        _valid = true;
+        close(fd);
+    }
+
+    ~TraceReader()
+    {
+        if (_records != nullptr)
+            munmap(const_cast<TraceRecord*>(_records), _size * sizeof(TraceRecord));
+    }
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    bool IsValid() const
+    {
+        return _valid;
+    }
+
+    const TraceRecord* begin() const
+    {
+        return _records;
+    }
+
+    const TraceRecord* end() const
+    {
+        return _records + _size;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    const TraceRecord* _records = nullptr;
+    size_t _size = 0;
+    bool _valid = false;
+};
+
+#endif //RISCV_SIM_TRACE_H
@@ -0,0 +1,203 @@
+#ifndef RISCV_SIM_VECTORALU_H
+#define RISCV_SIM_VECTORALU_H
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Instruction.h"
+
+// Element loops of the vector instructions over register bytes, for 8, 16 and 32-bit elements.
+// On x86 hosts the common operations run 16 bytes at a time on SSE2; the remaining elements and
+// the other operations take the scalar loop.
+class VectorAlu
+{
+public:
+    // vd[i] = vs2[i] op vs1[i], or vs2[i] op scalar when vs1 is null, for i below n
+    static void Elementwise(VecFunc func, Word sew, uint8_t* vd, const uint8_t* vs2, const uint8_t* vs1,
+                            Word scalar, Word n)
+    {
+        switch (sew)
+        {
+            case 8: Elementwise<uint8_t>(func, vd, vs2, vs1, uint8_t(scalar), n); break;
+            case 16: Elementwise<uint16_t>(func, vd, vs2, vs1, uint16_t(scalar), n); break;
+            default: Elementwise<uint32_t>(func, vd, vs2, vs1, scalar, n); break;
+        }
+    }
+
+    // Folds the first n elements of vs2 into init
+    static Word Reduce(VecFunc func, Word sew, Word init, const uint8_t* vs2, Word n)
+    {
+        switch (sew)
+        {
+            case 8: return Reduce<uint8_t>(func, uint8_t(init), vs2, n);
+            case 16: return Reduce<uint16_t>(func, uint16_t(init), vs2, n);
+            default: return Reduce<uint32_t>(func, init, vs2, n);
+        }
+    }
+
+    static bool IsReduction(VecFunc func)
+    {
+        return func >= VecFunc::RedSum && func <= VecFunc::RedMax;
+    }
+
+    template <typename T>
+    static T Get(const uint8_t* reg, size_t i)
+    {
+        T value;
+        std::memcpy(&value, reg + i * sizeof(T), sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    static void Set(uint8_t* reg, size_t i, T value)
+    {
+        std::memcpy(reg + i * sizeof(T), &value, sizeof(T));
+    }
+
+private:
+    template <typename T>
+    static void Elementwise(VecFunc func, uint8_t* vd, const uint8_t* vs2, const uint8_t* vs1, T scalar, size_t n)
+    {
+        size_t i = 0;
+#if defined(__SSE2__)
+        i = Simd<T>(func, vd, vs2, vs1, scalar, n);
+#endif
+        for (; i < n; ++i)
+            Set<T>(vd, i, Apply<T>(func, Get<T>(vs2, i), vs1 ? Get<T>(vs1, i) : scalar, Get<T>(vd, i)));
+    }
+
+    template <typename T>
+    static T Reduce(VecFunc func, T acc, const uint8_t* vs2, size_t n)
+    {
+        VecFunc step = ReductionStep(func);
+        for (size_t i = 0; i < n; ++i)
+            acc = Apply<T>(step, acc, Get<T>(vs2, i), 0);
+        return acc;
+    }
+
+    static VecFunc ReductionStep(VecFunc func)
+    {
+        switch (func)
+        {
+            case VecFunc::RedAnd: return VecFunc::And;
+            case VecFunc::RedOr: return VecFunc::Or;
+            case VecFunc::RedXor: return VecFunc::Xor;
+            case VecFunc::RedMinu: return VecFunc::Minu;
+            case VecFunc::RedMin: return VecFunc::Min;
+            case VecFunc::RedMaxu: return VecFunc::Maxu;
+            case VecFunc::RedMax: return VecFunc::Max;
+            default: return VecFunc::Add;
+        }
+    }
+
+    // a is the vs2 element, b the vs1, rs1 or immediate operand, d the old vd element
+    template <typename T>
+    static T Apply(VecFunc func, T a, T b, T d)
+    {
+        using S = std::make_signed_t<T>;
+        constexpr unsigned bits = 8 * sizeof(T);
+        unsigned shamt = b & (bits - 1);
+        switch (func)
+        {
+            case VecFunc::Add: return T(a + b);
+            case VecFunc::Sub: return T(a - b);
+            case VecFunc::Rsub: return T(b - a);
+            case VecFunc::Minu: return std::min(a, b);
+            case VecFunc::Min: return S(a) < S(b) ? a : b;
+            case VecFunc::Maxu: return std::max(a, b);
+            case VecFunc::Max: return S(a) > S(b) ? a : b;
+            case VecFunc::And: return T(a & b);
+            case VecFunc::Or: return T(a | b);
+            case VecFunc::Xor: return T(a ^ b);
+            case VecFunc::Sll: return T(a << shamt);
+            case VecFunc::Srl: return T(a >> shamt);
+            case VecFunc::Sra: return T(S(a) >> shamt);
+            case VecFunc::Mv: return b;
+            case VecFunc::Mul: return T(uint64_t(a) * uint64_t(b));
+            case VecFunc::Mulh: return T(uint64_t(int64_t(S(a)) * int64_t(S(b))) >> bits);
+            case VecFunc::Mulhu: return T((uint64_t(a) * uint64_t(b)) >> bits);
+            case VecFunc::Macc: return T(uint64_t(a) * uint64_t(b) + d);
+            default: return d;
+        }
+    }
+
+#if defined(__SSE2__)
+    // Handles whole 16-byte blocks of the operations SSE2 has for the element width; returns
+    // how many elements it did
+    template <typename T>
+    static size_t Simd(VecFunc func, uint8_t* vd, const uint8_t* vs2, const uint8_t* vs1, T scalar, size_t n)
+    {
+        constexpr size_t perBlock = 16 / sizeof(T);
+        bool supported = func == VecFunc::Add || func == VecFunc::Sub || func == VecFunc::Rsub
+                         || func == VecFunc::And || func == VecFunc::Or || func == VecFunc::Xor
+                         || func == VecFunc::Mv || (func == VecFunc::Mul && sizeof(T) == 2);
+        if (!supported)
+            return 0;
+
+        __m128i broadcast = Broadcast(scalar);
+        size_t i = 0;
+        for (; i + perBlock <= n; i += perBlock) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vs2 + i * sizeof(T)));
+            __m128i b = vs1 ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(vs1 + i * sizeof(T))) : broadcast;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(vd + i * sizeof(T)), SimdApply<T>(func, a, b));
+        }
+        return i;
+    }
+
+    template <typename T>
+    static __m128i Broadcast(T value)
+    {
+        if constexpr (sizeof(T) == 1)
+            return _mm_set1_epi8(char(value));
+        else if constexpr (sizeof(T) == 2)
+            return _mm_set1_epi16(short(value));
+        else
+            return _mm_set1_epi32(int(value));
+    }
+
+    template <typename T>
+    static __m128i SimdAdd(__m128i a, __m128i b)
+    {
+        if constexpr (sizeof(T) == 1)
+            return _mm_add_epi8(a, b);
+        else if constexpr (sizeof(T) == 2)
+            return _mm_add_epi16(a, b);
+        else
+            return _mm_add_epi32(a, b);
+    }
+
+    template <typename T>
+    static __m128i SimdSub(__m128i a, __m128i b)
+    {
+        if constexpr (sizeof(T) == 1)
+            return _mm_sub_epi8(a, b);
+        else if constexpr (sizeof(T) == 2)
+            return _mm_sub_epi16(a, b);
+        else
+            return _mm_sub_epi32(a, b);
+    }
+
+    template <typename T>
+    static __m128i SimdApply(VecFunc func, __m128i a, __m128i b)
+    {
+        switch (func)
+        {
+            case VecFunc::Add: return SimdAdd<T>(a, b);
+            case VecFunc::Sub: return SimdSub<T>(a, b);
+            case VecFunc::Rsub: return SimdSub<T>(b, a);
+            case VecFunc::And: return _mm_and_si128(a, b);
+            case VecFunc::Or: return _mm_or_si128(a, b);
+            case VecFunc::Xor: return _mm_xor_si128(a, b);
+            case VecFunc::Mul: return _mm_mullo_epi16(a, b);
+            default: return b;
+        }
+    }
+#endif
+};
+
+#endif //RISCV_SIM_VECTORALU_H
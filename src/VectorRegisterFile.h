@@ -0,0 +1,189 @@
+#ifndef RISCV_SIM_VECTORREGISTERFILE_H
+#define RISCV_SIM_VECTORREGISTERFILE_H
+
+#include <vector>
+
+#include "Memory.h"
+#include "VectorAlu.h"
+
+// Vector registers, vl and vtype of one hart, and the functional side of the vector instructions.
+// The 32 registers are one byte array, so a register group of LMUL registers is contiguous.
+// Supported are SEW 8, 16 and 32 and LMUL 1, 2, 4 and 8; any other vtype sets vill, and the
+// other vector instructions then do nothing. Elements past vl are left undisturbed.
+class VectorRegisterFile
+{
+public:
+    explicit VectorRegisterFile(size_t vlen)
+        : _vlenb(Word(vlen / 8))
+        , _regs(32 * _vlenb)
+    {
+
+    }
+
+    // Runs the instruction; vector loads and stores go straight to memory, so any older store
+    // must already be visible there
+    void Execute(Instruction& instr, CachedMem& mem)
+    {
+        if (instr._vecFunc == VecFunc::SetVl) {
+            SetVl(instr);
+            return;
+        }
+
+        instr._vl = Vill() ? 0 : _vl;
+        instr._eew = instr._vecFunc == VecFunc::Load || instr._vecFunc == VecFunc::Store
+                     ? 8u << Word(instr._memFunc) : Sew();
+        if (instr._vl == 0 && instr._vecFunc != VecFunc::MvXS)
+            return;
+
+        switch (instr._vecFunc)
+        {
+            case VecFunc::Load:
+            case VecFunc::Store:
+                Access(instr, mem);
+                break;
+            case VecFunc::MvXS:
+            {
+                // Sign extended from SEW
+                Word shift = XLEN - Sew();
+                instr._data = Word(SignedWord(Element(instr._vs2, 0) << shift) >> shift);
+                break;
+            }
+            case VecFunc::MvSX:
+                SetElement(instr._vd, 0, instr._src1Val);
+                break;
+            default:
+                if (VectorAlu::IsReduction(instr._vecFunc))
+                    Reduce(instr);
+                else
+                    Elementwise(instr);
+                break;
+        }
+    }
+
+private:
+    static constexpr Word vill = Word(1) << (XLEN - 1);
+
+    Word Sew() const
+    {
+        return 8u << ((_vtype >> 3u) & 7u);
+    }
+
+    Word VlMax(Word vtype) const
+    {
+        Word lmul = vtype & 7u;
+        Word sew = (vtype >> 3u) & 7u;
+        if (lmul > 3 || sew > 2 || vtype >> 8u != 0)
+            return 0;
+        return (_vlenb * 8u << lmul) / (8u << sew);
+    }
+
+    bool Vill() const
+    {
+        return (_vtype & vill) != 0;
+    }
+
+    void SetVl(Instruction& instr)
+    {
+        Word vtype = instr._src2 ? instr._src2Val : instr._vtype;
+        // vta and vma only allow the tail and masked-off elements to change; they stay undisturbed
+        Word vlMax = VlMax(vtype & ~0xc0u);
+        if (vlMax == 0) {
+            _vtype = vill;
+            _vl = 0;
+        } else {
+            Word avl = _vl;
+            if (instr._vecOperand == VecOperand::Imm)
+                avl = Word(*instr._imm);
+            else if (*instr._src1 != 0)
+                avl = instr._src1Val;
+            else if (instr._dst)
+                avl = ~Word(0);
+            _vtype = vtype;
+            _vl = std::min(avl, vlMax);
+        }
+        instr._data = _vl;
+        instr._vl = _vl;
+        instr._eew = 32;
+    }
+
+    uint8_t* Reg(RId reg)
+    {
+        return &_regs[reg * _vlenb];
+    }
+
+    // A register group must not run past v31
+    bool Fits(RId reg, Word elements, Word bits) const
+    {
+        return reg * _vlenb + elements * (bits / 8) <= _regs.size();
+    }
+
+    Word Element(RId reg, Word i)
+    {
+        switch (Sew())
+        {
+            case 8: return VectorAlu::Get<uint8_t>(Reg(reg), i);
+            case 16: return VectorAlu::Get<uint16_t>(Reg(reg), i);
+            default: return VectorAlu::Get<uint32_t>(Reg(reg), i);
+        }
+    }
+
+    void SetElement(RId reg, Word i, Word value)
+    {
+        switch (Sew())
+        {
+            case 8: VectorAlu::Set<uint8_t>(Reg(reg), i, uint8_t(value)); break;
+            case 16: VectorAlu::Set<uint16_t>(Reg(reg), i, uint16_t(value)); break;
+            default: VectorAlu::Set<uint32_t>(Reg(reg), i, value); break;
+        }
+    }
+
+    // Elements must be naturally aligned, so none of them crosses a memory word
+    void Access(const Instruction& instr, CachedMem& mem)
+    {
+        Word bytes = instr._eew / 8;
+        if (!Fits(instr._vd, instr._vl, instr._eew))
+            return;
+        Word stride = instr._src2 ? instr._src2Val : bytes;
+        uint8_t* reg = Reg(instr._vd);
+        MemFunc func = instr._memFunc == MemFunc::W ? MemFunc::W : MemFunc(Word(instr._memFunc) | 4u);
+        for (Word i = 0; i < instr._vl; ++i) {
+            Word addr = instr._src1Val + i * stride;
+            Word word = mem.Peek(addr);
+            if (instr._vecFunc == VecFunc::Load) {
+                Word value = LoadValue(func, word, addr);
+                std::memcpy(reg + i * bytes, &value, bytes);
+            } else {
+                Word value = 0;
+                std::memcpy(&value, reg + i * bytes, bytes);
+                mem.Poke(addr, StoreValue(instr._memFunc, word, addr, value), ByteMask(instr._memFunc, addr));
+            }
+        }
+    }
+
+    void Elementwise(const Instruction& instr)
+    {
+        bool vector = instr._vecOperand == VecOperand::Vector;
+        Word sew = Sew();
+        if (!Fits(instr._vd, _vl, sew) || !Fits(instr._vs2, _vl, sew) || (vector && !Fits(instr._vs1, _vl, sew)))
+            return;
+        Word scalar = instr._vecOperand == VecOperand::Imm ? Word(*instr._imm) : instr._src1Val;
+        VectorAlu::Elementwise(instr._vecFunc, sew, Reg(instr._vd), Reg(instr._vs2),
+                               vector ? Reg(instr._vs1) : nullptr, scalar, _vl);
+    }
+
+    // vd[0] = vs1[0] folded with vs2[0..vl)
+    void Reduce(const Instruction& instr)
+    {
+        if (!Fits(instr._vs2, _vl, Sew()))
+            return;
+        Word result = VectorAlu::Reduce(instr._vecFunc, Sew(), Element(instr._vs1, 0), Reg(instr._vs2), _vl);
+        SetElement(instr._vd, 0, result);
+    }
+
+    Word _vlenb;
+    std::vector<uint8_t> _regs;
+    Word _vl = 0;
+    Word _vtype = vill;
+};
+
+#endif //RISCV_SIM_VECTORREGISTERFILE_H
@@ -0,0 +1,106 @@
+#ifndef RISCV_SIM_VECTORUNIT_H
+#define RISCV_SIM_VECTORUNIT_H
+
+#include <algorithm>
+#include <ostream>
+
+#include "Instruction.h"
+
+struct VectorConfig
+{
+    size_t vlen = 128;          // bits in a vector register
+    size_t lanes = 4;           // 32-bit lanes; a lane takes four 8-bit or two 16-bit elements a cycle
+    size_t memBytes = 16;       // bytes the vector memory port moves a cycle on unit-stride accesses
+    size_t memLatency = 4;      // cycles before the first element of a vector load or store
+
+    bool IsValid() const
+    {
+        return vlen >= 32 && vlen <= 65536 && (vlen & (vlen - 1)) == 0 && lanes != 0 && memBytes != 0;
+    }
+};
+
+// Timing of the vector unit. It works on one instruction at a time, passing over the elements
+// lanes at a time, so a dependent vector instruction never starts before its source is complete.
+// Vector loads and stores stream through their own port to memory and do not go through L1D;
+// a strided access moves one element a cycle.
+class VectorUnit
+{
+public:
+    explicit VectorUnit(const VectorConfig& config)
+        : _config(config)
+    {
+
+    }
+
+    bool Free(uint64_t cycle) const
+    {
+        return _freeCycle <= cycle;
+    }
+
+    // Starts the instruction in the given cycle; returns the cycle its result is available
+    uint64_t Start(const Instruction& instr, uint64_t cycle)
+    {
+        uint64_t ready = cycle + Latency(instr);
+        _freeCycle = ready;
+        ++_instructions;
+        _elements += instr._vl;
+        return ready;
+    }
+
+    // An instruction waited a cycle for the unit
+    void BusyStall()
+    {
+        ++_busyStalls;
+    }
+
+    void PrintStats(std::ostream& out) const
+    {
+        if (_instructions == 0)
+            return;
+        out << "Vector: instructions = " << _instructions << ", elements = " << _elements
+            << ", unit busy stalls = " << _busyStalls << std::endl;
+    }
+
+private:
+    size_t Latency(const Instruction& instr) const
+    {
+        size_t perCycle = _config.lanes * 32 / instr._eew;
+        size_t passes = (instr._vl + perCycle - 1) / perCycle;
+        switch (instr._vecFunc)
+        {
+            case VecFunc::SetVl:
+            case VecFunc::MvXS:
+            case VecFunc::MvSX: return 1;
+            case VecFunc::Load:
+            case VecFunc::Store:
+            {
+                size_t bytes = instr._vl * instr._eew / 8;
+                size_t transfer = instr._src2 ? instr._vl : (bytes + _config.memBytes - 1) / _config.memBytes;
+                return _config.memLatency + transfer;
+            }
+            case VecFunc::Mul:
+            case VecFunc::Mulh:
+            case VecFunc::Mulhu:
+            case VecFunc::Macc: return passes + multiplyStages;
+            default: break;
+        }
+        if (instr._vecFunc >= VecFunc::RedSum && instr._vecFunc <= VecFunc::RedMax) {
+            // The lanes' partial results are combined in a tree
+            size_t steps = 0;
+            while ((size_t(1) << steps) < perCycle)
+                ++steps;
+            return passes + steps + 1;
+        }
+        return std::max<size_t>(passes, 1);
+    }
+
+    static constexpr size_t multiplyStages = 2;
+
+    VectorConfig _config;
+    uint64_t _freeCycle = 0;
+    uint64_t _instructions = 0;
+    uint64_t _elements = 0;
+    uint64_t _busyStalls = 0;
+};
+
+#endif //RISCV_SIM_VECTORUNIT_H
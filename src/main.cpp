@@ -1,49 +1,257 @@
+#include "Accelerators.h"
 #include "Cpu.h"
+#include "OooCpu.h"
+#include "PipelinedCpu.h"
+#include "SuperscalarCpu.h"
 #include "Memory.h"
 #include "BaseTypes.h"
+#include "Barrier.h"
+#include "CacheSweep.h"
+#include "Options.h"
+#include "Trace.h"
 
+#include <atomic>
+#include <fstream>
 #include <optional>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 // First task. Instruction per tact: 0.007611794. Info stored in info.odt file.
 
-int main()
+int RunSweep(const SimOptions& options)
 {
-    MemoryStorage mem ;
-    mem.LoadElf("program");
-    UncachedMem uncachedMem = UncachedMem (mem);
-    std::unique_ptr<CachedMem> memModelPtr( new CachedMem(uncachedMem));
-    Cpu cpu{*memModelPtr};
-    cpu.Reset(0x200);
+    TraceReader trace(options.sweepTrace);
+    if (!trace.IsValid())
+        return 1;
 
-    int32_t print_int = 0;
-    while (true)
-    {
-        cpu.Clock();
-        memModelPtr->Clock();
-        std::optional<CpuToHostData> msg = cpu.GetMessage();
+    std::vector<CacheConfig> configs = CacheSweep::Grid(options.sweepSizes, options.sweepWays,
+                                                        options.sweepLines, options.sweepPolicies,
+                                                        options.sweepVictims);
+    if (configs.empty()) {
+        std::cerr << "ERROR: sweep: no valid cache configuration to evaluate" << std::endl;
+        return 1;
+    }
+    CacheSweep sweep(trace, configs);
+    sweep.SetFilter(options.sweepFilter);
+    if (options.sweepThreads != 0)
+        sweep.SetThreads(options.sweepThreads);
+
+    std::vector<SweepResult> results = sweep.Run();
+
+    std::ofstream file;
+    if (!options.sweepOut.empty()) {
+        file.open(options.sweepOut);
+        if (!file.is_open()) {
+            std::cerr << "ERROR: sweep: failed opening file \"" << options.sweepOut << "\"" << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = options.sweepOut.empty() ? std::cout : file;
+
+    if (options.sweepJson)
+        CacheSweep::WriteJson(out, results);
+    else
+        CacheSweep::WriteCsv(out, results);
+    return 0;
+}
+
+// Every hart runs the same program from 0x200 on its own core and private L1 caches, kept
+// coherent over the shared memory. The run ends once every hart has sent its exit code.
+//
+// Without a quantum the harts are clocked in turn, one cycle each, on this thread. With one,
+// every hart runs on its own thread for a quantum of cycles at a time. Its stores and coherence
+// transactions are held back and made visible at the boundary, hart by hart in hart order, so a
+// parallel run gives the same result every time.
+template <typename Core, typename... Args>
+int Run(UncachedMem& uncachedMem, TraceWriter* trace, const SimOptions& options, const Args&... args)
+{
+    std::optional<CoherenceBus> bus;
+    if (options.coherence.protocol != CoherenceProtocol::None)
+        bus.emplace(options.coherence);
+
+    std::vector<std::unique_ptr<CachedMem>> memModels;
+    std::vector<std::unique_ptr<Core>> cpus;
+    for (size_t hart = 0; hart < options.harts; ++hart) {
+        memModels.push_back(std::make_unique<CachedMem>(uncachedMem, options.memory));
+        if (bus)
+            memModels.back()->AttachBus(&*bus);
+        cpus.push_back(std::make_unique<Core>(*memModels.back(), args...));
+        cpus.back()->SetHartId(Word(hart));
+        cpus.back()->Reset(0x200);
+    }
+    if (trace)
+        memModels.front()->SetTrace(trace);
+
+    bool parallel = options.quantum != 0;
+    // Per-hart state; a hart's thread only touches its own entries
+    std::vector<uint8_t> exited(options.harts, false);
+    std::vector<int> exitCodes(options.harts, 0);
+    std::vector<int32_t> print_int(options.harts, 0);
+    // Output is collected per hart and printed a line at a time, so harts printing together stay
+    // readable. Parallel harts keep finished lines until the quantum boundary.
+    std::vector<std::string> lines(options.harts);
+    std::vector<std::string> finished(options.harts);
+    auto flush = [&](size_t hart) {
+        if (options.harts > 1)
+            finished[hart] += "[hart " + std::to_string(hart) + "] ";
+        finished[hart] += lines[hart];
+        lines[hart].clear();
+        if (!parallel) {
+            std::cerr << finished[hart] << std::flush;
+            finished[hart].clear();
+        }
+    };
+
+    auto step = [&](size_t hart) {
+        cpus[hart]->Clock();
+        memModels[hart]->Clock();
+        std::optional<CpuToHostData> msg = cpus[hart]->GetMessage();
         if (!msg)
-            continue;
+            return;
 
         auto type = msg.value().unpacked.type;
         auto data = msg.value().unpacked.data;
 
         if(type == CpuToHostType::ExitCode) {
-            if(data == 0) {
-                fprintf(stderr, "PASSED\n");
-                return 0;
-            } else {
-                fprintf(stderr, "FAILED: exit code = %d\n", data);
-                return data;
-            }
-            break;
+            exited[hart] = true;
+            exitCodes[hart] = data;
+            if (!lines[hart].empty())
+                flush(hart);
         } else if(type == CpuToHostType::PrintChar) {
-            fprintf(stderr, "%c", (char)data);
+            lines[hart] += (char)data;
+            if ((char)data == '\n')
+                flush(hart);
         } else if(type == CpuToHostType::PrintIntLow) {
-            print_int = uint32_t(data);
+            print_int[hart] = uint32_t(data);
         } else if(type == CpuToHostType::PrintIntHigh) {
-            print_int |= uint32_t(data) << 16;
-            fprintf(stderr, "%d", print_int);
+            print_int[hart] |= uint32_t(data) << 16;
+            lines[hart] += std::to_string(print_int[hart]);
+        }
+    };
+
+    size_t running = options.harts;
+    int exitCode = 0;
+    std::vector<uint8_t> counted(options.harts, false);
+    auto countExits = [&]() {
+        for (size_t hart = 0; hart < options.harts; ++hart) {
+            if (!exited[hart] || counted[hart])
+                continue;
+            counted[hart] = true;
+            --running;
+            if (exitCode == 0)
+                exitCode = exitCodes[hart];
+        }
+    };
+
+    if (!parallel) {
+        while (running != 0) {
+            for (size_t hart = 0; hart < options.harts; ++hart) {
+                if (exited[hart])
+                    continue;
+                step(hart);
+                if (exited[hart])
+                    countExits();
+            }
+        }
+    } else {
+        if (bus)
+            bus->SetParallel(true);
+        for (auto& memModel : memModels)
+            memModel->DeferSharedAccesses();
+
+        // The harts and this thread meet at the start and at the end of every quantum
+        Barrier barrier(options.harts + 1);
+        std::atomic<bool> done{false};
+        std::vector<std::thread> workers;
+        for (size_t hart = 0; hart < options.harts; ++hart) {
+            workers.emplace_back([&, hart]() {
+                for (barrier.Wait(); !done; barrier.Wait()) {
+                    for (size_t cycle = 0; cycle < options.quantum && !exited[hart]; ++cycle)
+                        step(hart);
+                    barrier.Wait();
+                }
+            });
+        }
+
+        while (running != 0) {
+            barrier.Wait();
+            barrier.Wait();
+            for (auto& memModel : memModels)
+                memModel->PublishStores();
+            if (bus)
+                for (auto& memModel : memModels)
+                    memModel->ReplayCoherence();
+            for (size_t hart = 0; hart < options.harts; ++hart) {
+                std::cerr << finished[hart];
+                finished[hart].clear();
+            }
+            std::cerr << std::flush;
+            countExits();
         }
+        done = true;
+        barrier.Wait();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    if (options.stats) {
+        for (size_t hart = 0; hart < options.harts; ++hart) {
+            if (options.harts > 1)
+                std::cerr << "Hart " << hart << ":" << std::endl;
+            cpus[hart]->PrintStats(std::cerr);
+            memModels[hart]->PrintStats(std::cerr);
+        }
+        if (bus && options.harts > 1)
+            bus->PrintStats(std::cerr);
+    }
+    if(exitCode == 0) {
+        fprintf(stderr, "PASSED\n");
+        return 0;
+    }
+    fprintf(stderr, "FAILED: exit code = %d\n", exitCode);
+    return exitCode;
+}
+
+int main(int argc, char** argv)
+{
+    SimOptions options;
+    if (!ParseOptions(argc, argv, options))
+        return 1;
+
+    if (!options.sweepTrace.empty())
+        return RunSweep(options);
+
+    MemoryStorage mem ;
+    mem.LoadElf("program");
+    UncachedMem uncachedMem = UncachedMem (mem);
+    std::unique_ptr<TraceWriter> trace;
+    if (!options.traceFile.empty()) {
+        trace = std::make_unique<TraceWriter>(options.traceFile);
+        if (!trace->IsOpen())
+            return 1;
+    }
+
+    CustomExtensions custom;
+    if (!RegisterAccelerators(custom))
+        return 1;
+    const CustomExtensions* extensions = &custom;
+
+    switch (options.core)
+    {
+        case CoreModel::Pipelined:
+            return Run<PipelinedCpu>(uncachedMem, trace.get(), options, options.pipeline, options.predictor,
+                                     options.mulDiv, options.vector, extensions);
+        case CoreModel::Superscalar:
+            return Run<SuperscalarCpu>(uncachedMem, trace.get(), options, options.superscalar, options.predictor,
+                                       options.storeBufferEntries, options.mulDiv, options.vector, extensions);
+        case CoreModel::OutOfOrder:
+            return Run<OooCpu>(uncachedMem, trace.get(), options, options.ooo, options.predictor,
+                               options.storeBufferEntries, options.mulDiv, options.vector, extensions);
+        case CoreModel::Simple:
+            break;
     }
+    return Run<Cpu>(uncachedMem, trace.get(), options, options.storeBufferEntries, options.mulDiv,
+                    options.vector, extensions, options.fusion);
 }
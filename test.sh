@@ -19,10 +19,10 @@ case $testResponse in
 	         auipc
 	         beq bge bgeu blt bltu bne
 	         j jal jalr
-	         lw
+	         lb lbu lh lhu lw
 	         lui
 	         or ori
-	         sw
+	         sb sh sw
 	         sll slli
 	         slt slti
 	         sra srai
@@ -31,6 +31,21 @@ case $testResponse in
 	         xor xori
 	         bpred_bht bpred_j bpred_ras
 	         cache
+	         fusion
+	         fence
+	         amoadd_w amoand_w amomax_w amomaxu_w amomin_w amominu_w amoor_w amoswap_w amoxor_w
+	         lrsc
+	         mul mulh mulhsu mulhu
+	         div divu rem remu
+	         rvc
+	         csr
+	         zba zbb
+	         rvv
+	         custom
+	     );
+       # these run on the RV64 build of the simulator
+       rv64_tests=(
+	         rv64
 	     );
        vmh_dir=programs/build/assembly/bin;;
     2) asm_tests=(
@@ -59,18 +74,26 @@ wait_time=3
 # create bsim log dir
 mkdir -p ${log_dir}
 
-# run each test
-for test_name in ${asm_tests[@]}; do
+# run each test; a test that was not compiled is skipped and fails the run
+missing=0
+for test_name in ${asm_tests[@]} ${rv64_tests[@]}; do
 	echo "-- benchmark test: ${test_name} --"
 	# copy vmh file
 	mem_file=${vmh_dir}/${test_name}.riscv
 	if [ ! -f $mem_file ]; then
-		echo "ERROR: $mem_file does not exit, you need to first compile"
-		exit
+		echo "ERROR: $mem_file does not exist, you need to first compile"
+		missing=1
+		continue
 	fi
     ln -sf ${mem_file} program 
 
 	# run test
-    ${exe_file} > ${log_dir}/${test_name}.log  # run bsim, redirect outputs to log
+    test_exe=${exe_file}
+    if [[ " ${rv64_tests[@]} " == *" ${test_name} "* ]]; then
+        test_exe=${exe_file}64  # riscv_sim -> riscv_sim64
+    fi
+    ${test_exe} > ${log_dir}/${test_name}.log  # run bsim, redirect outputs to log
     sleep ${wait_time} # wait bsim to setup
 done
+
+exit ${missing}